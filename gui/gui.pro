@@ -6,5 +6,5 @@ QT += core gui network
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
 # Input
-HEADERS += main.h simulator.h protocol.h
-SOURCES += main.cpp simulator.cpp
+HEADERS += main.h simulator.h protocol.h cellpack.h shmring.h
+SOURCES += main.cpp simulator.cpp cellpack.c shmring.c
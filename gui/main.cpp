@@ -23,7 +23,7 @@ ConfigWidget::ConfigWidget (ExecuteAndProcessOutput * executorHandle) :
 	mainLayout->addLayout (programConfig);
 
 	programAddress = new QLineEdit;
-	programAddress->setPlaceholderText ("Simulator network address");
+	programAddress->setPlaceholderText ("Simulator network address (or local socket path)");
 	programConfig->addWidget (programAddress, 1);
 
 	programPort = new QSpinBox;
@@ -38,6 +38,10 @@ ConfigWidget::ConfigWidget (ExecuteAndProcessOutput * executorHandle) :
 	programUpdateRate->setToolTip ("Minimum time between screen updates (msec)");
 	programConfig->addWidget (programUpdateRate);
 
+	programDropFrames = new QCheckBox ("Drop");
+	programDropFrames->setToolTip ("With no minimum time between updates, only display the latest frame at each screen refresh");
+	programConfig->addWidget (programDropFrames);
+
 	programSamplingRate = new QSpinBox;
 	programSamplingRate->setRange (1, 1000000);
 	programSamplingRate->setValue (1);
@@ -79,6 +83,10 @@ ConfigWidget::ConfigWidget (ExecuteAndProcessOutput * executorHandle) :
 	saveToFile->setToolTip ("Save...");
 	wireworldMapConfig->addWidget (saveToFile);
 
+	droppedFrames = new QLabel;
+	droppedFrames->setToolTip ("Frames not displayed");
+	wireworldMapConfig->addWidget (droppedFrames);
+
 	setState (Stopped);
 
 	// Signals
@@ -102,6 +110,8 @@ ConfigWidget::ConfigWidget (ExecuteAndProcessOutput * executorHandle) :
 			this, SLOT (onInitSuccess ()));
 	QObject::connect (executor, SIGNAL (connectionEnded ()),
 			this, SLOT (onConnectionEnded ()));
+	QObject::connect (executor, SIGNAL (framesDropped (int)),
+			this, SLOT (onFramesDropped (int)));
 }
 
 void ConfigWidget::setState (SimulatorState state) {
@@ -111,6 +121,7 @@ void ConfigWidget::setState (SimulatorState state) {
 	programAddress->setEnabled (enableSettings);
 	programPort->setEnabled (enableSettings);
 	programUpdateRate->setEnabled (enableSettings);
+	programDropFrames->setEnabled (enableSettings);
 	programSamplingRate->setEnabled (enableSettings);
 	
 	programInit->setEnabled (enableSettings);
@@ -136,8 +147,13 @@ void ConfigWidget::saveFile (void) {
 	QString file = QFileDialog::getSaveFileName (
 			this, "Save Image", QDir::currentPath (),
 			"Images (*.png *.jpg *.xpm *.gif)");
-	if (file != QString ())
-		emit requestSaveToFile (file);
+	if (file == QString ())
+		return;
+
+	// The map, and not the widget which may show a part of it or a level of detail
+	QString error = executor->saveMap (file);
+	if (error != QString ())
+		QMessageBox::warning (this, "Unable to save the map", error);
 }
 
 void ConfigWidget::initClicked (void) {
@@ -145,7 +161,8 @@ void ConfigWidget::initClicked (void) {
 		setState (Initializing);
 		executor->init ( programAddress->text (), programPort->value (),
 				mapName->text (), cellSize->value (),
-				programUpdateRate->value (), programSamplingRate->value ());
+				programUpdateRate->value (), programSamplingRate->value (),
+				programDropFrames->isChecked ());
 	}
 }
 
@@ -179,6 +196,151 @@ void ConfigWidget::onError (QString errorText) {
 
 void ConfigWidget::onInitSuccess (void) { setState (Paused); } 
 void ConfigWidget::onConnectionEnded (void) { setState (Stopped); }
+void ConfigWidget::onFramesDropped (int total) {
+	droppedFrames->setText (total > 0 ? QString ("%1 dropped").arg (total) : QString ());
+}
+
+/* ------ WireWorldDrawZone ------ */
+WireWorldDrawZone::WireWorldDrawZone (ExecuteAndProcessOutput * executor) : zoom (0), level (0) {
+	setSizePolicy (QSizePolicy::Expanding, QSizePolicy::Expanding);
+	setMinimumSize (100, 100);
+
+	QObject::connect (executor, SIGNAL (mapLoaded (QSize)),
+			this, SLOT (setMapSize (QSize)));
+	QObject::connect (executor, SIGNAL (redraw (QPixmap)),
+			this, SLOT (updateWireworld (QPixmap)));
+}
+
+void WireWorldDrawZone::setMapSize (QSize size) {
+	// Back to the whole map, and tell it to the new simulation
+	mapSize = size;
+	zoom = 0;
+	viewport = QRect ();
+	level = 0;
+	emit viewportChanged (viewport, level);
+	updateViewport ();
+}
+
+void WireWorldDrawZone::updateWireworld (QPixmap pixmap) {
+	// Bufferise image
+	buffer = pixmap;
+	update ();
+}
+
+QRect WireWorldDrawZone::sourceRect (void) const {
+	QRect map (QPoint (0, 0), mapSize);
+	if (zoom == 0)
+		return map;
+	QRect cells (origin, QSize ((width () + zoom - 1) / zoom, (height () + zoom - 1) / zoom));
+	return cells.intersected (map);
+}
+
+QRect WireWorldDrawZone::targetRect (const QRect & source) const {
+	QSize size = source.size () * zoom;
+	if (zoom == 0) {
+		// Integer scaling if the map is smaller than the widget, to keep cells square
+		int factor = qMin (width () / mapSize.width (), height () / mapSize.height ());
+		if (factor >= 1)
+			size = mapSize * factor;
+		else
+			size = mapSize.scaled (this->size (), Qt::KeepAspectRatio);
+	}
+
+	// Centered if smaller than the widget
+	return QRect (QPoint (qMax (0, (width () - size.width ()) / 2),
+				qMax (0, (height () - size.height ()) / 2)), size);
+}
+
+QRectF WireWorldDrawZone::bufferRect (const QRect & source) const {
+	qreal xScale = (qreal) buffer.width () / mapSize.width ();
+	qreal yScale = (qreal) buffer.height () / mapSize.height ();
+	return QRectF (source.x () * xScale, source.y () * yScale,
+			source.width () * xScale, source.height () * yScale);
+}
+
+void WireWorldDrawZone::updateViewport (void) {
+	if (mapSize.isEmpty ())
+		return;
+
+	if (zoom > 0) {
+		QSize cells ((width () + zoom - 1) / zoom, (height () + zoom - 1) / zoom);
+		origin.setX (qBound (0, origin.x (), qMax (0, mapSize.width () - cells.width ())));
+		origin.setY (qBound (0, origin.y (), qMax (0, mapSize.height () - cells.height ())));
+	}
+
+	// The whole map is displayed : no viewport, and a level of detail if it has more cells
+	// than the widget has pixels (blocks of 2^level cells of a side)
+	QRect cells = sourceRect ();
+	int cellsLevel = 0;
+	if (zoom == 0) {
+		cells = QRect ();
+		while (((mapSize.width () - 1) >> cellsLevel) + 1 > width () ||
+				((mapSize.height () - 1) >> cellsLevel) + 1 > height ())
+			++cellsLevel;
+	}
+	if (cells != viewport || cellsLevel != level) {
+		viewport = cells;
+		level = cellsLevel;
+		emit viewportChanged (viewport, level);
+	}
+}
+
+void WireWorldDrawZone::paintEvent (QPaintEvent * event) {
+	(void) event;
+	if (buffer.isNull () || mapSize.isEmpty ())
+		return;
+	QPainter painter (this);
+	QRect source = sourceRect ();
+	painter.drawPixmap (QRectF (targetRect (source)), buffer, bufferRect (source));
+}
+
+void WireWorldDrawZone::resizeEvent (QResizeEvent * event) {
+	(void) event;
+	updateViewport ();
+}
+
+void WireWorldDrawZone::wheelEvent (QWheelEvent * event) {
+	if (mapSize.isEmpty ())
+		return;
+
+	// Cell under the mouse, which stays under it
+	QRect source = sourceRect ();
+	QRect target = targetRect (source);
+	QPointF cell = source.topLeft () + QPointF (event->pos () - target.topLeft ()) *
+		source.width () / qMax (1, target.width ());
+
+	if (event->delta () > 0) {
+		zoom = zoom == 0 ? qMax (1, target.width () / qMax (1, source.width ())) * 2 : zoom * 2;
+		zoom = qMin (zoom, 64);
+	} else if (zoom > 0) {
+		zoom /= 2;
+	}
+	if (zoom > 0)
+		origin = (cell - QPointF (event->pos ()) / zoom).toPoint ();
+
+	updateViewport ();
+	update ();
+}
+
+void WireWorldDrawZone::mousePressEvent (QMouseEvent * event) {
+	dragPosition = event->pos ();
+	dragOrigin = origin;
+}
+
+void WireWorldDrawZone::mouseMoveEvent (QMouseEvent * event) {
+	if (zoom > 0 && (event->buttons () & Qt::LeftButton)) {
+		origin = dragOrigin - (event->pos () - dragPosition) / zoom;
+		updateViewport ();
+		update ();
+	}
+}
+
+void WireWorldDrawZone::mouseDoubleClickEvent (QMouseEvent * event) {
+	(void) event;
+	zoom = 0;
+	updateViewport ();
+	update ();
+}
 
 /* ------ main ------ */
 int main (int argc, char * argv[]) {
@@ -198,8 +360,8 @@ int main (int argc, char * argv[]) {
 	WireWorldDrawZone * wireworldDrawer = new WireWorldDrawZone (executor);
 	mainLayout->addWidget (wireworldDrawer, 1);
 
-	QObject::connect (configWidget, SIGNAL (requestSaveToFile (QString)),
-			wireworldDrawer, SLOT (saveBuffer (QString)));
+	QObject::connect (wireworldDrawer, SIGNAL (viewportChanged (QRect, int)),
+			executor, SLOT (setViewport (QRect, int)));
 
 	window->show ();
 	return app.exec ();
@@ -10,6 +10,9 @@
 #include <QCheckBox>
 #include <QGroupBox>
 #include <QLabel>
+#include <QPainter>
+#include <QWheelEvent>
+#include <QMouseEvent>
 
 #include "simulator.h"
 
@@ -26,9 +29,6 @@ class ConfigWidget : public QGroupBox {
 
 		ConfigWidget (ExecuteAndProcessOutput * executorHandle);
 
-	signals:
-		void requestSaveToFile (QString file);
-
 	private slots:
 		void setState (SimulatorState state);
 
@@ -42,6 +42,7 @@ class ConfigWidget : public QGroupBox {
 		void onError (QString errorText);
 		void onInitSuccess (void);
 		void onConnectionEnded (void);
+		void onFramesDropped (int total);
 
 	private:
 		SimulatorState mState;
@@ -55,6 +56,7 @@ class ConfigWidget : public QGroupBox {
 
 		QSpinBox * programSamplingRate;
 		QSpinBox * programUpdateRate;
+		QCheckBox * programDropFrames;
 
 		QPushButton * programInit;
 		QPushButton * programStart;
@@ -66,60 +68,60 @@ class ConfigWidget : public QGroupBox {
 		QPushButton * openFromFile;
 		QSpinBox * cellSize;
 		QPushButton * saveToFile;
+		QLabel * droppedFrames;
 };
 
 /*
- * Auto scaled image viewer
+ * Image viewer, with zoom (mouse wheel) and pan (drag).
+ * By default the whole map is scaled to fit the widget ; zooming in shows a part of it, at an
+ * integer number of pixels per cell. The displayed cells are told to the simulator, so that it
+ * only updates them (an empty rectangle means the whole map).
  */
-class WireWorldDrawZone : public QLabel {
+class WireWorldDrawZone : public QWidget {
 	Q_OBJECT
 
 	public:
-		WireWorldDrawZone (ExecuteAndProcessOutput * executor) {
-			setAlignment (Qt::AlignCenter);
-			setSizePolicy (QSizePolicy::Expanding, QSizePolicy::Expanding);
+		WireWorldDrawZone (ExecuteAndProcessOutput * executor);
 
-			QObject::connect (executor, SIGNAL (redraw (QPixmap)),
-					this, SLOT (updateWireworld (QPixmap)));
-		}
+	signals:
+		void viewportChanged (QRect cells, int level);
 
 	public slots:
-		void updateWireworld (QPixmap pixmap) {
-			// Avoid absurd resizes
-			setMinimumSize (pixmap.size ());
-
-			// Bufferise image
-			buffer = pixmap;
-			updateScreen ();
-		}
-
-		void saveBuffer (QString fileName) {
-			buffer.save (fileName);
-		}
+		void setMapSize (QSize size);
+		void updateWireworld (QPixmap pixmap);
 
 	private:
-		void updateScreen (void) {
-			if (not buffer.isNull ()) {
-				QSize scaledSize (
-						(width () / buffer.width ()) * buffer.width (),
-						(height () / buffer.height ()) * buffer.height ());
-				
-				// Avoid a call to scaled() if same size
-				if (scaledSize != buffer.size ())
-					setPixmap (buffer.scaled (scaledSize, Qt::KeepAspectRatio));
-				else
-					setPixmap (buffer);
-			} else {
-				setPixmap (buffer);
-			}
-		}
-
-		void resizeEvent (QResizeEvent * event) {
-			(void) event;
-			updateScreen ();
-		}
+		/* Cells displayed, where they are drawn, and where they are in the buffer (which is
+		 * smaller than the map at a level of detail)
+		 */
+		QRect sourceRect (void) const;
+		QRect targetRect (const QRect & source) const;
+		QRectF bufferRect (const QRect & source) const;
+
+		/* Keeps the displayed cells in the map, and tells them and their level of detail if
+		 * they changed
+		 */
+		void updateViewport (void);
+
+		void paintEvent (QPaintEvent * event);
+		void resizeEvent (QResizeEvent * event);
+		void wheelEvent (QWheelEvent * event);
+		void mousePressEvent (QMouseEvent * event);
+		void mouseMoveEvent (QMouseEvent * event);
+		void mouseDoubleClickEvent (QMouseEvent * event);
 
 		QPixmap buffer;
+		QSize mapSize;
+
+		// Pixels per cell (0 to fit the widget), and first displayed cell
+		int zoom;
+		QPoint origin;
+
+		// Drag start
+		QPoint dragPosition, dragOrigin;
+
+		QRect viewport;
+		int level;
 };
 
 #endif
@@ -1,5 +1,12 @@
 #include "simulator.h"
 
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
 static QRgb wireworldColors[] = {
 	qRgb (0x10, 0x10, 0x10),
 	qRgb (0xA0, 0x50, 0x00),
@@ -23,11 +30,33 @@ static int getNearestState (QRgb color) {
 	return minIndex;
 }
 
+/* Image of cell states (one byte per cell), displayed with the wireworld colors */
+static QImage stateImage (QSize size) {
+	QImage image (size, QImage::Format_Indexed8);
+	image.setColorCount (4);
+	for (int i = 0; i < 4; ++i)
+		image.setColor (i, wireworldColors[i]);
+	return image;
+}
+
+/* Packs the states of an image (stateImage) in raw format, after 'offset' words of raw */
+static void packImage (const QImage & image, QVector< wireworld_message_t > & raw, int offset) {
+	raw.resize (offset);
+	raw.resize (offset + wireworldFrameMessageSize (image.width (), image.height ()));
+	raw.last () = 0;
+	for (int i = 0; i < image.height (); ++i)
+		cellPack (raw.data () + offset, (quint64) i * image.width (),
+				(const char *) image.constScanLine (i), image.width ());
+}
+
 /* ------ WireWorldMap ------ */
-WireWorldMap::WireWorldMap () {}
+WireWorldMap::WireWorldMap () :
+	lodLevel (0), lodDisplayed (false), activeCellsValid (false),
+	recordLevel (0), nextFrameFull (true) {}
 WireWorldMap::~WireWorldMap () {}
 
 QRect WireWorldMap::getRect (void) const { return internalMap.rect (); }
+const QImage & WireWorldMap::getCells (void) const { return internalMap; }
 
 bool WireWorldMap::inBounds (const QPoint & point) const {
 	return 0 <= point.x () && point.x () <= internalMap.width () &&
@@ -41,59 +70,115 @@ quint32 WireWorldMap::getRawMapSize (void) const {
 wireworld_message_t * WireWorldMap::getRawMap (void) const {
 	wireworld_message_t * rawMap = new wireworld_message_t [getRawMapSize ()];
 	if (rawMap != 0) {
-		// Extract map from image by matching colors with the palette
-		
-		// Iterators over bit-packed structure
-		quint32 messageIndex = 0;
-		int bitIndex = 0;
-
-		rawMap[0] = 0;
-		for (int i = 0; i < internalMap.height (); ++i) {
-			const QRgb * lineColors = (const QRgb *) internalMap.constScanLine (i);
-			for (int j = 0; j < internalMap.width (); ++j) {
-				// Set value
-				rawMap[messageIndex] |=
-					getNearestState (lineColors[j]) <<
-					(C_BIT_SIZE * bitIndex);
-
-				// Update iterators, and init next word if needed as we use or-ing
-				bitIndex++;
-				if (bitIndex == M_BIT_SIZE / C_BIT_SIZE) {
-					messageIndex++;
-					rawMap[messageIndex] = 0;
-					bitIndex = 0;
-				}
-			}
-		}
+		// Pack the states row by row
+		rawMap[getRawMapSize () - 1] = 0;
+		for (int i = 0; i < internalMap.height (); ++i)
+			cellPack (rawMap, (quint64) i * internalMap.width (),
+					(const char *) internalMap.constScanLine (i), internalMap.width ());
 	}
 	return rawMap;
 }
 
-void WireWorldMap::updateMap (QPoint topLeft, QPoint bottomRight, wireworld_message_t * data) {
-	// Iterators in bit-packed structure
-	quint32 messageIndex = 0;
-	int bitIndex = 0;
+void WireWorldMap::updateMap (QPoint topLeft, QPoint bottomRight, const wireworld_message_t * data) {
+	activeCellsValid = false;
 
-	// Update only rectangle
-	for (int i = topLeft.y (); i < bottomRight.y (); ++i) {
-		QRgb * lineColors = (QRgb *) internalMap.scanLine (i);
-		for (int j = topLeft.x (); j < bottomRight.x (); ++j) {
-			// Set value
-			wireworld_message_t cellValue = C_BIT_MASK & 
-				(data[messageIndex] >> (C_BIT_SIZE * bitIndex));
-			lineColors[j] = wireworldColors[cellValue];
-			
-			// Update counters
-			bitIndex++;
-			if (bitIndex == M_BIT_SIZE / C_BIT_SIZE) {
-				messageIndex++;
-				bitIndex = 0;
-			}
+	// The server sends the map again when leaving the level of detail
+	lodDisplayed = false;
+	applyRect (internalMap, 0, topLeft, bottomRight, data);
+}
+
+bool WireWorldMap::updateLod (quint32 level, QPoint topLeft, QPoint bottomRight,
+		const wireworld_message_t * data) {
+	if (level == 0 || level > LOD_MAX_LEVEL)
+		return false;
+
+	// Blocks of 2^level cells of a side, the last ones clipped by the map
+	QSize size (((internalMap.width () - 1) >> level) + 1, ((internalMap.height () - 1) >> level) + 1);
+	if (level != lodLevel || lodMap.size () != size) {
+		lodMap = stateImage (size);
+		lodMap.fill (C_INSULATOR);
+		lodLevel = level;
+		nextFrameFull = true;
+	}
+	if (topLeft.x () < 0 || topLeft.y () < 0 || topLeft.x () > bottomRight.x () ||
+			topLeft.y () > bottomRight.y () || bottomRight.x () > size.width () ||
+			bottomRight.y () > size.height ())
+		return false;
+
+	lodDisplayed = true;
+	applyRect (lodMap, level, topLeft, bottomRight, data);
+	return true;
+}
+
+void WireWorldMap::xorRawMap (quint32 index, const wireworld_message_t * data, quint32 count) {
+	const quint32 cellsPerMessage = M_BIT_SIZE / C_BIT_SIZE;
+	const quint32 nbCells = internalMap.width () * internalMap.height ();
+	activeCellsValid = false;
+	recordRun (0, index, data, count);
+
+	for (quint32 m = 0; m < count; ++m) {
+		wireworld_message_t bits = data[m];
+
+		// Only touch cells with a non null xor
+		for (quint32 c = 0; bits != 0; ++c, bits >>= C_BIT_SIZE) {
+			wireworld_message_t cellXor = bits & C_BIT_MASK;
+			quint32 cell = (index + m) * cellsPerMessage + c;
+			if (cellXor == 0 || cell >= nbCells)
+				continue;
+
+			*cellState (cell) ^= cellXor;
+		}
+	}
+}
+
+bool WireWorldMap::updateHeads (quint32 format, const wireworld_message_t * data, quint32 size) {
+	const quint32 nbCells = internalMap.width () * internalMap.height ();
+
+	if (not activeCellsValid)
+		findActiveCells ();
+
+	// Tails become wires, and heads become tails
+	for (int i = 0; i < tails.size (); ++i) {
+		*cellState (tails[i]) = C_WIRE;
+		recordCell (tails[i], C_TAIL ^ C_WIRE);
+	}
+	for (int i = 0; i < heads.size (); ++i) {
+		*cellState (heads[i]) = C_TAIL;
+		recordCell (heads[i], C_HEAD ^ C_TAIL);
+	}
+	tails.swap (heads);
+	heads.clear ();
+
+	// Decode new heads
+	if (format == H_LIST) {
+		for (quint32 i = 0; i < size; ++i)
+			heads.append (data[i]);
+	} else if (format == H_BITMAP) {
+		for (quint32 m = 0; m < size; ++m)
+			for (quint32 bits = data[m], b = 0; bits != 0; ++b, bits >>= 1)
+				if (bits & 1)
+					heads.append (m * M_BIT_SIZE + b);
+	} else {
+		return false;
+	}
+
+	// New heads must be wires
+	for (int i = 0; i < heads.size (); ++i) {
+		if (heads[i] >= nbCells || *cellState (heads[i]) != C_WIRE) {
+			activeCellsValid = false;
+			return false;
 		}
+		*cellState (heads[i]) = C_HEAD;
+		recordCell (heads[i], C_WIRE ^ C_HEAD);
 	}
+	return true;
 }
 
 bool WireWorldMap::fromImage (const QImage & image, int cellSize) {
+	activeCellsValid = false;
+	lodDisplayed = false;
+	nextFrameFull = true;
+
 	// Check size is valid
 	if (not resetImage (QSize (image.width () / cellSize, image.height () / cellSize)))
 		return false;
@@ -101,49 +186,157 @@ bool WireWorldMap::fromImage (const QImage & image, int cellSize) {
 	int cellMidOffset = cellSize / 2;
 
 	// Fill image with the sampled content of the source image (sampling factor : cellSize)
-	// Also format colors to the 4 color used
+	// Also convert colors to the nearest of the 4 states
 	for (int i = 0; i < internalMap.height (); ++i) {
-		QRgb * toLineColors =
-			reinterpret_cast< QRgb * > (internalMap.scanLine (i));
+		uchar * toLineStates = internalMap.scanLine (i);
 		const QRgb * fromLineColors = 
 			reinterpret_cast< const QRgb * > (image.constScanLine (i * cellSize + cellMidOffset));
-		for (int j = 0; j < internalMap.width (); ++j) {
-			int state = getNearestState (fromLineColors[j * cellSize + cellMidOffset]);
-			toLineColors[j] = wireworldColors[state];
-		}
+		for (int j = 0; j < internalMap.width (); ++j)
+			toLineStates[j] = getNearestState (fromLineColors[j * cellSize + cellMidOffset]);
 	}
 
 	return true;
 }
 
 QPixmap WireWorldMap::toImage (void) const {
-	return QPixmap::fromImage (internalMap);
+	return QPixmap::fromImage (lodDisplayed ? lodMap : internalMap);
+}
+
+CompactFrame WireWorldMap::takeFrame (void) {
+	CompactFrame frame;
+	const QImage & image = lodDisplayed ? lodMap : internalMap;
+	frame.level = lodDisplayed ? lodLevel : 0;
+	frame.size = image.size ();
+	frame.complete = true;
+
+	// The recorded changes, unless they are not those of the displayed image
+	frame.full = nextFrameFull || frame.level != recordLevel || frame.size != lastFrameSize;
+	if (frame.full) {
+		frame.runs.append (0);
+		frame.runs.append (wireworldFrameMessageSize (image.width (), image.height ()));
+		packImage (image, frame.runs, 2);
+	} else {
+		frame.runs.swap (pendingRuns);
+	}
+	pendingRuns.clear ();
+	recordLevel = frame.level;
+	lastFrameSize = frame.size;
+	nextFrameFull = false;
+	return frame;
+}
+
+void WireWorldMap::resetFrames (void) {
+	nextFrameFull = true;
+}
+
+uchar * WireWorldMap::cellState (quint32 cell) {
+	return internalMap.scanLine (cell / internalMap.width ()) + cell % internalMap.width ();
+}
+
+void WireWorldMap::applyRect (QImage & image, quint32 level, QPoint topLeft,
+		QPoint bottomRight, const wireworld_message_t * data) {
+	const quint32 cellsPerMessage = M_BIT_SIZE / C_BIT_SIZE;
+	int width = bottomRight.x () - topLeft.x ();
+
+	// Row by row : the changes are xored states, from the first cell of the first word
+	QByteArray states (width, C_INSULATOR), changes;
+	QVector< wireworld_message_t > words;
+	for (int i = topLeft.y (); i < bottomRight.y (); ++i) {
+		uchar * lineStates = image.scanLine (i) + topLeft.x ();
+		cellUnpack (data, (quint64) (i - topLeft.y ()) * width, states.data (), width);
+
+		quint64 first = (quint64) i * image.width () + topLeft.x ();
+		int offset = first % cellsPerMessage;
+		changes.fill (0, offset + width);
+		bool changed = false;
+		for (int j = 0; j < width; ++j) {
+			changes[offset + j] = lineStates[j] ^ states[j];
+			changed = changed || lineStates[j] != states[j];
+			lineStates[j] = states[j];
+		}
+
+		if (changed) {
+			words.fill (0, (changes.size () + cellsPerMessage - 1) / cellsPerMessage);
+			cellPack (words.data (), 0, changes.constData (), changes.size ());
+			recordRun (level, first / cellsPerMessage, words.constData (), words.size ());
+		}
+	}
+}
+
+void WireWorldMap::recordRun (quint32 level, quint32 index, const wireworld_message_t * data,
+		quint32 count) {
+	// Past the size of the map, a full frame is smaller
+	if (level != recordLevel ||
+			(quint32) pendingRuns.size () + count + 2 > getRawMapSize () + 2)
+		nextFrameFull = true;
+	if (nextFrameFull)
+		return;
+
+	pendingRuns.append (index);
+	pendingRuns.append (count);
+	for (quint32 m = 0; m < count; ++m)
+		pendingRuns.append (data[m]);
+}
+
+void WireWorldMap::recordCell (quint32 cell, quint32 cellXor) {
+	const quint32 cellsPerMessage = M_BIT_SIZE / C_BIT_SIZE;
+	wireworld_message_t word = cellXor << (C_BIT_SIZE * (cell % cellsPerMessage));
+	recordRun (0, cell / cellsPerMessage, &word, 1);
+}
+
+void WireWorldMap::findActiveCells (void) {
+	heads.clear ();
+	tails.clear ();
+	for (int i = 0; i < internalMap.height (); ++i) {
+		const uchar * lineStates = internalMap.constScanLine (i);
+		for (int j = 0; j < internalMap.width (); ++j) {
+			if (lineStates[j] == C_HEAD)
+				heads.append (j + i * internalMap.width ());
+			else if (lineStates[j] == C_TAIL)
+				tails.append (j + i * internalMap.width ());
+		}
+	}
+	activeCellsValid = true;
 }
 
 bool WireWorldMap::resetImage (QSize size) {
 	if (size.width () == 0 || size.height () == 0)
 		return false;
 
-	internalMap = QImage (size, QImage::Format_RGB32);
+	internalMap = stateImage (size);
 	return true;
 }
 
 /* -------- PixmapBuffer ------- */
-PixmapBuffer::PixmapBuffer () {
+
+// Display refresh interval when the latest frame wins (msec)
+#define REFRESH_INTERVAL 16
+
+PixmapBuffer::PixmapBuffer () : outputLevel (0), outputComplete (true), droppedFrames (0) {
 	QObject::connect (&timer, SIGNAL (timeout ()),
 			this, SLOT (timerTicked ()));
 }
 
-void PixmapBuffer::reset (int maxCreditAllowed, int interval) {
-	// Get mode
-	isFullSpeed = (interval <= 0);
+void PixmapBuffer::reset (const QImage & initialMap, int maxCreditAllowed, int interval,
+		bool latestFrameWins) {
+	// Get mode : the latest frame wins only makes sense at full speed, and it is drawn by the
+	// timer at the refresh interval
+	isLatestFrameWins = latestFrameWins && interval <= 0;
+	isFullSpeed = (interval <= 0) && not isLatestFrameWins;
 	
 	// Reset timer if we need it
-	if (not isFullSpeed)
+	if (isLatestFrameWins)
+		timer.setInterval (REFRESH_INTERVAL);
+	else if (not isFullSpeed)
 		timer.setInterval (interval);
 	
 	// Clear the queue, in the case there are left-overs from a previous simulation
-	pixmapQueue.clear ();
+	frameQueue.clear ();
+	outputMap = initialMap;
+	outputLevel = 0;
+	outputComplete = true;
+	droppedFrames = 0;
+	emit framesDropped (0);
 	
 	// Start paused (stepmode)
 	isInStepMode = true;
@@ -153,13 +346,17 @@ void PixmapBuffer::reset (int maxCreditAllowed, int interval) {
 	emit hasCredit (maxCreditAllowed);
 }
 
-bool PixmapBuffer::pixmapReady (QPixmap pixmap) {
+bool PixmapBuffer::frameReady (const CompactFrame & frame) {
 	// Check credit system is respected
-	if (pixmapQueue.size () == maxCredits)
+	if (frameQueue.size () == maxCredits)
 		return false;
 
-	// Queue pixmap (even in fullspeed mode)
-	pixmapQueue.enqueue (pixmap);
+	// The frame waiting for the next refresh is replaced
+	if (isLatestFrameWins && not isInStepMode && not frameQueue.isEmpty ())
+		dropFrame ();
+
+	// Queue frame (even in fullspeed mode)
+	frameQueue.enqueue (frame);
 
 	if (isFullSpeed) {
 		// In fullspeed, we redraw each time a frame arrives (and we are not paused).
@@ -187,9 +384,14 @@ void PixmapBuffer::start (void) {
 		// Flush all data stored in buffer (redraws), to allow the redraw-on-frame-reception
 		// to work (if we do not do this, we are blocked as the buffer might be full and no credit
 		// is given).
-		while (not pixmapQueue.isEmpty ())
+		while (not frameQueue.isEmpty ())
 			outputPixmap ();
 	} else {
+		// Only the latest of the frames buffered during the pause is worth drawing
+		if (isLatestFrameWins)
+			while (frameQueue.size () > 1)
+				dropFrame ();
+
 		// Restarts timer if we need it
 		timer.start ();
 	}
@@ -207,16 +409,23 @@ void PixmapBuffer::stop (void) {
 void PixmapBuffer::step (void) {
 	// In every mode, redraw if we are in paused mode and there is a ready frame.
 	// Do nothing (no error) if no frame is here, or not paused (should not arrive).
-	if (isInStepMode && not pixmapQueue.empty ())
+	if (isInStepMode && not frameQueue.empty ())
 		outputPixmap ();
 }
 
+bool PixmapBuffer::outputCells (QImage & map) const {
+	if (outputLevel != 0 || not outputComplete)
+		return false;
+	map = outputMap;
+	return true;
+}
+
 void PixmapBuffer::timerTicked (void) {
 	if (not isFullSpeed) {
 		// If we are using timer-based redraw only, try to redraw the screen.
 		// If no frame is ready, stop the timer, which will be restarted when a frame arrives
 		// to resume normal working state.
-		if (not pixmapQueue.isEmpty ())
+		if (not frameQueue.isEmpty ())
 			outputPixmap ();
 		else
 			timer.stop ();
@@ -226,12 +435,66 @@ void PixmapBuffer::timerTicked (void) {
 void PixmapBuffer::outputPixmap (void) {
 	// Extract a frame from the queue, and give a credit to sender to allow
 	// it to send another frame.
-	emit canRedraw (pixmapQueue.dequeue ());
+	applyFrame (frameQueue.dequeue ());
+
+	// Only now render it
+	emit canRedraw (QPixmap::fromImage (outputMap));
+	emit hasCredit (1);
+}
+
+void PixmapBuffer::dropFrame (void) {
+	// Its changes are still needed by the next frames, but it is not rendered
+	applyFrame (frameQueue.dequeue ());
+	emit framesDropped (++droppedFrames);
 	emit hasCredit (1);
 }
 
+void PixmapBuffer::applyFrame (const CompactFrame & frame) {
+	const quint32 cellsPerMessage = M_BIT_SIZE / C_BIT_SIZE;
+	int width = frame.size.width ();
+
+	if (frame.full) {
+		// The whole map
+		if (frame.size != outputMap.size ())
+			outputMap = stateImage (frame.size);
+		outputLevel = frame.level;
+		outputComplete = frame.complete;
+		for (int y = 0; y < frame.size.height () && frame.runs.size () > 2; ++y)
+			cellUnpack (frame.runs.constData () + 2, (quint64) y * width,
+					(char *) outputMap.scanLine (y), width);
+		return;
+	}
+	if (frame.level != outputLevel || frame.size != outputMap.size ())
+		return; // Not changes of the output map (frames follow a full one)
+	outputComplete = frame.complete;
+
+	// Only the changed cells
+	const quint64 nbCells = (quint64) width * frame.size.height ();
+	int i = 0;
+	while (i + 2 <= frame.runs.size ()) {
+		quint64 index = frame.runs[i];
+		int count = frame.runs[i + 1];
+		i += 2;
+		for (int m = 0; m < count; ++m) {
+			wireworld_message_t bits = frame.runs[i + m];
+			for (quint32 c = 0; bits != 0; ++c, bits >>= C_BIT_SIZE) {
+				quint64 cell = (index + m) * cellsPerMessage + c;
+				if ((bits & C_BIT_MASK) != 0 && cell < nbCells)
+					outputMap.scanLine (cell / width)[cell % width] ^= bits & C_BIT_MASK;
+			}
+		}
+		i += count;
+	}
+}
+
 /* ------ ExecuteAndProcessOutput ------ */
-ExecuteAndProcessOutput::ExecuteAndProcessOutput () {
+ExecuteAndProcessOutput::ExecuteAndProcessOutput () :
+	mViewportLevel (0), mMapComplete (true), mLocalSocket (-1), mLocalNotifier (0),
+	mNotifyFd (-1), mWakeFd (-1), mRingNotifier (0), mRingPayload (0)
+{
+	mRing.base = 0;
+	mRing.data = 0;
+
 	QObject::connect (&mSocket, SIGNAL (error (QAbstractSocket::SocketError)),
 			this, SLOT (onSocketError ()));
 	QObject::connect (&mSocket, SIGNAL (connected ()),
@@ -244,12 +507,14 @@ ExecuteAndProcessOutput::ExecuteAndProcessOutput () {
 			this, SLOT (bufferSaidRedraw (QPixmap)));
 	QObject::connect (&mPixmapBuffer, SIGNAL (hasCredit (int)),
 			this, SLOT (sendFrameRequest (int)));
+	QObject::connect (&mPixmapBuffer, SIGNAL (framesDropped (int)),
+			this, SIGNAL (framesDropped (int)));
 }
 
 void ExecuteAndProcessOutput::init (
 		QString host, int port,
 		QString mapFile, int cellSize,
-		int updateRate, int samplingRate) {
+		int updateRate, int samplingRate, bool dropFrames) {
 	// Load from file
 	QImage image (mapFile);
 
@@ -272,13 +537,29 @@ void ExecuteAndProcessOutput::init (
 	// Save parameters for later initialization
 	mUpdateRate = updateRate;
 	mSamplingRate = samplingRate;
+	mDropFrames = dropFrames;
 
 	// Init decoding automaton
 	mDecodingStep = WaitingHeader;
 	mRequestedDataSize = 1;
-
-	// Start Tcp
-	mSocket.connectToHost (host, port);
+	mFeatures = 0;
+	mInitAcknowledged = false;
+	mPendingCredits = 0;
+	mMapComplete = true;
+
+	// Start on the local socket if there is one, Tcp otherwise
+	closeLocal ();
+	mLocalSocket = connectLocal (host, port);
+	if (mLocalSocket != -1) {
+		mLocalNotifier = new QSocketNotifier (mLocalSocket, QSocketNotifier::Read, this);
+		QObject::connect (mLocalNotifier, SIGNAL (activated (int)),
+				this, SLOT (localSocketReadable ()));
+		hasConnected ();
+	} else if (host.startsWith ('/')) {
+		abort (QString ("Unable to connect to local socket \"%1\"").arg (host));
+	} else {
+		mSocket.connectToHost (host, port);
+	}
 }
 
 /* Execution control functions */
@@ -297,6 +578,20 @@ void ExecuteAndProcessOutput::step (void) {
 void ExecuteAndProcessOutput::stop (void) {
 	mPixmapBuffer.stop ();
 	mSocket.close ();
+	closeLocal ();
+}
+
+QString ExecuteAndProcessOutput::saveMap (QString fileName) const {
+	// The output map, not the received one which may be frames ahead
+	QImage map;
+	if (not mPixmapBuffer.outputCells (map))
+		return "Only a part of the map is displayed, or a level of detail : "
+			"show the whole map, one pixel per cell or more, to save it";
+	if (map.isNull ())
+		return "No map is displayed";
+	if (not map.save (fileName))
+		return "Unable to write " + fileName;
+	return QString ();
 }
 
 void ExecuteAndProcessOutput::onSocketError (void) {
@@ -306,6 +601,7 @@ void ExecuteAndProcessOutput::onSocketError (void) {
 void ExecuteAndProcessOutput::onSocketDisconnected (void) {
 	mPixmapBuffer.stop ();
 	mSocket.close ();
+	closeLocal ();
 
 	// Signal gui if connection has been closed
 	emit connectionEnded ();
@@ -317,38 +613,101 @@ void ExecuteAndProcessOutput::bufferSaidRedraw (QPixmap pixmap) {
 }
 
 void ExecuteAndProcessOutput::sendFrameRequest (int nbRequests) {
-	const wireworld_message_t message = R_FRAME;
-	for (int i = 0; i < nbRequests; ++i)
-		writeInternal (&message, 1);
+	if (not mInitAcknowledged) {
+		// Wait to know if requests can be batched
+		mPendingCredits += nbRequests;
+	} else if (mFeatures & F_FRAME_BATCH) {
+		// Acknowledge the processed frames of the stream
+		wireworld_message_t message[2] = { R_FRAME_N, (wireworld_message_t) nbRequests };
+		writeInternal (message, 2);
+	} else {
+		const wireworld_message_t message = R_FRAME;
+		for (int i = 0; i < nbRequests; ++i)
+			writeInternal (&message, 1);
+	}
+}
+
+void ExecuteAndProcessOutput::setViewport (QRect cells, int level) {
+	mViewport = cells;
+	mViewportLevel = level;
+	if (mInitAcknowledged)
+		sendViewport ();
+}
+
+void ExecuteAndProcessOutput::sendViewport (void) {
+	if (mFeatures & F_VIEWPORT) {
+		wireworld_message_t message[6] = { R_VIEWPORT, 0, 0, 0, 0, 0 };
+		if (not mViewport.isEmpty ()) {
+			message[1] = mViewport.left ();
+			message[2] = mViewport.top ();
+			message[3] = mViewport.right () + 1;
+			message[4] = mViewport.bottom () + 1;
+		}
+		message[5] = qMin ((quint32) mViewportLevel, LOD_MAX_LEVEL);
+		writeInternal (message, mFeatures & F_LEVEL_OF_DETAIL ? 6 : 5);
+
+		// Cells out of the viewport (or all of them at a level of detail) are left behind
+		if (not mViewport.isEmpty () || (message[5] > 0 && (mFeatures & F_LEVEL_OF_DETAIL)))
+			mMapComplete = false;
+	}
+}
+
+void ExecuteAndProcessOutput::startStream (void) {
+	mInitAcknowledged = true;
+	if (not mViewport.isEmpty () || mViewportLevel > 0)
+		sendViewport ();
+
+	if (mFeatures & F_FRAME_BATCH) {
+		// Push mode : the server sends frames as long as the buffer has room, at the update rate
+		wireworld_message_t message[3];
+		message[0] = R_STREAM;
+		message[1] = mPendingCredits;
+		message[2] = mUpdateRate > 0 ? mUpdateRate * 1000 : 0;
+		writeInternal (message, 3);
+	} else {
+		sendFrameRequest (mPendingCredits);
+	}
+	mPendingCredits = 0;
 }
 
 void ExecuteAndProcessOutput::hasConnected (void) {
-	// If connected, send init request
-	wireworld_message_t message[4];
-	message[0] = R_INIT;
+	wireworld_message_t * data = mCellMap.getRawMap ();
+	quint32 dataSize = mCellMap.getRawMapSize ();
+
+	// If connected, send init request with the features we can decode.
+	// Guis opening the same circuit share its simulation, named after the map data.
+	wireworld_message_t message[6];
+	message[0] = R_INIT_EX;
 	message[1] = mCellMap.getRect ().width ();
 	message[2] = mCellMap.getRect ().height ();
 	message[3] = mSamplingRate;
-	writeInternal (message, 4);
+	message[4] = F_DELTA_UPDATE | F_HEADS_ONLY | F_LITTLE_ENDIAN | F_FRAME_BATCH | F_SHARED_SESSION |
+		F_VIEWPORT | F_LEVEL_OF_DETAIL;
+	if (mLocalSocket != -1)
+		message[4] |= F_SHARED_MEMORY;
+	message[5] = qHash (QByteArray::fromRawData ((const char *) data,
+				dataSize * sizeof (wireworld_message_t)));
+	writeInternal (message, 6);
 
 	// Send map data
-	wireworld_message_t * data = mCellMap.getRawMap ();
-	writeInternal (data, mCellMap.getRawMapSize ());
+	writeInternal (data, dataSize);
 	delete[] data;
 
 	// Correctly initialized, inform gui
 	emit initialized ();
 	
 	// And force redraw of initial map state.
+	emit mapLoaded (mCellMap.getRect ().size ());
 	emit redraw (mCellMap.toImage ());
 
 	// Then start reception buffer with a buffer of size 5
-	mPixmapBuffer.reset (5, mUpdateRate);
+	mCellMap.resetFrames ();
+	mPixmapBuffer.reset (mCellMap.getCells (), 5, mUpdateRate, mDropFrames);
 }
 
 void ExecuteAndProcessOutput::canReadData (void) {
 	// Run automaton until we do not have enough data to process
-	while ((quint32) mSocket.bytesAvailable () >= mRequestedDataSize * sizeof (wireworld_message_t)) {
+	while (bytesAvailable () >= mRequestedDataSize * sizeof (wireworld_message_t)) {
 		if (mDecodingStep == WaitingHeader) {
 			// Read one message to determine type.
 			wireworld_message_t messageType;
@@ -359,11 +718,25 @@ void ExecuteAndProcessOutput::canReadData (void) {
 				mDecodingStep = RectUpdateWaitingPos;
 				mRequestedDataSize = 4;
 			} else if (messageType == A_FRAME_END) {
-				// Extract pixmap and add to queue
-				if (not mPixmapBuffer.pixmapReady (mCellMap.toImage ()))
+				// Queue the changes of the frame, rendered when displayed
+				CompactFrame frame = mCellMap.takeFrame ();
+				frame.complete = mMapComplete;
+				if (not mPixmapBuffer.frameReady (frame))
 					abort ("Protocol error : credit not given");
 
 				// Do not change state and requestedSize, message with no payload
+			} else if (messageType == A_INIT_ACK) {
+				mDecodingStep = InitAckWaitingFeatures;
+				mRequestedDataSize = 1;
+			} else if (messageType == A_DELTA_UPDATE) {
+				mDecodingStep = DeltaUpdateWaitingSize;
+				mRequestedDataSize = 1;
+			} else if (messageType == A_HEADS_UPDATE) {
+				mDecodingStep = HeadsUpdateWaitingHeader;
+				mRequestedDataSize = 2;
+			} else if (messageType == A_LOD_UPDATE) {
+				mDecodingStep = LodUpdateWaitingPos;
+				mRequestedDataSize = 5;
 			} else {
 				abort ("Protocol error : unknown message type");
 			}
@@ -382,17 +755,113 @@ void ExecuteAndProcessOutput::canReadData (void) {
 					mPos2.x () - mPos1.x (),
 					mPos2.y () - mPos1.y ());
 		} else if (mDecodingStep == RectUpdateWaitingData) {
-			// Get data in a buffer
-			wireworld_message_t * buf = new wireworld_message_t [mRequestedDataSize];
-			readInternal (buf, mRequestedDataSize);
+			const wireworld_message_t * buf = readPayload (mRequestedDataSize);
 
-			// Check update validity
+			// Check update validity, and apply it
 			if (not mCellMap.inBounds (mPos1) || not mCellMap.inBounds (mPos2))
 				abort ("Protocol error : update out of bounds");
+			else
+				mCellMap.updateMap (mPos1, mPos2, buf);
+			releasePayload ();
+
+			// The whole map, sent again once the viewport is back to it
+			if (mViewport.isEmpty () && mPos1 == QPoint (0, 0) &&
+					QSize (mPos2.x (), mPos2.y ()) == mCellMap.getRect ().size ())
+				mMapComplete = true;
 
-			// Apply rect update
-			mCellMap.updateMap (mPos1, mPos2, buf);
-			delete[] buf;
+			// Return to wait message state
+			mDecodingStep = WaitingHeader;
+			mRequestedDataSize = 1;
+		} else if (mDecodingStep == InitAckWaitingFeatures) {
+			readInternal (&mFeatures, 1);
+			startStream ();
+
+			mDecodingStep = WaitingHeader;
+			mRequestedDataSize = 1;
+		} else if (mDecodingStep == DeltaUpdateWaitingSize) {
+			wireworld_message_t size;
+			readInternal (&size, 1);
+
+			if (size > 0) {
+				mDecodingStep = DeltaUpdateWaitingData;
+				mRequestedDataSize = size;
+			} else {
+				mDecodingStep = WaitingHeader;
+				mRequestedDataSize = 1;
+			}
+		} else if (mDecodingStep == DeltaUpdateWaitingData) {
+			const wireworld_message_t * buf = readPayload (mRequestedDataSize);
+
+			// Apply runs, checking they stay in the raw map
+			quint32 mapSize = mCellMap.getRawMapSize ();
+			quint32 index = 0, i = 0;
+			bool valid = true;
+			while (valid && i + 2 <= mRequestedDataSize) {
+				quint32 skip = buf[i], count = buf[i + 1];
+				i += 2;
+				valid = skip <= mapSize - index && count <= mapSize - index - skip &&
+					count <= mRequestedDataSize - i;
+				if (valid) {
+					index += skip;
+					mCellMap.xorRawMap (index, &buf[i], count);
+					index += count;
+					i += count;
+				}
+			}
+			releasePayload ();
+
+			if (not valid || i != mRequestedDataSize)
+				abort ("Protocol error : invalid delta update");
+
+			// Return to wait message state
+			mDecodingStep = WaitingHeader;
+			mRequestedDataSize = 1;
+		} else if (mDecodingStep == HeadsUpdateWaitingHeader) {
+			wireworld_message_t header[2];
+			readInternal (header, 2);
+			mHeadsFormat = header[0];
+
+			if (header[1] > 0) {
+				mDecodingStep = HeadsUpdateWaitingData;
+				mRequestedDataSize = header[1];
+			} else {
+				// No heads at all
+				if (not mCellMap.updateHeads (mHeadsFormat, 0, 0))
+					abort ("Protocol error : invalid heads update");
+				mDecodingStep = WaitingHeader;
+				mRequestedDataSize = 1;
+			}
+		} else if (mDecodingStep == HeadsUpdateWaitingData) {
+			const wireworld_message_t * buf = readPayload (mRequestedDataSize);
+			bool valid = mCellMap.updateHeads (mHeadsFormat, buf, mRequestedDataSize);
+			releasePayload ();
+			if (not valid)
+				abort ("Protocol error : invalid heads update");
+
+			// Return to wait message state
+			mDecodingStep = WaitingHeader;
+			mRequestedDataSize = 1;
+		} else if (mDecodingStep == LodUpdateWaitingPos) {
+			// Get level and sizes (in blocks)
+			wireworld_message_t header[5];
+			readInternal (header, 5);
+			mLodLevel = header[0];
+			mPos1.setX (header[1]);
+			mPos1.setY (header[2]);
+			mPos2.setX (header[3]);
+			mPos2.setY (header[4]);
+
+			// Wait for data
+			mDecodingStep = LodUpdateWaitingData;
+			mRequestedDataSize = wireworldFrameMessageSize (
+					mPos2.x () - mPos1.x (),
+					mPos2.y () - mPos1.y ());
+		} else if (mDecodingStep == LodUpdateWaitingData) {
+			const wireworld_message_t * buf = readPayload (mRequestedDataSize);
+			bool valid = mCellMap.updateLod (mLodLevel, mPos1, mPos2, buf);
+			releasePayload ();
+			if (not valid)
+				abort ("Protocol error : invalid level of detail update");
 
 			// Return to wait message state
 			mDecodingStep = WaitingHeader;
@@ -410,10 +879,23 @@ void ExecuteAndProcessOutput::writeInternal (
 	for (quint32 i = 0; i < nbMessages; ++i)
 		buffer[i] = qToBigEndian (messages[i]);
 
-	// Send all of it (qt should not block, it buffers instead)
+	// Send all of it (qt should not block, it buffers instead ; the local socket blocks)
 	const char * it = (const char *) buffer;
 	qint64 bytesToSend = nbMessages * sizeof (wireworld_message_t);
 	while (bytesToSend > 0) {
+		if (mLocalSocket != -1) {
+			ssize_t sent = ::send (mLocalSocket, it, bytesToSend, MSG_NOSIGNAL);
+			if (sent == -1 && errno == EINTR)
+				continue;
+			if (sent == -1) {
+				abort (QString ("Write error : ") + strerror (errno));
+				break;
+			}
+			bytesToSend -= sent;
+			it += sent;
+			continue;
+		}
+
 		qint64 sent = mSocket.write (it, bytesToSend);
 
 		// On error, abort connection.
@@ -437,6 +919,11 @@ void ExecuteAndProcessOutput::readInternal (
 	// Send all of it (qt should not block, it buffers instead)
 	char * it = (char *) buffer;
 	qint64 bytesToRead = nbMaxMessages * sizeof (wireworld_message_t);
+	if (mLocalSocket != -1) {
+		// Already received (see bytesAvailable)
+		readLocal (it, bytesToRead);
+		bytesToRead = 0;
+	}
 	while (bytesToRead > 0) {
 		qint64 read = mSocket.read (it, bytesToRead);
 		if (read == -1) {
@@ -454,9 +941,14 @@ void ExecuteAndProcessOutput::readInternal (
 		it += read;
 	}
 
-	// Convert endianness
-	for (quint32 i = 0; i < nbMaxMessages; ++i)
-		messages[i] = qFromBigEndian (buffer[i]);
+	// Convert endianness (answers after A_INIT_ACK may be little endian)
+	if (mFeatures & F_LITTLE_ENDIAN) {
+		for (quint32 i = 0; i < nbMaxMessages; ++i)
+			messages[i] = qFromLittleEndian (buffer[i]);
+	} else {
+		for (quint32 i = 0; i < nbMaxMessages; ++i)
+			messages[i] = qFromBigEndian (buffer[i]);
+	}
 
 	delete[] buffer;
 }
@@ -464,6 +956,168 @@ void ExecuteAndProcessOutput::readInternal (
 void ExecuteAndProcessOutput::abort (QString error) {
 	emit errored (error);
 	mSocket.abort ();
+	closeLocal ();
 	mPixmapBuffer.stop ();
 }
 
+quint64 ExecuteAndProcessOutput::bytesAvailable (void) const {
+	if (mLocalSocket == -1)
+		return mSocket.bytesAvailable ();
+	return mLocalInput.size () + (mRing.base != 0 ? shmRingReadable (&mRing) : 0);
+}
+
+const wireworld_message_t * ExecuteAndProcessOutput::readPayload (quint32 nbMessages) {
+	bool hostOrder = (mFeatures & F_LITTLE_ENDIAN) ?
+		Q_BYTE_ORDER == Q_LITTLE_ENDIAN : Q_BYTE_ORDER == Q_BIG_ENDIAN;
+	if (mLocalSocket != -1 && mRing.base != 0 && mLocalInput.isEmpty () && hostOrder) {
+		// Contiguous, as the ring is mapped twice
+		mRingPayload = (quint64) nbMessages * sizeof (wireworld_message_t);
+		return (const wireworld_message_t *) shmRingPeek (&mRing);
+	}
+	mPayload.resize (nbMessages);
+	readInternal (mPayload.data (), nbMessages);
+	return mPayload.constData ();
+}
+
+void ExecuteAndProcessOutput::releasePayload (void) {
+	if (mRingPayload > 0 && mRing.base != 0)
+		consumeRing (mRingPayload);
+	mRingPayload = 0;
+}
+
+/* Local connection */
+int ExecuteAndProcessOutput::connectLocal (QString host, int port) {
+	struct sockaddr_un addr;
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	if (host.startsWith ('/')) {
+		QByteArray path = QFile::encodeName (host);
+		if ((size_t) path.size () >= sizeof (addr.sun_path))
+			return -1;
+		memcpy (addr.sun_path, path.constData (), path.size ());
+	} else if (host == "localhost" || QHostAddress (host) == QHostAddress::LocalHost ||
+			QHostAddress (host) == QHostAddress::LocalHostIPv6) {
+		snprintf (addr.sun_path, sizeof (addr.sun_path), LOCAL_SOCKET_PATH, port);
+	} else {
+		return -1;
+	}
+
+	// A server not listening there is reached through Tcp
+	int sock = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock == -1)
+		return -1;
+	if (::connect (sock, (const struct sockaddr *) &addr, sizeof (addr)) == -1) {
+		::close (sock);
+		return -1;
+	}
+	return sock;
+}
+
+void ExecuteAndProcessOutput::localSocketReadable (void) {
+	bool ended = false;
+	while (mLocalSocket != -1) {
+		char buffer[4096];
+		char control[CMSG_SPACE (3 * sizeof (int))];
+		struct iovec iov = { buffer, sizeof (buffer) };
+		struct msghdr msg;
+		memset (&msg, 0, sizeof (msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof (control);
+
+		ssize_t res = recvmsg (mLocalSocket, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				abort (QString ("Read error : ") + strerror (errno));
+				return;
+			}
+			break;
+		} else if (res == 0) {
+			ended = true;
+			break;
+		}
+		mLocalInput.append (buffer, res);
+
+		// File descriptors of the ring, with A_INIT_ACK
+		struct cmsghdr * cmsg = CMSG_FIRSTHDR (&msg);
+		if (cmsg != 0 && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+				cmsg->cmsg_len == CMSG_LEN (3 * sizeof (int))) {
+			int fds[3];
+			memcpy (fds, CMSG_DATA (cmsg), sizeof (fds));
+			bool mapped = mRing.base == 0 && shmRingMap (&mRing, fds[0]) == 0;
+			::close (fds[0]);
+			if (not mapped) {
+				::close (fds[1]);
+				::close (fds[2]);
+				abort ("Unable to map the shared memory ring");
+				return;
+			}
+			mNotifyFd = fds[1];
+			mWakeFd = fds[2];
+			mRingNotifier = new QSocketNotifier (mNotifyFd, QSocketNotifier::Read, this);
+			QObject::connect (mRingNotifier, SIGNAL (activated (int)),
+					this, SLOT (ringNotified ()));
+		}
+	}
+
+	canReadData ();
+	if (ended)
+		onSocketDisconnected ();
+}
+
+void ExecuteAndProcessOutput::ringNotified (void) {
+	quint64 count;
+	if (::read (mNotifyFd, &count, sizeof (count)) == -1 && errno != EAGAIN)
+		abort (QString ("Read error : ") + strerror (errno));
+	else
+		canReadData ();
+}
+
+void ExecuteAndProcessOutput::readLocal (char * buffer, quint64 size) {
+	// Answers received on the socket come first
+	quint64 fromSocket = qMin (size, (quint64) mLocalInput.size ());
+	memcpy (buffer, mLocalInput.constData (), fromSocket);
+	mLocalInput.remove (0, fromSocket);
+
+	if (size > fromSocket) {
+		memcpy (buffer + fromSocket, shmRingPeek (&mRing), size - fromSocket);
+		consumeRing (size - fromSocket);
+	}
+}
+
+void ExecuteAndProcessOutput::consumeRing (quint64 size) {
+	// Wake the server if it waits for room
+	if (shmRingConsume (&mRing, size)) {
+		quint64 one = 1;
+		if (::write (mWakeFd, &one, sizeof (one)) == -1 && errno != EAGAIN)
+			abort (QString ("Write error : ") + strerror (errno));
+	}
+}
+
+void ExecuteAndProcessOutput::closeLocal (void) {
+	// Notifiers may be in their signal
+	if (mLocalNotifier != 0) {
+		mLocalNotifier->setEnabled (false);
+		mLocalNotifier->deleteLater ();
+		mLocalNotifier = 0;
+	}
+	if (mRingNotifier != 0) {
+		mRingNotifier->setEnabled (false);
+		mRingNotifier->deleteLater ();
+		mRingNotifier = 0;
+	}
+	if (mLocalSocket != -1)
+		::close (mLocalSocket);
+	if (mNotifyFd != -1)
+		::close (mNotifyFd);
+	if (mWakeFd != -1)
+		::close (mWakeFd);
+	mLocalSocket = mNotifyFd = mWakeFd = -1;
+	shmRingUnmap (&mRing);
+	mLocalInput.clear ();
+	mRingPayload = 0;
+}
+
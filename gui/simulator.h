@@ -5,21 +5,42 @@
 #include <QTcpSocket>
 #include <QImage>
 #include <QPixmap>
+#include <QSocketNotifier>
 #include <QtCore>
 
 #include "protocol.h"
+#include "cellpack.h"
+#include "shmring.h"
 
 /*
- * Hold the wireworld cell map, and allow translation from/to image
+ * Frame queued for display : the cells of the displayed map which changed since the previous
+ * frame, as runs of xored words of raw format (word index, count, then the words), recorded
+ * from the updates as they are decoded.
+ * A full frame holds the whole map instead, as one run (after a change of level or size).
+ * While a viewport is set, cells outside of it are not updated : the map is then not complete.
+ */
+struct CompactFrame {
+	quint32 level; // 0 for the map, else the level of detail of the downsampled map
+	QSize size;
+	bool full;
+	bool complete;
+	QVector< wireworld_message_t > runs;
+};
+
+/*
+ * Hold the wireworld cell map, and allow translation from/to image.
+ * The map is stored as an indexed image : each pixel is the state of a cell, and the color
+ * table turns states into colors only when the pixmap is made.
  */
 class WireWorldMap {
 	public:
 		WireWorldMap ();
 		~WireWorldMap ();
 
-		/* Borders of internal map
+		/* Borders of internal map, and its image of cell states
 		 */
 		QRect getRect (void) const;
+		const QImage & getCells (void) const;
 		bool inBounds (const QPoint & point) const;
 	
 		/* Get map in raw format.
@@ -30,20 +51,76 @@ class WireWorldMap {
 
 		/* Update rectangle with raw format
 		 */
-		void updateMap (QPoint topLeft, QPoint bottomRight, wireworld_message_t * data);
+		void updateMap (QPoint topLeft, QPoint bottomRight, const wireworld_message_t * data);
+
+		/* Update rectangle of the map downsampled at 'level' (A_LOD_UPDATE), which is then
+		 * displayed until the next rectangle update of the map.
+		 * Returns false if the level or the rectangle are invalid.
+		 */
+		bool updateLod (quint32 level, QPoint topLeft, QPoint bottomRight,
+				const wireworld_message_t * data);
 
-		/* Generates a new pixmap from stored map.
-		 * Or load initial map from an image.
+		/* Xor 'count' words of raw format, starting at word 'index' of the raw map
+		 */
+		void xorRawMap (quint32 index, const wireworld_message_t * data, quint32 count);
+
+		/* Move to next generation given its heads (A_HEADS_UPDATE format and data) :
+		 * heads become tails, and tails become wires.
+		 * Returns false if the heads are invalid.
+		 */
+		bool updateHeads (quint32 format, const wireworld_message_t * data, quint32 size);
+
+		/* Generates a new pixmap from stored map (or from the downsampled map while it is
+		 * displayed). Or load initial map from an image.
 		 */	
 		bool fromImage (const QImage & image, int cellSize = 1);
 		QPixmap toImage (void) const;
 
+		/* Changes of the displayed map since the last call (or since resetFrames, which makes
+		 * the next frame hold the whole map).
+		 */
+		CompactFrame takeFrame (void);
+		void resetFrames (void);
+
 	private:
 		/* Resets internalMap image.
 		 */
 		bool resetImage (QSize size);
 
+		/* Cell access by index (x + y * width)
+		 */
+		uchar * cellState (quint32 cell);
+		void findActiveCells (void);
+
+		/* Unpacks a rectangle update into the image (the map, or the downsampled map at
+		 * 'level'), recording its changes
+		 */
+		void applyRect (QImage & image, quint32 level, QPoint topLeft, QPoint bottomRight,
+				const wireworld_message_t * data);
+
+		/* Records changes of the image at 'level' for the next frame
+		 */
+		void recordRun (quint32 level, quint32 index, const wireworld_message_t * data,
+				quint32 count);
+		void recordCell (quint32 cell, quint32 cellXor);
+
 		QImage internalMap;
+
+		// Map downsampled at lodLevel, and whether it is the one displayed
+		QImage lodMap;
+		quint32 lodLevel;
+		bool lodDisplayed;
+
+		// Heads and tails indexes, rebuilt from the image when invalidated by other updates
+		QVector< quint32 > heads, tails;
+		bool activeCellsValid;
+
+		// Changes since the last frame, of the image at recordLevel (the next frame is full if
+		// they do not describe the displayed image)
+		QVector< wireworld_message_t > pendingRuns;
+		quint32 recordLevel;
+		bool nextFrameFull;
+		QSize lastFrameSize;
 };
 
 
@@ -52,9 +129,14 @@ class WireWorldMap {
  * It handles timing control (including actions from buttons),
  * and buffers multiple frames in advance to hide network latency
  * (but it outputs them in the right order).
+ * Frames are queued as compact frames, and only rendered to a pixmap when output.
  *
  * If the interval is 0, we are in fullspeed mode, and we redraw each time
  * a new frame arrives. We only buffers when in a pause (stepMode)
+ *
+ * Unless the latest frame wins : frames are then drawn at most once per refresh interval, and
+ * a frame arriving while the previous one is not drawn yet replaces it (the previous one is
+ * dropped, and its credit given back at once).
  */
 class PixmapBuffer : public QObject {
 	Q_OBJECT
@@ -62,28 +144,47 @@ class PixmapBuffer : public QObject {
 	public:
 		PixmapBuffer ();
 
-		void reset (int maxCreditAllowed, int interval);
-		bool pixmapReady (QPixmap pixmap);
+		/* Starts a simulation of the initial map (an image of cell states), which is output
+		 * until the first frame
+		 */
+		void reset (const QImage & initialMap, int maxCreditAllowed, int interval,
+				bool latestFrameWins = false);
+		bool frameReady (const CompactFrame & frame);
 		void start (void);
 		void stop (void);
 		void step (void);
 
+		/* Map of the last output frame, one pixel per cell : false while it is at a level
+		 * of detail, or not complete
+		 */
+		bool outputCells (QImage & map) const;
+
 	signals:
 		void canRedraw (QPixmap pixmap);
 		void hasCredit (int credit);
+		void framesDropped (int total);
 
 	private slots:
 		void timerTicked (void);
 
 	private:
 		void outputPixmap (void);
+		void dropFrame (void);
+		void applyFrame (const CompactFrame & frame);
 
-		QQueue< QPixmap > pixmapQueue;
+		QQueue< CompactFrame > frameQueue;
 		QTimer timer;
 
+		// Map of the last output frame (an image of cell states)
+		QImage outputMap;
+		quint32 outputLevel;
+		bool outputComplete;
+
 		int maxCredits;
 		bool isInStepMode;
 		bool isFullSpeed;
+		bool isLatestFrameWins;
+		int droppedFrames;
 };
 
 /*
@@ -95,18 +196,35 @@ class ExecuteAndProcessOutput : public QObject {
 	public:
 		ExecuteAndProcessOutput ();
 	
+		/* A host starting with '/' is the path of a local socket. For a loopback host, the
+		 * local socket of the port is used if the server listens there : answers then go
+		 * through shared memory (F_SHARED_MEMORY) instead of the network.
+		 */
 		void init (QString host, int port,
 				QString mapFile, int cellSize,
-				int updateRate, int samplingRate);
+				int updateRate, int samplingRate, bool dropFrames = false);
 
 		void start (void);
 		void pause (void);
 		void step (void);
 		void stop (void);
 
+		/* Saves the displayed map to an image file, one pixel per cell.
+		 * Returns an error text, empty on success.
+		 */
+		QString saveMap (QString fileName) const;
+
+	public slots:
+		/* Cells displayed (empty for the whole map) and their level of detail : only they
+		 * are updated, at this level, if the simulator supports it
+		 */
+		void setViewport (QRect cells, int level);
+
 	signals:
 		// Called if initialization succedeed.
 		void initialized (void);
+		// Called with the size of the map, before the first redraw
+		void mapLoaded (QSize size);
 		// Called if error happened. In this case the connection will be closed.
 		void errored (QString error);
 		// End of connection
@@ -114,6 +232,8 @@ class ExecuteAndProcessOutput : public QObject {
 
 		// Called when a new frame is available
 		void redraw (QPixmap pixmap);
+		// Frames not displayed since the start (latest frame wins mode)
+		void framesDropped (int total);
 
 	private slots:
 		void onSocketError (void);
@@ -122,12 +242,33 @@ class ExecuteAndProcessOutput : public QObject {
 		void onSocketDisconnected (void);
 		void bufferSaidRedraw (QPixmap pixmap);
 		void sendFrameRequest (int nbRequests);
+		void localSocketReadable (void);
+		void ringNotified (void);
 
 	private:
+		void startStream (void);
+		void sendViewport (void);
 		void writeInternal (const wireworld_message_t * messages, quint32 nbMessages);
 		void readInternal (wireworld_message_t * messages, quint32 nbMessages);
 		void abort (QString error);
 
+		/* Bytes received and not read yet, from the socket or the local connection
+		 */
+		quint64 bytesAvailable (void) const;
+
+		/* Payload of 'nbMessages' messages : read in place from the shared memory ring when
+		 * it is in host byte order, otherwise into a buffer. Valid until releasePayload.
+		 */
+		const wireworld_message_t * readPayload (quint32 nbMessages);
+		void releasePayload (void);
+
+		/* Local connection
+		 */
+		int connectLocal (QString host, int port);
+		void readLocal (char * buffer, quint64 size);
+		void consumeRing (quint64 size);
+		void closeLocal (void);
+
 		QTcpSocket mSocket;
 		WireWorldMap mCellMap;
 		PixmapBuffer mPixmapBuffer;
@@ -135,11 +276,15 @@ class ExecuteAndProcessOutput : public QObject {
 		// Temporarily store parameters
 		int mUpdateRate;
 		int mSamplingRate;
+		bool mDropFrames;
 
 		/* Store message decoding step
 		 */
 		enum DecodingStep {
-			WaitingHeader, RectUpdateWaitingPos, RectUpdateWaitingData
+			WaitingHeader, RectUpdateWaitingPos, RectUpdateWaitingData,
+			InitAckWaitingFeatures, DeltaUpdateWaitingSize, DeltaUpdateWaitingData,
+			HeadsUpdateWaitingHeader, HeadsUpdateWaitingData, LodUpdateWaitingPos,
+			LodUpdateWaitingData
 		};
 
 		// Step we are in, and size of data needed to go further
@@ -148,6 +293,37 @@ class ExecuteAndProcessOutput : public QObject {
 
 		// Specific data
 		QPoint mPos1, mPos2;
+		quint32 mHeadsFormat;
+		quint32 mLodLevel;
+
+		// Features accepted by the server
+		quint32 mFeatures;
+
+		// Frame requests are only sent once the features are known
+		bool mInitAcknowledged;
+		int mPendingCredits;
+
+		QRect mViewport;
+		int mViewportLevel;
+
+		// Whether every cell of the map is up to date : not since a viewport was sent, until
+		// the server sends the whole map again
+		bool mMapComplete;
+
+		// Local connection (-1 if none), and bytes received on it and not read yet (the
+		// answers before the ring is used, or all of them if F_SHARED_MEMORY was refused)
+		int mLocalSocket;
+		QSocketNotifier * mLocalNotifier;
+		QByteArray mLocalInput;
+
+		// Shared memory ring, mapped when its file descriptors come with A_INIT_ACK
+		shm_ring_t mRing;
+		int mNotifyFd, mWakeFd;
+		QSocketNotifier * mRingNotifier;
+
+		// Payload buffer, or bytes of the ring used in place by the payload
+		QVector< wireworld_message_t > mPayload;
+		quint64 mRingPayload;
 };
 
 #endif
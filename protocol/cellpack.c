@@ -0,0 +1,228 @@
+#include "cellpack.h"
+
+#include <string.h>
+
+#if defined (__GNUC__) && defined (__x86_64__)
+#define CELLPACK_X86
+#include <immintrin.h>
+#endif
+
+#define CELLS_PER_WORD (M_BIT_SIZE / C_BIT_SIZE)
+
+/* Kernels convert whole words : nbWords words, and 16 times more cells */
+typedef struct {
+	const char * name;
+	void (*pack) (wireworld_message_t * words, const char * cells, size_t nbWords);
+	void (*unpack) (char * cells, const wireworld_message_t * words, size_t nbWords);
+} kernels_t;
+
+static void pack_scalar (wireworld_message_t * words, const char * cells, size_t nbWords) {
+	size_t w;
+	int i;
+	for (w = 0; w < nbWords; ++w, cells += CELLS_PER_WORD) {
+		wireworld_message_t word = 0;
+		for (i = 0; i < CELLS_PER_WORD; ++i)
+			word |= (wireworld_message_t) cells[i] << (C_BIT_SIZE * i);
+		words[w] = word;
+	}
+}
+
+static void unpack_scalar (char * cells, const wireworld_message_t * words, size_t nbWords) {
+	size_t w;
+	int i;
+	for (w = 0; w < nbWords; ++w, cells += CELLS_PER_WORD) {
+		wireworld_message_t word = words[w];
+		for (i = 0; i < CELLS_PER_WORD; ++i, word >>= C_BIT_SIZE)
+			cells[i] = word & C_BIT_MASK;
+	}
+}
+
+#ifdef CELLPACK_X86
+
+/* SSE2 (always there on x86_64).
+ * Packing merges neighbour cells with shifts : 2 cells per 16-bit lane, then 4 per 32-bit lane,
+ * and the bytes of 4 vectors are gathered with saturating packs (values stay below 256).
+ * Unpacking repeats each byte 4 times, and tests the 2 bits of its cell in each copy.
+ */
+static inline __m128i pack_lanes_sse2 (__m128i v) {
+	v = _mm_and_si128 (_mm_or_si128 (v, _mm_srli_epi16 (v, 6)), _mm_set1_epi16 (0x00ff));
+	return _mm_and_si128 (_mm_or_si128 (v, _mm_srli_epi32 (v, 12)), _mm_set1_epi32 (0xff));
+}
+
+static void pack_sse2 (wireworld_message_t * words, const char * cells, size_t nbWords) {
+	size_t w;
+	for (w = 0; w + 4 <= nbWords; w += 4, cells += 4 * CELLS_PER_WORD) {
+		__m128i a = pack_lanes_sse2 (_mm_loadu_si128 ((const __m128i *) cells));
+		__m128i b = pack_lanes_sse2 (_mm_loadu_si128 ((const __m128i *) (cells + 16)));
+		__m128i c = pack_lanes_sse2 (_mm_loadu_si128 ((const __m128i *) (cells + 32)));
+		__m128i d = pack_lanes_sse2 (_mm_loadu_si128 ((const __m128i *) (cells + 48)));
+		_mm_storeu_si128 ((__m128i *) &words[w],
+				_mm_packus_epi16 (_mm_packs_epi32 (a, b), _mm_packs_epi32 (c, d)));
+	}
+	pack_scalar (&words[w], cells, nbWords - w);
+}
+
+static inline __m128i unpack_word_sse2 (__m128i repeated) {
+	const __m128i low = _mm_set1_epi32 (0x40100401), high = _mm_set1_epi32 ((int) 0x80200802);
+	__m128i l = _mm_cmpeq_epi8 (_mm_and_si128 (repeated, low), low);
+	__m128i h = _mm_cmpeq_epi8 (_mm_and_si128 (repeated, high), high);
+	return _mm_or_si128 (_mm_and_si128 (l, _mm_set1_epi8 (1)), _mm_and_si128 (h, _mm_set1_epi8 (2)));
+}
+
+static void unpack_sse2 (char * cells, const wireworld_message_t * words, size_t nbWords) {
+	size_t w;
+	for (w = 0; w + 4 <= nbWords; w += 4, cells += 4 * CELLS_PER_WORD) {
+		__m128i x = _mm_loadu_si128 ((const __m128i *) &words[w]);
+		__m128i lo = _mm_unpacklo_epi8 (x, x), hi = _mm_unpackhi_epi8 (x, x);
+		_mm_storeu_si128 ((__m128i *) cells, unpack_word_sse2 (_mm_unpacklo_epi16 (lo, lo)));
+		_mm_storeu_si128 ((__m128i *) (cells + 16), unpack_word_sse2 (_mm_unpackhi_epi16 (lo, lo)));
+		_mm_storeu_si128 ((__m128i *) (cells + 32), unpack_word_sse2 (_mm_unpacklo_epi16 (hi, hi)));
+		_mm_storeu_si128 ((__m128i *) (cells + 48), unpack_word_sse2 (_mm_unpackhi_epi16 (hi, hi)));
+	}
+	unpack_scalar (cells, &words[w], nbWords - w);
+}
+
+/* AVX2 : the same on 32 cells per vector. Packs work within 128-bit lanes, so the packed
+ * words are put back in order with a permutation, and unpacking repeats bytes with a shuffle.
+ */
+__attribute__ ((target ("avx2")))
+static inline __m256i pack_lanes_avx2 (__m256i v) {
+	v = _mm256_and_si256 (_mm256_or_si256 (v, _mm256_srli_epi16 (v, 6)), _mm256_set1_epi16 (0x00ff));
+	return _mm256_and_si256 (_mm256_or_si256 (v, _mm256_srli_epi32 (v, 12)), _mm256_set1_epi32 (0xff));
+}
+
+__attribute__ ((target ("avx2")))
+static void pack_avx2 (wireworld_message_t * words, const char * cells, size_t nbWords) {
+	const __m256i order = _mm256_setr_epi32 (0, 4, 1, 5, 2, 6, 3, 7);
+	size_t w;
+	for (w = 0; w + 8 <= nbWords; w += 8, cells += 8 * CELLS_PER_WORD) {
+		__m256i a = pack_lanes_avx2 (_mm256_loadu_si256 ((const __m256i *) cells));
+		__m256i b = pack_lanes_avx2 (_mm256_loadu_si256 ((const __m256i *) (cells + 32)));
+		__m256i c = pack_lanes_avx2 (_mm256_loadu_si256 ((const __m256i *) (cells + 64)));
+		__m256i d = pack_lanes_avx2 (_mm256_loadu_si256 ((const __m256i *) (cells + 96)));
+		__m256i p = _mm256_packus_epi16 (_mm256_packs_epi32 (a, b), _mm256_packs_epi32 (c, d));
+		_mm256_storeu_si256 ((__m256i *) &words[w], _mm256_permutevar8x32_epi32 (p, order));
+	}
+	pack_sse2 (&words[w], cells, nbWords - w);
+}
+
+__attribute__ ((target ("avx2")))
+static inline __m256i unpack_words_avx2 (__m256i repeated) {
+	const __m256i low = _mm256_set1_epi32 (0x40100401), high = _mm256_set1_epi32 ((int) 0x80200802);
+	__m256i l = _mm256_cmpeq_epi8 (_mm256_and_si256 (repeated, low), low);
+	__m256i h = _mm256_cmpeq_epi8 (_mm256_and_si256 (repeated, high), high);
+	return _mm256_or_si256 (_mm256_and_si256 (l, _mm256_set1_epi8 (1)),
+			_mm256_and_si256 (h, _mm256_set1_epi8 (2)));
+}
+
+__attribute__ ((target ("avx2")))
+static void unpack_avx2 (char * cells, const wireworld_message_t * words, size_t nbWords) {
+	const __m256i first = _mm256_setr_epi8 (0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+			4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7);
+	const __m256i second = _mm256_add_epi8 (first, _mm256_set1_epi8 (8));
+	size_t w;
+	for (w = 0; w + 4 <= nbWords; w += 4, cells += 4 * CELLS_PER_WORD) {
+		__m256i x = _mm256_broadcastsi128_si256 (_mm_loadu_si128 ((const __m128i *) &words[w]));
+		_mm256_storeu_si256 ((__m256i *) cells, unpack_words_avx2 (_mm256_shuffle_epi8 (x, first)));
+		_mm256_storeu_si256 ((__m256i *) (cells + 32),
+				unpack_words_avx2 (_mm256_shuffle_epi8 (x, second)));
+	}
+	unpack_scalar (cells, &words[w], nbWords - w);
+}
+
+/* BMI2 : the 2 bits of 8 cells are extracted from (or deposited to) a 64-bit word at once */
+#define BMI2_CELL_BITS 0x0303030303030303ull
+
+__attribute__ ((target ("bmi2")))
+static void pack_bmi2 (wireworld_message_t * words, const char * cells, size_t nbWords) {
+	size_t w;
+	for (w = 0; w < nbWords; ++w, cells += CELLS_PER_WORD) {
+		uint64_t lo, hi;
+		memcpy (&lo, cells, sizeof (lo));
+		memcpy (&hi, cells + 8, sizeof (hi));
+		words[w] = _pext_u64 (lo, BMI2_CELL_BITS) | _pext_u64 (hi, BMI2_CELL_BITS) << 16;
+	}
+}
+
+__attribute__ ((target ("bmi2")))
+static void unpack_bmi2 (char * cells, const wireworld_message_t * words, size_t nbWords) {
+	size_t w;
+	for (w = 0; w < nbWords; ++w, cells += CELLS_PER_WORD) {
+		uint64_t lo = _pdep_u64 (words[w] & 0xffff, BMI2_CELL_BITS);
+		uint64_t hi = _pdep_u64 (words[w] >> 16, BMI2_CELL_BITS);
+		memcpy (cells, &lo, sizeof (lo));
+		memcpy (cells + 8, &hi, sizeof (hi));
+	}
+}
+
+static kernels_t kernels = { "sse2", pack_sse2, unpack_sse2 };
+
+/* AVX2 is the widest, and pdep/pext are slow on some cpus which have them without AVX2 */
+__attribute__ ((constructor))
+static void select_kernels (void) {
+	static const kernels_t avx2 = { "avx2", pack_avx2, unpack_avx2 };
+	static const kernels_t bmi2 = { "bmi2", pack_bmi2, unpack_bmi2 };
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("avx2"))
+		kernels = avx2;
+	else if (__builtin_cpu_supports ("bmi2"))
+		kernels = bmi2;
+}
+
+#else
+
+static const kernels_t kernels = { "scalar", pack_scalar, unpack_scalar };
+
+#endif
+
+void cellPack (wireworld_message_t * frame, uint64_t first, const char * cells, size_t count) {
+	wireworld_message_t * word = &frame[first / CELLS_PER_WORD];
+	uint32_t i = first % CELLS_PER_WORD;
+
+	// First word, if it is shared with previous cells
+	if (i != 0 && count > 0) {
+		wireworld_message_t w = *word & ((1u << (C_BIT_SIZE * i)) - 1);
+		for (; i < CELLS_PER_WORD && count > 0; ++i, --count)
+			w |= (wireworld_message_t) *cells++ << (C_BIT_SIZE * i);
+		*word++ = w;
+	}
+
+	// Whole words, then the last cells
+	size_t nbWords = count / CELLS_PER_WORD;
+	kernels.pack (word, cells, nbWords);
+	word += nbWords;
+	cells += nbWords * CELLS_PER_WORD;
+	count -= nbWords * CELLS_PER_WORD;
+	if (count > 0) {
+		wireworld_message_t w = 0;
+		for (i = 0; i < count; ++i)
+			w |= (wireworld_message_t) cells[i] << (C_BIT_SIZE * i);
+		*word = w;
+	}
+}
+
+void cellUnpack (const wireworld_message_t * frame, uint64_t first, char * cells, size_t count) {
+	const wireworld_message_t * word = &frame[first / CELLS_PER_WORD];
+	uint32_t i = first % CELLS_PER_WORD;
+
+	if (i != 0) {
+		wireworld_message_t w = *word++ >> (C_BIT_SIZE * i);
+		for (; i < CELLS_PER_WORD && count > 0; ++i, --count, w >>= C_BIT_SIZE)
+			*cells++ = w & C_BIT_MASK;
+	}
+
+	size_t nbWords = count / CELLS_PER_WORD;
+	kernels.unpack (cells, word, nbWords);
+	word += nbWords;
+	cells += nbWords * CELLS_PER_WORD;
+	count -= nbWords * CELLS_PER_WORD;
+	if (count > 0) {
+		wireworld_message_t w = *word;
+		for (i = 0; i < count; ++i, w >>= C_BIT_SIZE)
+			cells[i] = w & C_BIT_MASK;
+	}
+}
+
+const char * cellPackKernel (void) {
+	return kernels.name;
+}
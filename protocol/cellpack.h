@@ -0,0 +1,36 @@
+#ifndef CELLPACK_H
+#define CELLPACK_H
+
+#include <stddef.h>
+
+#include "protocol.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Conversions between the frame format (see protocol.h) and arrays of one char per cell (with
+ * values from C_INSULATOR to C_TAIL), shared by the server and the gui.
+ * Frame words are in host byte order. Whole words are converted with SSE2, AVX2 or BMI2 kernels
+ * when the cpu has them, selected when the program is loaded.
+ */
+
+/* Packs 'count' cells into the frame, from the cell 'first' of the frame.
+ * The cells before 'first' in its word are kept, the cells after the last one in its word are
+ * cleared, and the words after it are not written (so the last word of a frame must be cleared
+ * by the caller if it may contain no cell).
+ */
+void cellPack (wireworld_message_t * frame, uint64_t first, const char * cells, size_t count);
+
+/* Unpacks 'count' cells of the frame, from the cell 'first' of the frame.
+ */
+void cellUnpack (const wireworld_message_t * frame, uint64_t first, char * cells, size_t count);
+
+/* Name of the kernels in use (for diagnostics) */
+const char * cellPackKernel (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -42,6 +42,127 @@ typedef uint32_t wireworld_message_t;
  */
 #define R_FRAME 1u
 
+/* Extended init message (same as R_INIT, with optional protocol features) :
+ *	   id       : 1 [R_INIT_EX]
+ *	   xsize    : 1
+ *	   ysize    : 1
+ *	   sampling : 1
+ *	   features : 1 (bitwise or of requested F_* flags)
+ *	   name     : 1 (only if F_SHARED_SESSION is requested)
+ *	   frame    : xsize * ysize * C_BIT_SIZE / M_BIT_SIZE + 1
+ *
+ * The server answers with an A_INIT_ACK message before any frame, telling which of the
+ * requested features it will use. An old server will just close the connection.
+ *
+ * Messages are big endian, except answers following A_INIT_ACK if F_LITTLE_ENDIAN was accepted
+ * (requests stay big endian), which saves conversions between little endian hosts.
+ */
+#define R_INIT_EX 2u
+
+/* Request several frames message (same as 'count' R_FRAME messages, requires F_FRAME_BATCH) :
+ *	   id    : 1 [R_FRAME_N]
+ *	   count : 1
+ */
+#define R_FRAME_N 3u
+
+/* Stream message (push mode, requires F_FRAME_BATCH) :
+ *	   id       : 1 [R_STREAM]
+ *	   window   : 1
+ *	   interval : 1 (microseconds, 0 for as fast as possible)
+ *
+ * Requests 'window' frames, like R_FRAME_N, and asks the server to send frames at most one per
+ * 'interval'. The client then acknowledges the frames it has processed with R_FRAME or R_FRAME_N,
+ * so the server pushes frames as long as fewer than 'window' are in flight, without a round trip
+ * per frame. A new R_STREAM message adds its window, and replaces the interval.
+ */
+#define R_STREAM 4u
+
+/* Init from a server file message (for maps too large to be sent, see server/mapfile.h) :
+ *	   id       : 1 [R_INIT_FILE]
+ *	   sampling : 1
+ *	   features : 1
+ *	   name     : 1 (only if F_SHARED_SESSION is requested)
+ *	   length   : 1 (length of the path, in bytes)
+ *	   path     : length / 4 + 1 (path of the map file in the map directory of the server,
+ *	              zero padded)
+ *
+ * Like R_INIT_EX, it is answered with A_INIT_ACK, which then also gives the map sizes. The gui
+ * starts from an empty map (only insulators), which the first frame updates to the whole map.
+ * If the server checkpoints simulations, the simulation resumes from the last checkpoint of the
+ * map file. A server which does not allow it closes the connection.
+ */
+#define R_INIT_FILE 5u
+
+/* Viewport message (requires F_VIEWPORT) :
+ *	   id    : 1 [R_VIEWPORT]
+ *	   x1    : 1
+ *	   y1    : 1
+ *	   x2    : 1
+ *	   y2    : 1
+ *	   level : 1 (only if F_LEVEL_OF_DETAIL was accepted)
+ *
+ * Tells the server that the gui only displays the rectangle [x1, x2) * [y1, y2) of the map
+ * (clipped to the map). The next frames only update it : the first one with a rectangle update
+ * of the whole viewport, and the following ones with rectangle updates of what changed in it
+ * (delta and heads updates are not used meanwhile). An empty rectangle goes back to the whole
+ * map : the next frame is a rectangle update of the whole map, and the following ones use the
+ * accepted features again.
+ * It applies from the next frame sent : the frames the server computed ahead and did not send
+ * yet are dropped, so the gui skips their generations.
+ *
+ * With a level L above 0 (at most LOD_MAX_LEVEL), the gui displays the viewport (or the whole map)
+ * downsampled by 2^L in each direction : the updates are then A_LOD_UPDATE messages, and their
+ * size scales with the displayed pixels instead of the cells. Going back to level 0 is a viewport
+ * change like the others.
+ */
+#define R_VIEWPORT 6u
+
+#define LOD_MAX_LEVEL 16u
+
+/* Features */
+#define F_DELTA_UPDATE (1u << 0) // frames may be sent as A_DELTA_UPDATE
+#define F_HEADS_ONLY (1u << 1) // frames are sent as A_HEADS_UPDATE (only if sampling is 1)
+#define F_LITTLE_ENDIAN (1u << 2) // answers after A_INIT_ACK are little endian
+#define F_FRAME_BATCH (1u << 3) // R_FRAME_N and R_STREAM requests are accepted
+#define F_SHARED_SESSION (1u << 4) // the simulation is shared by the clients of the same map
+#define F_VIEWPORT (1u << 5) // R_VIEWPORT requests are accepted
+#define F_LEVEL_OF_DETAIL (1u << 6) // R_VIEWPORT has a level, for A_LOD_UPDATE (needs F_VIEWPORT)
+#define F_SHARED_MEMORY (1u << 7) // answers after A_INIT_ACK go through a shared memory ring
+
+/* Shared sessions : the clients giving the same name and the same frame (or map file), with the
+ * same sampling, see the same simulation : the name alone does not attach to it. The first one
+ * creates it from its frame, and the next ones attach to it, their frame only being what they
+ * display until the first update.
+ * The simulation advances with the fastest client, and the others skip the frames they did not
+ * request in time. So with F_HEADS_ONLY, the frame following skipped ones (or the first one of an
+ * attached client) is sent as a rectangle update of the whole map instead.
+ */
+
+/* Shared memory transport : a gui running on the host of the server may connect to its local
+ * socket (a Unix socket, at LOCAL_SOCKET_PATH for the server port, if the server listens there),
+ * and request F_SHARED_MEMORY. If it is accepted, the A_INIT_ACK message comes with three file
+ * descriptors (SCM_RIGHTS) : a memfd holding the ring, an eventfd the server signals after
+ * writing answers, and an eventfd the gui signals after consuming answers, if the server waits
+ * for room. All the answers following A_INIT_ACK are then written to the ring, in the byte
+ * order of the accepted features, instead of the socket (requests still use the socket).
+ *
+ * The memfd holds a header page, then the ring (a power of two number of pages). The header
+ * has 64 bits counters at these byte offsets, accessed atomically :
+ * - SHM_SIZE : size of the ring in bytes,
+ * - SHM_HEAD : bytes of answers written (only by the server),
+ * - SHM_TAIL : bytes of answers consumed (only by the gui),
+ * - SHM_WAITING : set by the server when the ring is full, and cleared by the gui before it
+ *   signals the server.
+ * Byte n of the answers is at offset n % size of the ring. The ring is large enough for the
+ * largest answer of the map (a rectangle update of the whole map), twice.
+ */
+#define LOCAL_SOCKET_PATH "/tmp/wireworld-%d.sock"
+
+#define SHM_SIZE 0
+#define SHM_HEAD 64
+#define SHM_TAIL 128
+#define SHM_WAITING 192
+
 /*******************************
  * Answer (from server to gui) *
  ******************************/
@@ -68,6 +189,65 @@ typedef uint32_t wireworld_message_t;
  */
 #define A_FRAME_END 1u
 
+/* Init acknowledgement message (only in answer to R_INIT_EX and R_INIT_FILE) :
+ *	   id       : 1 [A_INIT_ACK]
+ *	   features : 1 (features accepted by the server, subset of the requested ones)
+ *	   xsize    : 1 (only in answer to R_INIT_FILE)
+ *	   ysize    : 1 (only in answer to R_INIT_FILE)
+ */
+#define A_INIT_ACK 2u
+
+/* Delta update message (only if F_DELTA_UPDATE was accepted) :
+ *	   id   : 1 [A_DELTA_UPDATE]
+ *	   size : 1
+ *	   runs : size
+ *
+ * It carries the xor of the whole new frame (in the R_INIT frame format) with the previous one.
+ * The xor is cut in a sequence of runs, each being :
+ *	   skip  : 1 (number of unchanged frame words, which are not sent)
+ *	   count : 1
+ *	   xor   : count (xor words to apply to the following frame words)
+ * Frame words after the last run are unchanged.
+ * Like rectangle updates, it is part of a sequence terminated with an end-of-frame message.
+ */
+#define A_DELTA_UPDATE 3u
+
+/* Heads update message (only if F_HEADS_ONLY was accepted, which requires sampling to be 1) :
+ *	   id     : 1 [A_HEADS_UPDATE]
+ *	   format : 1 [H_BITMAP or H_LIST]
+ *	   size   : 1
+ *	   heads  : size
+ *
+ * Conductors never change, and with sampling 1 the tails of the new frame are the heads of the
+ * previous one, and its wires the other conductors. So the new frame is given by its heads :
+ * - H_BITMAP : one bit per cell (1 for heads), in the order of the R_INIT frame, 32 cells
+ *   per message with cell 0 in the low bit (size is xsize * ysize / M_BIT_SIZE + 1),
+ * - H_LIST : the sorted indexes (x + y * xsize) of the heads (size is the number of heads).
+ * The server uses the smallest of the two.
+ * Like rectangle updates, it is part of a sequence terminated with an end-of-frame message.
+ */
+#define A_HEADS_UPDATE 4u
+
+#define H_BITMAP 0u
+#define H_LIST 1u
+
+/* Level of detail update message (only with a R_VIEWPORT level above 0) :
+ *	   id    : 1 [A_LOD_UPDATE]
+ *	   level : 1
+ *	   x1    : 1
+ *	   y1    : 1
+ *	   x2    : 1
+ *	   y2    : 1
+ *	   frame : (x2-x1) * (y2-y1) * C_BIT_SIZE / M_BIT_SIZE + 1
+ *
+ * Same as a rectangle update of the map downsampled by k = 2^level : the rectangle is in blocks
+ * of k * k cells (block x covers the cells [x * k, (x + 1) * k) of the map, clipped to it), and
+ * each block is summarized by its most visible cell : C_HEAD if it has any head, else C_TAIL if
+ * it has any tail, else C_WIRE if it has any wire, else C_INSULATOR.
+ * Like rectangle updates, it is part of a sequence terminated with an end-of-frame message.
+ */
+#define A_LOD_UPDATE 5u
+
 /********************
  * Cell description *
  *******************/
@@ -93,7 +273,7 @@ typedef uint32_t wireworld_message_t;
  */
 
 static inline uint32_t wireworldFrameMessageSize (int w, int h) {
-	return w * h * C_BIT_SIZE / M_BIT_SIZE + 1;
+	return (uint64_t) (uint32_t) w * (uint32_t) h * C_BIT_SIZE / M_BIT_SIZE + 1;
 }
 
 #endif
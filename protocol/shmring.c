@@ -0,0 +1,104 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "shmring.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+
+/* Counters of the header, each on its own cache line (see protocol.h) */
+static inline uint64_t * counter (const shm_ring_t * ring, size_t offset) {
+	return (uint64_t *) (ring->base + offset);
+}
+
+/* Maps the header page and the ring twice, in one reserved range */
+static int map_ring (shm_ring_t * ring, int fd, uint64_t size) {
+	size_t page = sysconf (_SC_PAGESIZE);
+	size_t mapSize = page + 2 * size;
+	char * base = mmap (NULL, mapSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		return -1;
+	if (mmap (base, page + size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) ==
+				MAP_FAILED ||
+			mmap (base + page + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+				page) == MAP_FAILED) {
+		munmap (base, mapSize);
+		return -1;
+	}
+	ring->base = base;
+	ring->data = base + page;
+	ring->size = size;
+	ring->mapSize = mapSize;
+	return 0;
+}
+
+int shmRingCreate (shm_ring_t * ring, uint64_t size) {
+	// A power of two number of pages
+	uint64_t page = sysconf (_SC_PAGESIZE), ringSize = page;
+	while (ringSize < size)
+		ringSize *= 2;
+
+	int fd = memfd_create ("wireworld-ring", MFD_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	if (ftruncate (fd, page + ringSize) != 0 || map_ring (ring, fd, ringSize) != 0) {
+		close (fd);
+		return -1;
+	}
+	*counter (ring, SHM_SIZE) = ringSize;
+	return fd;
+}
+
+int shmRingMap (shm_ring_t * ring, int fd) {
+	struct stat st;
+	uint64_t page = sysconf (_SC_PAGESIZE);
+	if (fstat (fd, &st) != 0 || (uint64_t) st.st_size <= page)
+		return -1;
+	uint64_t size = st.st_size - page;
+	if ((size & (size - 1)) != 0 || size % page != 0 || map_ring (ring, fd, size) != 0)
+		return -1;
+	if (*counter (ring, SHM_SIZE) != size) {
+		shmRingUnmap (ring);
+		return -1;
+	}
+	return 0;
+}
+
+void shmRingUnmap (shm_ring_t * ring) {
+	if (ring->base != NULL)
+		munmap (ring->base, ring->mapSize);
+	ring->base = NULL;
+	ring->data = NULL;
+}
+
+uint64_t shmRingWrite (shm_ring_t * ring, const void * data, uint64_t size) {
+	uint64_t head = *counter (ring, SHM_HEAD); // only written here
+	uint64_t room = ring->size - (head - __atomic_load_n (counter (ring, SHM_TAIL), __ATOMIC_ACQUIRE));
+	if (room < size) {
+		// Tell the reader, then look again in case it consumed meanwhile (so that either it
+		// sees the flag, or this sees its progress)
+		__atomic_store_n (counter (ring, SHM_WAITING), 1, __ATOMIC_SEQ_CST);
+		room = ring->size - (head - __atomic_load_n (counter (ring, SHM_TAIL), __ATOMIC_SEQ_CST));
+	}
+	if (size > room)
+		size = room;
+	memcpy (&ring->data[head & (ring->size - 1)], data, size);
+	__atomic_store_n (counter (ring, SHM_HEAD), head + size, __ATOMIC_RELEASE);
+	return size;
+}
+
+uint64_t shmRingReadable (const shm_ring_t * ring) {
+	return __atomic_load_n (counter (ring, SHM_HEAD), __ATOMIC_ACQUIRE) - *counter (ring, SHM_TAIL);
+}
+
+const char * shmRingPeek (const shm_ring_t * ring) {
+	return &ring->data[*counter (ring, SHM_TAIL) & (ring->size - 1)];
+}
+
+int shmRingConsume (shm_ring_t * ring, uint64_t size) {
+	__atomic_store_n (counter (ring, SHM_TAIL), *counter (ring, SHM_TAIL) + size, __ATOMIC_SEQ_CST);
+	return __atomic_exchange_n (counter (ring, SHM_WAITING), 0, __ATOMIC_SEQ_CST) != 0;
+}
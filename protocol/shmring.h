@@ -0,0 +1,57 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Shared memory ring of the F_SHARED_MEMORY transport (see protocol.h), shared by the server
+ * (writer) and the gui (reader).
+ * The ring is mapped twice in a row after its header, so that up to 'size' bytes starting
+ * anywhere in the ring are contiguous in memory : messages are written and read in place.
+ */
+typedef struct {
+	char * base; // header page, then the ring twice
+	char * data;
+	uint64_t size;
+	size_t mapSize;
+} shm_ring_t;
+
+/* Creates a ring of at least 'size' bytes in a new memfd, and maps it.
+ * Returns the memfd (to be passed to the reader), or -1 on error.
+ */
+int shmRingCreate (shm_ring_t * ring, uint64_t size);
+
+/* Maps the ring of a memfd created by shmRingCreate.
+ * Returns -1 on error, 0 on success.
+ */
+int shmRingMap (shm_ring_t * ring, int fd);
+
+void shmRingUnmap (shm_ring_t * ring);
+
+/* Writer : copies the first bytes of 'data' which fit in the ring, and publishes them.
+ * Returns the number of bytes written. When it is less than 'size', the writer is marked as
+ * waiting, and the reader signals it once it consumed some.
+ */
+uint64_t shmRingWrite (shm_ring_t * ring, const void * data, uint64_t size);
+
+/* Reader : number of published bytes not consumed yet, and the first of them.
+ */
+uint64_t shmRingReadable (const shm_ring_t * ring);
+const char * shmRingPeek (const shm_ring_t * ring);
+
+/* Reader : consumes 'size' bytes.
+ * Returns 1 if the writer waits for room (it must then be signaled), 0 otherwise.
+ */
+int shmRingConsume (shm_ring_t * ring, uint64_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
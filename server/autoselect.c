@@ -0,0 +1,113 @@
+#include "engine.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "../protocol/protocol.h"
+
+/* Automatic engine selection.
+ *
+ * The bitslice engine has a cost proportional to the map area, and the frontier engine a cost
+ * proportional to the number of heads and tails. Measured costs are about 0.2ns per cell
+ * for the first, and 20ns per active cell for the second, so the break-even is around
+ * 1% of active cells.
+ *
+ * This engine wraps one of them, and checks the activity after each step. When it crosses the
+ * threshold, the state is exported and moved to the other engine. The two thresholds are
+ * apart by a factor 2, to avoid switching back and forth.
+ */
+
+#define SPARSE_RATIO 128 // below area / SPARSE_RATIO active cells, use frontier
+#define DENSE_RATIO 64 // above area / DENSE_RATIO active cells, use bitslice
+
+typedef struct {
+	engine_t base;
+	engine_t * inner;
+	char * scratch;
+	engine_params_t params;
+} auto_engine_t;
+
+static const engine_ops_t * choose (const engine_ops_t * current, uint64_t activity, uint64_t area) {
+	if (activity * SPARSE_RATIO < area)
+		return &frontierEngine;
+	else if (activity * DENSE_RATIO > area)
+		return &bitsliceEngine;
+	else
+		return current;
+}
+
+static engine_t * auto_create (const char * borderedMap, uint32_t xsize, uint32_t ysize,
+		const engine_params_t * params) {
+	auto_engine_t * e = malloc (sizeof (auto_engine_t));
+	assert (e != NULL);
+	e->scratch = engineAllocMap (xsize, ysize);
+	e->params = *params;
+
+	// Initial activity
+	uint64_t activity = 0;
+	uint32_t i, size = engineMapCells (xsize, ysize);
+	for (i = 0; i < size; ++i)
+		if (borderedMap[i] == C_HEAD || borderedMap[i] == C_TAIL)
+			activity++;
+
+	e->inner = engineCreate (choose (&bitsliceEngine, activity, (uint64_t) xsize * ysize),
+			borderedMap, xsize, ysize, params);
+	if (e->inner == NULL) {
+		free (e->scratch);
+		free (e);
+		return NULL;
+	}
+	return &e->base;
+}
+
+static int auto_step (engine_t * engine, uint32_t generations) {
+	auto_engine_t * e = (auto_engine_t *) engine;
+	if (engineStep (e->inner, generations) != 0)
+		return -1;
+
+	const engine_ops_t * current = e->inner->ops;
+	const engine_ops_t * next = choose (current,
+			current->activity (e->inner), (uint64_t) engine->xsize * engine->ysize);
+	if (next != current) {
+		const char * map = engineExport (e->inner, e->scratch);
+		if (map == NULL)
+			return -1;
+		engine_t * moved = engineCreate (next, map, engine->xsize, engine->ysize, &e->params);
+		if (moved != NULL) {
+			engineDestroy (e->inner);
+			e->inner = moved;
+		}
+	}
+	return 0;
+}
+
+static char * auto_export (engine_t * engine, char * scratch) {
+	return engineExport (((auto_engine_t *) engine)->inner, scratch);
+}
+
+static int auto_pack (engine_t * engine, uint32_t * frame) {
+	auto_engine_t * e = (auto_engine_t *) engine;
+	return enginePack (e->inner, frame, e->scratch);
+}
+
+static uint64_t auto_activity (engine_t * engine) {
+	engine_t * inner = ((auto_engine_t *) engine)->inner;
+	return inner->ops->activity (inner);
+}
+
+static uint64_t auto_hash (engine_t * engine) {
+	auto_engine_t * e = (auto_engine_t *) engine;
+	return engineHash (e->inner, e->scratch);
+}
+
+static void auto_destroy (engine_t * engine) {
+	auto_engine_t * e = (auto_engine_t *) engine;
+	engineDestroy (e->inner);
+	free (e->scratch);
+	free (e);
+}
+
+const engine_ops_t autoEngine = {
+	"auto", auto_create, auto_step, auto_export, auto_pack, auto_activity, auto_hash,
+	auto_destroy
+};
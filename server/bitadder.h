@@ -0,0 +1,48 @@
+#ifndef BITADDER_H
+#define BITADDER_H
+
+#include <stdint.h>
+
+/* Bitwise neighbour counting, shared by the bit-parallel engines (bitslice and packed).
+ *
+ * Each bit position of the masks is a cell, and the 8 masks give which of its neighbours are
+ * heads. The engines only differ by how they lay out the cells, and how they shift their rows
+ * to get the masks.
+ */
+
+/* Only the row kernels are cloned, the dispatch is done at load time by the loader */
+#if defined (__GNUC__) && defined (__x86_64__)
+#define KERNEL_CLONES __attribute__ ((target_clones ("avx2", "default")))
+#else
+#define KERNEL_CLONES
+#endif
+
+/* Returns the mask of the cells with 1 or 2 heads among their neighbours : uL, uC and uR are
+ * the up-left, up and up-right neighbours, mL and mR the left and right ones, and dL, dC and
+ * dR the down ones.
+ */
+static inline uint64_t bitAdderOneOrTwo (uint64_t uL, uint64_t uC, uint64_t uR,
+		uint64_t mL, uint64_t mR, uint64_t dL, uint64_t dC, uint64_t dR) {
+	// Sum of each row, as (carry, sum) pairs
+	uint64_t s0 = uL ^ uC ^ uR;
+	uint64_t c0 = (uL & uC) | (uR & (uL ^ uC));
+	uint64_t s1 = mL ^ mR;
+	uint64_t c1 = mL & mR;
+	uint64_t s2 = dL ^ dC ^ dR;
+	uint64_t c2 = (dL & dC) | (dR & (dL ^ dC));
+
+	// Add the units : total = ones + 2 * (c0 + c1 + c2 + b)
+	uint64_t ones = s0 ^ s1 ^ s2;
+	uint64_t b = (s0 & s1) | (s2 & (s0 ^ s1));
+
+	// Among the 4 weight-2 bits : none, or exactly one
+	uint64_t x01 = c0 ^ c1, a01 = c0 & c1;
+	uint64_t x2b = c2 ^ b, a2b = c2 & b;
+	uint64_t none = ~(x01 | x2b | a01 | a2b);
+	uint64_t exactlyOne = (x01 ^ x2b) & ~(a01 | a2b);
+
+	// 1 or 2 heads
+	return (ones & none) | (~ones & exactlyOne);
+}
+
+#endif
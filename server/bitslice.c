@@ -0,0 +1,204 @@
+#include "engine.h"
+#include "bitadder.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../protocol/protocol.h"
+
+/* Bit-sliced engine.
+ *
+ * The map is stored as bit planes of 64 cells per word : a constant conductor plane
+ * (wire, head or tail cells), and rotating head and tail planes.
+ * Each row has a ghost word on each side, and there is a ghost row above and below the map,
+ * all kept at zero, so that the kernel never needs to test for borders.
+ *
+ * A cell becomes a head if it is a wire with 1 or 2 head neighbours, the heads become
+ * tails, and the tails become wires. So the next tail plane is the current head plane,
+ * and only the head plane is computed, with a bitwise adder (see bitadder.h) over the 8 shifted
+ * neighbour planes.
+ */
+
+#define WORD_BITS 64
+
+typedef struct {
+	engine_t base;
+
+	uint32_t stride; // words per row, ghost words included
+	uint64_t * cond;
+	uint64_t * planes[3]; // head, tail, and spare plane
+	int head, tail, spare;
+} bitslice_engine_t;
+
+static uint64_t * plane_alloc (uint32_t stride, uint32_t ysize) {
+	uint64_t * p = calloc (stride * (ysize + 2), sizeof (uint64_t));
+	assert (p != NULL);
+	return p;
+}
+
+static inline uint64_t * row (uint64_t * plane, uint32_t y, uint32_t stride) {
+	// Points to the first real word of map row y (ghost row is y = -1)
+	return &plane[(y + 1) * stride + 1];
+}
+
+static engine_t * bitslice_create (const char * borderedMap, uint32_t xsize, uint32_t ysize,
+		const engine_params_t * params) {
+	(void) params;
+	bitslice_engine_t * e = malloc (sizeof (bitslice_engine_t));
+	assert (e != NULL);
+
+	e->stride = (xsize + WORD_BITS - 1) / WORD_BITS + 2;
+	e->cond = plane_alloc (e->stride, ysize);
+	int i;
+	for (i = 0; i < 3; ++i)
+		e->planes[i] = plane_alloc (e->stride, ysize);
+	e->head = 0;
+	e->tail = 1;
+	e->spare = 2;
+
+	// Fill planes
+	uint32_t x, y;
+	for (y = 0; y < ysize; ++y) {
+		const char * line = &borderedMap[(y + 1) * (xsize + 2) + 1];
+		uint64_t * cond = row (e->cond, y, e->stride);
+		uint64_t * head = row (e->planes[e->head], y, e->stride);
+		uint64_t * tail = row (e->planes[e->tail], y, e->stride);
+		for (x = 0; x < xsize; ++x) {
+			uint64_t bit = (uint64_t) 1 << (x % WORD_BITS);
+			uint32_t w = x / WORD_BITS;
+			if (line[x] != C_INSULATOR)
+				cond[w] |= bit;
+			if (line[x] == C_HEAD)
+				head[w] |= bit;
+			else if (line[x] == C_TAIL)
+				tail[w] |= bit;
+		}
+	}
+	return &e->base;
+}
+
+/* Computes a row of the next head plane.
+ * up, mid, down are the rows of the current head plane around the computed one ;
+ * all pointers point to the first real word, and [-1] and [nwords] must be readable.
+ */
+KERNEL_CLONES
+static void bitslice_row (uint64_t * restrict out,
+		const uint64_t * restrict up, const uint64_t * restrict mid, const uint64_t * restrict down,
+		const uint64_t * restrict tail, const uint64_t * restrict cond, int nwords) {
+	int k;
+	for (k = 0; k < nwords; ++k) {
+		// Neighbour planes : left neighbour (x - 1) is obtained by a shift towards high bits
+		uint64_t uL = (up[k] << 1) | (up[k - 1] >> 63);
+		uint64_t uC = up[k];
+		uint64_t uR = (up[k] >> 1) | (up[k + 1] << 63);
+		uint64_t mL = (mid[k] << 1) | (mid[k - 1] >> 63);
+		uint64_t mR = (mid[k] >> 1) | (mid[k + 1] << 63);
+		uint64_t dL = (down[k] << 1) | (down[k - 1] >> 63);
+		uint64_t dC = down[k];
+		uint64_t dR = (down[k] >> 1) | (down[k + 1] << 63);
+
+		uint64_t birth = bitAdderOneOrTwo (uL, uC, uR, mL, mR, dL, dC, dR);
+		out[k] = birth & cond[k] & ~mid[k] & ~tail[k];
+	}
+}
+
+static int bitslice_step (engine_t * engine, uint32_t generations) {
+	bitslice_engine_t * e = (bitslice_engine_t *) engine;
+	int nwords = e->stride - 2;
+	uint32_t g, y;
+
+	for (g = 0; g < generations; ++g) {
+		uint64_t * head = e->planes[e->head];
+		uint64_t * tail = e->planes[e->tail];
+		uint64_t * next = e->planes[e->spare];
+
+		for (y = 0; y < engine->ysize; ++y)
+			bitslice_row (row (next, y, e->stride),
+					row (head, y - 1, e->stride), row (head, y, e->stride), row (head, y + 1, e->stride),
+					row (tail, y, e->stride), row (e->cond, y, e->stride), nwords);
+
+		// Rotate : heads become tails, and the old tail plane is reused
+		int oldTail = e->tail;
+		e->tail = e->head;
+		e->head = e->spare;
+		e->spare = oldTail;
+	}
+	return 0;
+}
+
+static char * bitslice_export (engine_t * engine, char * scratch) {
+	bitslice_engine_t * e = (bitslice_engine_t *) engine;
+	uint32_t xsize = engine->xsize;
+	uint32_t x, y;
+
+	for (y = 0; y < engine->ysize; ++y) {
+		char * line = &scratch[(y + 1) * (xsize + 2) + 1];
+		const uint64_t * cond = row (e->cond, y, e->stride);
+		const uint64_t * head = row (e->planes[e->head], y, e->stride);
+		const uint64_t * tail = row (e->planes[e->tail], y, e->stride);
+		for (x = 0; x < xsize; x += WORD_BITS) {
+			uint32_t w = x / WORD_BITS;
+			uint32_t n = xsize - x < WORD_BITS ? xsize - x : WORD_BITS;
+			uint32_t i;
+			if (cond[w] == 0) {
+				memset (&line[x], C_INSULATOR, n);
+				continue;
+			}
+			// state = cond + head + 2 * tail gives the protocol values
+			for (i = 0; i < n; ++i)
+				line[x + i] = ((cond[w] >> i) & 1) + ((head[w] >> i) & 1) + 2 * ((tail[w] >> i) & 1);
+		}
+	}
+	return scratch;
+}
+
+static uint64_t bitslice_activity (engine_t * engine) {
+	bitslice_engine_t * e = (bitslice_engine_t *) engine;
+	const uint64_t * head = e->planes[e->head];
+	const uint64_t * tail = e->planes[e->tail];
+	uint32_t size = e->stride * (engine->ysize + 2);
+	uint32_t i;
+	uint64_t count = 0;
+	for (i = 0; i < size; ++i)
+		count += __builtin_popcountll (head[i]) + __builtin_popcountll (tail[i]);
+	return count;
+}
+
+static uint64_t plane_hash (const uint64_t * plane, uint32_t stride, uint32_t xsize, uint32_t ysize,
+		char state) {
+	uint64_t hash = 0;
+	uint32_t y, w;
+	for (y = 0; y < ysize; ++y) {
+		const uint64_t * line = row ((uint64_t *) plane, y, stride);
+		for (w = 0; w < stride - 2; ++w) {
+			uint64_t bits = line[w];
+			while (bits != 0) {
+				uint32_t x = w * WORD_BITS + __builtin_ctzll (bits);
+				hash += engineCellHash ((x + 1) + (y + 1) * (xsize + 2), state);
+				bits &= bits - 1;
+			}
+		}
+	}
+	return hash;
+}
+
+static uint64_t bitslice_hash (engine_t * engine) {
+	bitslice_engine_t * e = (bitslice_engine_t *) engine;
+	return plane_hash (e->planes[e->head], e->stride, engine->xsize, engine->ysize, C_HEAD) +
+		plane_hash (e->planes[e->tail], e->stride, engine->xsize, engine->ysize, C_TAIL);
+}
+
+static void bitslice_destroy (engine_t * engine) {
+	bitslice_engine_t * e = (bitslice_engine_t *) engine;
+	free (e->cond);
+	free (e->planes[0]);
+	free (e->planes[1]);
+	free (e->planes[2]);
+	free (e);
+}
+
+const engine_ops_t bitsliceEngine = {
+	"bitslice", bitslice_create, bitslice_step, bitslice_export, NULL, bitslice_activity,
+	bitslice_hash, bitslice_destroy
+};
@@ -0,0 +1,280 @@
+#include "engine.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../protocol/protocol.h"
+
+/* Cycle detection wrapper.
+ *
+ * The simulation is stepped by a fixed number of generations (its sampling), so cycles are
+ * looked for between frames : a frame is the state after one step, and periods count frames.
+ * While searching, the hash of each frame (from the hash op of the inner engine) is fed to
+ * Brent's cycle detection algorithm (constant memory : a saved hash, and the distance to it).
+ * When the current hash equals the saved one, the distance is a candidate period P.
+ * The search gives up after CYCLE_SEARCH_FRAMES frames.
+ *
+ * The candidate is then checked while recording : the P next frames are stored, and the frame
+ * after them must be identical to the first one (which rules out hash collisions).
+ * As the conductors never change, a state is stored as the sorted lists of its heads and tails,
+ * on top of a common map where they are all wires.
+ *
+ * Once the cycle is confirmed, the inner engine is destroyed, and advancing the simulation is
+ * only moving the position in the cycle, modulo P.
+ */
+
+// Frames hashed before giving up on finding a cycle
+#define CYCLE_SEARCH_FRAMES (1u << 20)
+
+typedef enum {
+	Searching, Recording, Cycling, Disabled
+} cycle_phase_t;
+
+typedef struct {
+	engine_t base;
+	engine_t * inner;
+	char * scratch;
+	size_t maxMemory;
+
+	cycle_phase_t phase;
+	uint32_t generations; // per frame, 0 before the first step
+
+	// Brent's algorithm
+	uint64_t savedHash;
+	uint64_t power, distance;
+	uint64_t searched;
+
+	// Recorded states : frame f is cells[frames[f]] to cells[frames[f + 1]] excluded,
+	// as bordered map indexes with the state in the 2 low bits.
+	char * wires;
+	uint64_t * cells;
+	uint32_t nbCells, cellCapacity;
+	uint32_t * frames;
+	uint32_t period;
+	uint32_t position;
+} cycle_engine_t;
+
+static const engine_ops_t cycleEngine;
+
+static size_t used_memory (cycle_engine_t * e) {
+	return e->cellCapacity * sizeof (uint64_t) + (e->period + 1) * sizeof (uint32_t);
+}
+
+static void stop_recording (cycle_engine_t * e) {
+	free (e->cells);
+	free (e->frames);
+	free (e->wires);
+	e->cells = NULL;
+	e->frames = NULL;
+	e->wires = NULL;
+}
+
+/* Stores the current state of the inner engine as the next frame.
+ * Returns 0 on success, -1 if it does not fit in memory or the inner engine failed (which its
+ * next step reports).
+ */
+static int record_frame (cycle_engine_t * e, uint32_t frame) {
+	const char * map = engineExport (e->inner, e->scratch);
+	size_t i, size = engineMapCells (e->base.xsize, e->base.ysize);
+	if (map == NULL)
+		return -1;
+
+	if (e->wires == NULL) {
+		e->wires = malloc (size * sizeof (char));
+		assert (e->wires != NULL);
+		for (i = 0; i < size; ++i)
+			e->wires[i] = map[i] == C_INSULATOR ? C_INSULATOR : C_WIRE;
+	}
+
+	e->frames[frame] = e->nbCells;
+	for (i = 0; i < size; ++i) {
+		if (map[i] == C_HEAD || map[i] == C_TAIL) {
+			if (e->nbCells == e->cellCapacity) {
+				e->cellCapacity = e->cellCapacity * 2 + 1024;
+				if (used_memory (e) > e->maxMemory)
+					return -1;
+				e->cells = realloc (e->cells, e->cellCapacity * sizeof (uint64_t));
+				assert (e->cells != NULL);
+			}
+			e->cells[e->nbCells++] = ((uint64_t) i << 2) | map[i];
+		}
+	}
+	e->frames[frame + 1] = e->nbCells;
+	return 0;
+}
+
+/* Checks that the current state of the inner engine is the first recorded frame */
+static int is_first_frame (cycle_engine_t * e) {
+	const char * map = engineExport (e->inner, e->scratch);
+	size_t i, size = engineMapCells (e->base.xsize, e->base.ysize);
+	uint32_t c = 0, end = e->frames[1];
+	if (map == NULL)
+		return 0;
+
+	for (i = 0; i < size; ++i) {
+		if (map[i] == C_HEAD || map[i] == C_TAIL) {
+			if (c == end || e->cells[c] != (((uint64_t) i << 2) | map[i]))
+				return 0;
+			c++;
+		}
+	}
+	return c == end;
+}
+
+static void start_search (cycle_engine_t * e) {
+	e->phase = Searching;
+	e->savedHash = e->inner->ops->hash (e->inner);
+	e->power = 1;
+	e->distance = 0;
+}
+
+static void start_recording (cycle_engine_t * e, uint32_t period) {
+	e->phase = Recording;
+	e->period = period;
+	e->position = 0;
+	e->nbCells = 0;
+	e->cellCapacity = 0;
+	e->cells = NULL;
+	e->wires = NULL;
+	e->frames = malloc ((period + 1) * sizeof (uint32_t));
+	assert (e->frames != NULL);
+}
+
+/* One frame of the inner engine, and update of the detection.
+ * Returns -1 if the inner engine failed.
+ */
+static int step_inner (cycle_engine_t * e) {
+	if (engineStep (e->inner, e->generations) != 0)
+		return -1;
+
+	if (e->phase == Searching) {
+		uint64_t hash = e->inner->ops->hash (e->inner);
+		e->distance++;
+		if (++e->searched > CYCLE_SEARCH_FRAMES) {
+			e->phase = Disabled; // No cycle, or after a too long transient
+		} else if (hash == e->savedHash) {
+			if (e->distance * sizeof (uint32_t) < e->maxMemory)
+				start_recording (e, e->distance);
+			else
+				e->phase = Disabled; // Period too long to be stored
+		} else if (e->distance == e->power) {
+			e->savedHash = hash;
+			e->power *= 2;
+			e->distance = 0;
+		}
+	}
+
+	if (e->phase == Recording) {
+		if (e->position < e->period) {
+			// Record the state, and check that it fits in memory
+			if (record_frame (e, e->position) != 0) {
+				stop_recording (e);
+				e->phase = Disabled;
+			} else {
+				e->position++;
+			}
+		} else if (is_first_frame (e)) {
+			// Confirmed : the inner engine is not needed anymore
+			e->position = 0;
+			e->phase = Cycling;
+			engineDestroy (e->inner);
+			e->inner = NULL;
+		} else {
+			// Hash collision
+			stop_recording (e);
+			start_search (e);
+		}
+	}
+	return 0;
+}
+
+engine_t * cycleEngineCreate (engine_t * inner, size_t maxMemory) {
+	assert (inner->ops->hash != NULL);
+	cycle_engine_t * e = malloc (sizeof (cycle_engine_t));
+	assert (e != NULL);
+
+	e->base.ops = &cycleEngine;
+	e->base.xsize = inner->xsize;
+	e->base.ysize = inner->ysize;
+	e->inner = inner;
+	e->scratch = engineAllocMap (inner->xsize, inner->ysize);
+	e->maxMemory = maxMemory;
+	e->cells = NULL;
+	e->frames = NULL;
+	e->wires = NULL;
+	e->generations = 0;
+	e->searched = 0;
+
+	start_search (e);
+	return &e->base;
+}
+
+/* Sessions always step by their sampling : a step of another size restarts the search, as the
+ * frames seen so far are not comparable anymore. Once cycling, only multiples of the frame size
+ * can be stepped, as the generations in between are not stored.
+ */
+static int cycle_step (engine_t * engine, uint32_t generations) {
+	cycle_engine_t * e = (cycle_engine_t *) engine;
+
+	if (e->phase == Cycling) {
+		assert (generations % e->generations == 0);
+		e->position = (e->position + (uint64_t) (generations / e->generations)) % e->period;
+		return 0;
+	} else if (e->phase == Disabled) {
+		return engineStep (e->inner, generations);
+	}
+
+	if (generations != e->generations) {
+		if (e->phase == Recording)
+			stop_recording (e);
+		e->generations = generations;
+		e->searched = 0;
+		start_search (e);
+	}
+	return step_inner (e);
+}
+
+static char * cycle_export (engine_t * engine, char * scratch) {
+	cycle_engine_t * e = (cycle_engine_t *) engine;
+	if (e->phase != Cycling)
+		return engineExport (e->inner, scratch);
+
+	memcpy (scratch, e->wires, engineMapCells (engine->xsize, engine->ysize) * sizeof (char));
+	uint32_t c;
+	for (c = e->frames[e->position]; c < e->frames[e->position + 1]; ++c)
+		scratch[e->cells[c] >> 2] = e->cells[c] & C_BIT_MASK;
+	return scratch;
+}
+
+static int cycle_pack (engine_t * engine, uint32_t * frame) {
+	cycle_engine_t * e = (cycle_engine_t *) engine;
+	if (e->phase != Cycling)
+		return enginePack (e->inner, frame, e->scratch);
+
+	enginePackMap (cycle_export (engine, e->scratch), engine->xsize, engine->ysize, frame);
+	return 0;
+}
+
+static uint64_t cycle_activity (engine_t * engine) {
+	cycle_engine_t * e = (cycle_engine_t *) engine;
+	if (e->phase == Cycling)
+		return e->frames[e->position + 1] - e->frames[e->position];
+	else if (e->inner->ops->activity != NULL)
+		return e->inner->ops->activity (e->inner);
+	else
+		return 0;
+}
+
+static void cycle_destroy (engine_t * engine) {
+	cycle_engine_t * e = (cycle_engine_t *) engine;
+	if (e->inner != NULL)
+		engineDestroy (e->inner);
+	stop_recording (e);
+	free (e->scratch);
+	free (e);
+}
+
+static const engine_ops_t cycleEngine = {
+	"cycle", NULL, cycle_step, cycle_export, cycle_pack, cycle_activity, NULL, cycle_destroy
+};
@@ -0,0 +1,144 @@
+#include "dirty.h"
+#include "engine.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Tiles are 32x32 cells (64 message words once packed), and when there are more than
+ * MAX_RECTS rectangles, their bounding box is sent instead to bound the header overhead.
+ */
+#define TILE_SIZE 32
+#define MAX_RECTS 64
+
+struct dirty_tracker {
+	uint32_t xsize, ysize;
+	char * last;
+
+	uint32_t ntx, nty;
+	uint8_t * dirty; // one per tile
+
+	rect_t * rects;
+	uint32_t capacity;
+};
+
+dirty_tracker_t * dirtyCreate (const char * borderedMap, uint32_t xsize, uint32_t ysize) {
+	dirty_tracker_t * t = malloc (sizeof (dirty_tracker_t));
+	assert (t != NULL);
+
+	size_t size = engineMapCells (xsize, ysize) * sizeof (char);
+	t->xsize = xsize;
+	t->ysize = ysize;
+	t->last = malloc (size);
+	assert (t->last != NULL);
+	memcpy (t->last, borderedMap, size);
+
+	t->ntx = (xsize + TILE_SIZE - 1) / TILE_SIZE;
+	t->nty = (ysize + TILE_SIZE - 1) / TILE_SIZE;
+	t->dirty = malloc (t->ntx * sizeof (uint8_t));
+	assert (t->dirty != NULL);
+
+	t->capacity = MAX_RECTS + t->ntx;
+	t->rects = malloc (t->capacity * sizeof (rect_t));
+	assert (t->rects != NULL);
+	return t;
+}
+
+uint32_t dirtyUpdate (dirty_tracker_t * t, const char * borderedMap, const rect_t ** rects) {
+	uint32_t stride = t->xsize + 2;
+	uint32_t nbRects = 0;
+	uint32_t prevStart = 0, prevEnd = 0; // rects which ended on the previous tile row
+	int tooMany = 0;
+	rect_t bounds = { t->xsize, t->ysize, 0, 0 };
+	uint32_t tx, ty, y;
+
+	for (ty = 0; ty < t->nty; ++ty) {
+		uint32_t y1 = ty * TILE_SIZE;
+		uint32_t y2 = y1 + TILE_SIZE < t->ysize ? y1 + TILE_SIZE : t->ysize;
+
+		// Find dirty tiles of this row of tiles, and update them in last map
+		int anyDirty = 0;
+		memset (t->dirty, 0, t->ntx * sizeof (uint8_t));
+		for (y = y1; y < y2; ++y) {
+			const char * from = &borderedMap[(y + 1) * stride + 1];
+			char * to = &t->last[(y + 1) * stride + 1];
+			if (memcmp (from, to, t->xsize) == 0)
+				continue;
+
+			for (tx = 0; tx < t->ntx; ++tx) {
+				uint32_t x1 = tx * TILE_SIZE;
+				uint32_t w = x1 + TILE_SIZE < t->xsize ? TILE_SIZE : t->xsize - x1;
+				if (memcmp (&from[x1], &to[x1], w) != 0) {
+					t->dirty[tx] = 1;
+					anyDirty = 1;
+				}
+			}
+			memcpy (to, from, t->xsize);
+		}
+		if (!anyDirty) {
+			prevStart = prevEnd = nbRects;
+			continue;
+		}
+
+		// Merge runs of dirty tiles into rectangles
+		uint32_t rowStart = nbRects;
+		tx = 0;
+		while (tx < t->ntx) {
+			if (!t->dirty[tx]) {
+				tx++;
+				continue;
+			}
+			uint32_t runStart = tx;
+			while (tx < t->ntx && t->dirty[tx])
+				tx++;
+
+			rect_t r;
+			r.x1 = runStart * TILE_SIZE;
+			r.x2 = tx * TILE_SIZE < t->xsize ? tx * TILE_SIZE : t->xsize;
+			r.y1 = y1;
+			r.y2 = y2;
+
+			if (r.x1 < bounds.x1) bounds.x1 = r.x1;
+			if (r.y1 < bounds.y1) bounds.y1 = r.y1;
+			if (r.x2 > bounds.x2) bounds.x2 = r.x2;
+			if (r.y2 > bounds.y2) bounds.y2 = r.y2;
+			if (tooMany)
+				continue;
+
+			// Extend a rectangle of the previous row with the same columns, or add it
+			uint32_t i;
+			for (i = prevStart; i < prevEnd; ++i)
+				if (t->rects[i].x1 == r.x1 && t->rects[i].x2 == r.x2)
+					break;
+			if (i < prevEnd) {
+				t->rects[i].y2 = y2;
+				// Move it with the rects of this row
+				rect_t tmp = t->rects[i];
+				t->rects[i] = t->rects[prevEnd - 1];
+				t->rects[prevEnd - 1] = tmp;
+				prevEnd--;
+				rowStart--;
+			} else if (nbRects < MAX_RECTS) {
+				t->rects[nbRects++] = r;
+			} else {
+				tooMany = 1;
+			}
+		}
+		prevStart = rowStart;
+		prevEnd = nbRects;
+	}
+
+	if (tooMany) {
+		t->rects[0] = bounds;
+		nbRects = 1;
+	}
+	*rects = t->rects;
+	return nbRects;
+}
+
+void dirtyDestroy (dirty_tracker_t * t) {
+	free (t->last);
+	free (t->dirty);
+	free (t->rects);
+	free (t);
+}
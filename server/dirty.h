@@ -0,0 +1,31 @@
+#ifndef DIRTY_H
+#define DIRTY_H
+
+#include <stdint.h>
+
+/* Dirty rectangle tracking.
+ *
+ * Keeps a copy of the last sent map, cut in tiles. Each update compares the new map to it,
+ * and returns the tiles which changed, merged into a small set of rectangles.
+ * Maps are bordered maps (see engine.h), rectangles are in map coordinates.
+ */
+
+typedef struct {
+	uint32_t x1, y1, x2, y2; // [x1, x2) * [y1, y2)
+} rect_t;
+
+typedef struct dirty_tracker dirty_tracker_t;
+
+/* Creates a tracker, with the map the client already has.
+ */
+dirty_tracker_t * dirtyCreate (const char * borderedMap, uint32_t xsize, uint32_t ysize);
+
+/* Compares borderedMap with the last one, which is then replaced.
+ * Returns the number of changed rectangles, and sets *rects to an array of them, which is
+ * valid until the next call.
+ */
+uint32_t dirtyUpdate (dirty_tracker_t * tracker, const char * borderedMap, const rect_t ** rects);
+
+void dirtyDestroy (dirty_tracker_t * tracker);
+
+#endif
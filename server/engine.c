@@ -0,0 +1,201 @@
+#include "engine.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../protocol/protocol.h"
+#include "../protocol/cellpack.h"
+
+#define CELLS_PER_WORD (M_BIT_SIZE / C_BIT_SIZE)
+
+static inline char * map (char * tab, int x, int y, int xsize) { return &tab[x + y * xsize]; }
+
+/* Registry */
+
+static const engine_ops_t * engines[] = {
+	&autoEngine,
+	&bitsliceEngine,
+	&tiledEngine,
+	&frontierEngine,
+	&packedEngine,
+	&graphEngine,
+	&hashlifeEngine,
+	&stripsEngine,
+	&charEngine
+};
+
+#define NB_ENGINES (sizeof (engines) / sizeof (engines[0]))
+
+const engine_ops_t * engineDefault (void) {
+	return engines[0];
+}
+
+const engine_ops_t * engineFind (const char * name) {
+	uint32_t i;
+	for (i = 0; i < NB_ENGINES; ++i)
+		if (strcmp (engines[i]->name, name) == 0)
+			return engines[i];
+	return NULL;
+}
+
+void engineList (FILE * out) {
+	uint32_t i;
+	for (i = 0; i < NB_ENGINES; ++i)
+		fprintf (out, i == 0 ? "%s" : " %s", engines[i]->name);
+}
+
+char * engineAllocMap (uint32_t xsize, uint32_t ysize) {
+	char * m = malloc (engineMapCells (xsize, ysize) * sizeof (char));
+	assert (m != NULL);
+
+	uint32_t i;
+	// horiz lines
+	for (i = 0; i < xsize + 2; ++i) {
+		*map (m, i, 0, xsize + 2) = C_INSULATOR;
+		*map (m, i, ysize + 1, xsize + 2) = C_INSULATOR;
+	}
+	// vert lines
+	for (i = 0; i < ysize + 2; ++i) {
+		*map (m, 0, i, xsize + 2) = C_INSULATOR;
+		*map (m, xsize + 1, i, xsize + 2) = C_INSULATOR;
+	}
+	return m;
+}
+
+engine_t * engineCreate (const engine_ops_t * ops,
+		const char * borderedMap, uint32_t xsize, uint32_t ysize,
+		const engine_params_t * params) {
+	engine_t * engine = ops->create (borderedMap, xsize, ysize, params);
+	if (engine != NULL) {
+		engine->ops = ops;
+		engine->xsize = xsize;
+		engine->ysize = ysize;
+	}
+	return engine;
+}
+
+uint64_t engineHashMap (const char * borderedMap, uint32_t xsize, uint32_t ysize) {
+	uint32_t i, size = engineMapCells (xsize, ysize);
+	uint64_t hash = 0;
+	for (i = 0; i < size; ++i)
+		if (borderedMap[i] == C_HEAD || borderedMap[i] == C_TAIL)
+			hash += engineCellHash (i, borderedMap[i]);
+	return hash;
+}
+
+uint64_t engineHash (engine_t * engine, char * scratch) {
+	if (engine->ops->hash != NULL)
+		return engine->ops->hash (engine);
+
+	const char * map = engineExport (engine, scratch);
+	return map != NULL ? engineHashMap (map, engine->xsize, engine->ysize) : 0;
+}
+
+void enginePackMap (const char * borderedMap, uint32_t xsize, uint32_t ysize, uint32_t * frame) {
+	uint32_t y;
+	frame[(uint64_t) xsize * ysize / CELLS_PER_WORD] = 0; // may have no cell
+	for (y = 0; y < ysize; ++y)
+		cellPack (frame, (uint64_t) y * xsize, &borderedMap[(size_t) (y + 1) * (xsize + 2) + 1], xsize);
+}
+
+int enginePack (engine_t * engine, uint32_t * frame, char * scratch) {
+	if (engine->ops->pack != NULL)
+		return engine->ops->pack (engine, frame);
+
+	const char * map = engineExport (engine, scratch);
+	if (map == NULL)
+		return -1;
+	enginePackMap (map, engine->xsize, engine->ysize, frame);
+	return 0;
+}
+
+/* Reference engine : one char per cell, double buffered.
+ */
+typedef struct {
+	engine_t base;
+	char * maps[2];
+	int dir;
+} char_engine_t;
+
+static engine_t * char_create (const char * borderedMap, uint32_t xsize, uint32_t ysize,
+		const engine_params_t * params) {
+	(void) params;
+	char_engine_t * e = malloc (sizeof (char_engine_t));
+	assert (e != NULL);
+
+	size_t size = engineMapCells (xsize, ysize) * sizeof (char);
+	e->maps[0] = engineAllocMap (xsize, ysize);
+	e->maps[1] = engineAllocMap (xsize, ysize);
+	memcpy (e->maps[0], borderedMap, size);
+	e->dir = 0;
+	return &e->base;
+}
+
+static int char_step (engine_t * engine, uint32_t generations) {
+	char_engine_t * e = (char_engine_t *) engine;
+	uint32_t k;
+	for (k = 0; k < generations; ++k)
+		update_map (&e->dir, e->maps, engine->xsize, engine->ysize);
+	return 0;
+}
+
+static char * char_export (engine_t * engine, char * scratch) {
+	(void) scratch;
+	char_engine_t * e = (char_engine_t *) engine;
+	return e->maps[e->dir];
+}
+
+static void char_destroy (engine_t * engine) {
+	char_engine_t * e = (char_engine_t *) engine;
+	free (e->maps[0]);
+	free (e->maps[1]);
+	free (e);
+}
+
+const engine_ops_t charEngine = {
+	"char", char_create, char_step, char_export, NULL, NULL, NULL, char_destroy
+};
+
+void update_map (int * dir, char ** maps, uint32_t xs, uint32_t ys) {
+	char * fromMap = maps[*dir];
+	char * toMap = maps[1 - *dir];
+	uint32_t i, j;
+
+	static const int diffs[][2] = {
+		{ -1, -1 },
+		{ 0, -1 },
+		{ 1, -1 },
+		{ 1, 0 },
+		{ 1, 1 },
+		{ 0, 1 },
+		{ -1, 1 },
+		{ -1, 0 }
+	};
+
+	for (i = 1; i < xs + 1; ++i)
+		for (j = 1; j < ys + 1; ++j) {
+			char state = *map (fromMap, i, j, xs + 2);
+			char * out = map (toMap, i, j, xs + 2);
+
+			if (state == C_INSULATOR) {
+				*out = C_INSULATOR;
+			} else if (state == C_WIRE) {
+				int nbHeads = 0;
+				int k;
+				for (k = 0; k < 8; ++k)
+					if (*map (fromMap, i + diffs[k][0], j + diffs[k][1], xs + 2) == C_HEAD)
+						nbHeads++;
+				if (nbHeads == 1 || nbHeads == 2)
+					*out = C_HEAD;
+				else
+					*out = C_WIRE;
+			} else if (state == C_HEAD) {
+				*out = C_TAIL;
+			} else { // C_TAIL
+				*out = C_WIRE;
+			}
+		}
+
+	*dir = 1 - *dir;
+}
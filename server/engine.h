@@ -0,0 +1,167 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Simulation engines.
+ *
+ * An engine holds the state of one simulation, in the representation that suits it best.
+ * Engines exchange maps with the rest of the server as "bordered maps" : char arrays of size
+ * (xsize + 2) * (ysize + 2), surrounded by a line of C_INSULATOR cells, where the cell (x, y)
+ * of the simulated map is stored at index (x + 1) + (y + 1) * (xsize + 2).
+ * Engines index them with 32-bit integers, so they have at most ENGINE_MAX_MAP_CELLS cells
+ * (which maps loaded from files are checked against).
+ */
+
+#define ENGINE_MAX_MAP_CELLS UINT32_MAX
+
+typedef struct engine engine_t;
+
+/* Settings common to all engines (each engine uses the ones it understands).
+ */
+typedef struct {
+	// Number of threads of parallel engines, 0 means one per online cpu.
+	uint32_t threads;
+	// Number of processes of the strips engine, 0 means one per online cpu.
+	uint32_t processes;
+} engine_params_t;
+
+typedef struct engine_ops {
+	// Name used to select the engine on the command line
+	const char * name;
+
+	/* Builds a new engine from a bordered map (which is only read during the call).
+	 * Returns NULL on error.
+	 */
+	engine_t * (*create) (const char * borderedMap, uint32_t xsize, uint32_t ysize,
+			const engine_params_t * params);
+
+	/* Computes the given number of generations.
+	 * Returns 0 on success, -1 if the engine failed (a worker process of the strips engine
+	 * died) : its state is lost, and it can only be destroyed.
+	 */
+	int (*step) (engine_t * engine, uint32_t generations);
+
+	/* Returns the current state as a bordered map.
+	 * It is either an internal buffer of the engine, or 'scratch' (a bordered map allocated
+	 * with engineAllocMap) after it has been filled. It stays valid until the next call to step.
+	 * Returns NULL if the engine failed.
+	 */
+	char * (*export) (engine_t * engine, char * scratch);
+
+	/* Writes the current state in the frame format of the protocol (16 cells per word, rows
+	 * one after the other, see protocol.h) to 'frame', in host byte order.
+	 * Optional (NULL if the engine does not store cells in a layout close to it : the state is
+	 * then exported, and packed).
+	 * Returns 0 on success, -1 if the engine failed.
+	 */
+	int (*pack) (engine_t * engine, uint32_t * frame);
+
+	/* Returns the number of heads and tails (cells which will change at the next generation).
+	 * Optional (NULL if the engine can not tell it cheaply).
+	 * The activity and the hash of a failed engine are 0 : the failure is reported by the next
+	 * step, export or pack.
+	 */
+	uint64_t (*activity) (engine_t * engine);
+
+	/* Returns the state hash, as defined by engineHashMap (so that it does not depend on the
+	 * engine). Optional (NULL if the engine has no faster way than hashing an export).
+	 */
+	uint64_t (*hash) (engine_t * engine);
+
+	void (*destroy) (engine_t * engine);
+} engine_ops_t;
+
+/* Common header of every engine state, which must be its first member.
+ */
+struct engine {
+	const engine_ops_t * ops;
+	uint32_t xsize, ysize;
+};
+
+/* Available engines */
+extern const engine_ops_t charEngine;
+extern const engine_ops_t bitsliceEngine;
+extern const engine_ops_t tiledEngine;
+extern const engine_ops_t frontierEngine;
+extern const engine_ops_t packedEngine;
+extern const engine_ops_t graphEngine;
+extern const engine_ops_t hashlifeEngine;
+extern const engine_ops_t stripsEngine;
+extern const engine_ops_t autoEngine;
+
+/* Reference rules : computes maps[1 - *dir] from maps[*dir] (bordered maps of xs * ys cells),
+ * and flips *dir. The char engine uses it, and the other engines are checked against it.
+ */
+void update_map (int * dir, char ** maps, uint32_t xs, uint32_t ys);
+
+/* Default engine, and lookup by name (NULL if not found).
+ */
+const engine_ops_t * engineDefault (void);
+const engine_ops_t * engineFind (const char * name);
+
+/* Print the list of engine names, separated by spaces.
+ */
+void engineList (FILE * out);
+
+/* Allocates a bordered map for a xsize * ysize simulation, with its borders set to C_INSULATOR.
+ * The inside is left uninitialized. Free it with free().
+ */
+char * engineAllocMap (uint32_t xsize, uint32_t ysize);
+
+/* Cells of a bordered map (computed in size_t, as maps loaded from files may be huge) */
+static inline size_t engineMapCells (uint32_t xsize, uint32_t ysize) {
+	return ((size_t) xsize + 2) * ((size_t) ysize + 2);
+}
+
+/* State hash : the sum of engineCellHash over the heads and tails of a bordered map.
+ * Wires are ignored, as the conductors never change during a simulation.
+ * Being a sum, it can be updated incrementally when cells change.
+ */
+static inline uint64_t engineCellHash (uint32_t index, char state) {
+	// splitmix64 finalizer
+	uint64_t z = (uint64_t) index * 4 + state + 0x9E3779B97F4A7C15ull;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+uint64_t engineHashMap (const char * borderedMap, uint32_t xsize, uint32_t ysize);
+
+/* Cycle detection.
+ * Wraps the 'inner' engine (which is then owned by the wrapper), and looks for a cycle in the
+ * sequence of frames (states after each step) with the hash op of the inner engine, which is
+ * required. Once a cycle is found and checked, its frames are stored (if they fit in maxMemory
+ * bytes) and the inner engine is not used anymore.
+ */
+engine_t * cycleEngineCreate (engine_t * inner, size_t maxMemory);
+
+/* Generic wrappers around engine_ops */
+engine_t * engineCreate (const engine_ops_t * ops,
+		const char * borderedMap, uint32_t xsize, uint32_t ysize,
+		const engine_params_t * params);
+
+static inline int engineStep (engine_t * engine, uint32_t generations) {
+	return engine->ops->step (engine, generations);
+}
+
+static inline char * engineExport (engine_t * engine, char * scratch) {
+	return engine->ops->export (engine, scratch);
+}
+
+/* Packs a bordered map in the frame format (see the pack op) */
+void enginePackMap (const char * borderedMap, uint32_t xsize, uint32_t ysize, uint32_t * frame);
+
+/* Uses the pack op if available, or packs an export in 'scratch' */
+int enginePack (engine_t * engine, uint32_t * frame, char * scratch);
+
+/* Uses the hash op if available, or hashes an export in 'scratch' */
+uint64_t engineHash (engine_t * engine, char * scratch);
+
+static inline void engineDestroy (engine_t * engine) {
+	engine->ops->destroy (engine);
+}
+
+#endif
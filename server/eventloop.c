@@ -0,0 +1,544 @@
+#include "eventloop.h"
+#include "server.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+
+/* Each connection first waits for the init message. Then its session is created by a worker,
+ * and frames are computed by workers, one at a time, when they are requested or while fewer
+ * than 'framesAhead' are ready. Ready frames are queued on the connection, and sent as soon as
+ * they are requested : so the frames computed ahead are sent without waiting for compute.
+ * While 'computing', a worker owns the session (the loop thread only sends queued frames).
+ * In push mode (R_STREAM), requests are the window of frames in flight, and frames are sent at
+ * most one per 'interval' : a client waiting for its interval to elapse is 'paced'.
+ * A viewport received while computing is given to the session with the next job. Frames
+ * computed ahead with the previous viewport are dropped (the session then resyncs the gui), so
+ * that the next frame sent uses the new one.
+ * Once answers go through a shared memory ring (F_SHARED_MEMORY), the loop waits for the wake
+ * fd of the connection instead of the socket to be writable : its events are told apart by
+ * the low bit of the client address.
+ */
+typedef struct client {
+	int sock;
+	int computing;
+	int sending; // waiting for the socket to be writable
+	int wakeFd; // of the shared memory ring, -1 until it is used
+	int closing; // connection ended while computing
+	int dead; // destroyed, freed after the current batch of events
+	session_t * session;
+	uint32_t requests; // frames requested and not sent yet
+	uint32_t ready; // frames computed and not sent yet
+
+	// Push mode
+	uint32_t interval; // microseconds, 0 for no limit
+	uint64_t lastSent, due;
+	int paced;
+
+	// Viewport (R_VIEWPORT) : the last received one, and the one given with the current job
+	uint32_t viewport[5]; // x1, y1, x2, y2, level
+	int viewportChanged;
+	uint32_t jobViewport[5];
+	int jobViewportChanged;
+	int dropAhead; // the current job uses the previous viewport
+	int resync, jobResync; // frames were dropped : the next job resyncs the gui
+
+	// Init data, until the session is created
+	int initialized;
+	uint32_t xsize, ysize, sampling, features, name;
+	char * firstMap;
+	char * mapPath; // R_INIT_FILE, until it is acknowledged
+
+	// Result of the last computation
+	int result;
+	int frameDone;
+
+	struct client * next; // in the job or done queue
+	struct client * nextPaced;
+} client_t;
+
+typedef struct {
+	int serverSock;
+	int localSock; // -1 if none
+	int epoll;
+	int eventFd; // signaled by workers when a job is done
+	int timerFd; // armed for the first paced client
+	const session_settings_t * settings;
+	uint32_t framesAhead;
+
+	pthread_mutex_t lock;
+	pthread_cond_t hasJobs;
+	client_t * jobs, * lastJob; // fifo
+	client_t * done;
+
+	client_t * dead;
+	client_t * paced;
+} event_loop_t;
+
+#define MAX_EVENTS 64
+
+/* Workers */
+
+static void * worker (void * arg) {
+	event_loop_t * loop = arg;
+
+	while (1) {
+		pthread_mutex_lock (&loop->lock);
+		while (loop->jobs == NULL)
+			pthread_cond_wait (&loop->hasJobs, &loop->lock);
+		client_t * c = loop->jobs;
+		loop->jobs = c->next;
+		pthread_mutex_unlock (&loop->lock);
+
+		if (c->session == NULL && c->mapPath != NULL) {
+			c->session = sessionCreateFromFile (c->sock, c->mapPath, c->sampling, c->features,
+					c->name, loop->settings, &c->xsize, &c->ysize);
+			c->result = c->session == NULL ? -1 : 0;
+			c->frameDone = 0;
+		} else if (c->session == NULL) {
+			c->session = sessionCreate (c->sock, c->xsize, c->ysize, c->sampling, c->features,
+					c->name, c->firstMap, loop->settings);
+			c->firstMap = NULL;
+			c->result = c->session == NULL ? -1 : 0;
+			c->frameDone = 0;
+		} else {
+			if (c->jobViewportChanged)
+				sessionSetViewport (c->session, c->jobViewport);
+			if (c->jobResync)
+				sessionResync (c->session);
+			c->result = sessionNextFrame (c->session);
+			c->frameDone = 1;
+		}
+
+		pthread_mutex_lock (&loop->lock);
+		c->next = loop->done;
+		loop->done = c;
+		pthread_mutex_unlock (&loop->lock);
+
+		uint64_t one = 1;
+		if (write (loop->eventFd, &one, sizeof (one)) == -1)
+			perror ("write");
+	}
+	return NULL;
+}
+
+static void submit (event_loop_t * loop, client_t * c) {
+	c->computing = 1;
+	c->jobViewportChanged = c->viewportChanged && c->session != NULL;
+	if (c->jobViewportChanged) {
+		memcpy (c->jobViewport, c->viewport, sizeof (c->viewport));
+		c->viewportChanged = 0;
+	}
+	c->jobResync = c->resync;
+	c->resync = 0;
+
+	pthread_mutex_lock (&loop->lock);
+	c->next = NULL;
+	if (loop->jobs == NULL)
+		loop->jobs = c;
+	else
+		loop->lastJob->next = c;
+	loop->lastJob = c;
+	pthread_cond_signal (&loop->hasJobs);
+	pthread_mutex_unlock (&loop->lock);
+}
+
+/* Clients */
+
+static void watch (event_loop_t * loop, client_t * c, int op, uint32_t events) {
+	struct epoll_event ev;
+	ev.events = events;
+	ev.data.ptr = c;
+	if (epoll_ctl (loop->epoll, op, c->sock, &ev) == -1)
+		perror ("epoll_ctl");
+}
+
+#define WAKE_EVENT(c) ((void *) ((uintptr_t) (c) | 1))
+
+static void watch_wake (event_loop_t * loop, client_t * c) {
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = WAKE_EVENT (c);
+	if (epoll_ctl (loop->epoll, EPOLL_CTL_ADD, c->wakeFd, &ev) == -1)
+		perror ("epoll_ctl");
+}
+
+/* Pacing */
+
+static uint64_t now_us (void) {
+	struct timespec t;
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+/* Arms the timer for the first paced client (or disarms it) */
+static void arm_timer (event_loop_t * loop) {
+	struct itimerspec spec;
+	memset (&spec, 0, sizeof (spec));
+	client_t * c;
+	uint64_t due = UINT64_MAX;
+	for (c = loop->paced; c != NULL; c = c->nextPaced)
+		if (c->due < due)
+			due = c->due;
+	if (due != UINT64_MAX) {
+		spec.it_value.tv_sec = due / 1000000;
+		spec.it_value.tv_nsec = (due % 1000000) * 1000;
+	}
+	if (timerfd_settime (loop->timerFd, TFD_TIMER_ABSTIME, &spec, NULL) == -1)
+		perror ("timerfd_settime");
+}
+
+static void pace (event_loop_t * loop, client_t * c, uint64_t due) {
+	c->due = due;
+	if (!c->paced) {
+		c->paced = 1;
+		c->nextPaced = loop->paced;
+		loop->paced = c;
+	}
+	arm_timer (loop);
+}
+
+static void unpace (event_loop_t * loop, client_t * c) {
+	client_t ** p = &loop->paced;
+	while (*p != c)
+		p = &(*p)->nextPaced;
+	*p = c->nextPaced;
+	c->paced = 0;
+}
+
+static void destroy_client (event_loop_t * loop, client_t * c) {
+	if (c->paced) {
+		unpace (loop, c);
+		arm_timer (loop);
+	}
+	if (!c->closing) {
+		epoll_ctl (loop->epoll, EPOLL_CTL_DEL, c->sock, NULL);
+		if (c->wakeFd != -1)
+			epoll_ctl (loop->epoll, EPOLL_CTL_DEL, c->wakeFd, NULL);
+	}
+	if (c->session != NULL)
+		sessionDestroy (c->session);
+	free (c->firstMap);
+	free (c->mapPath);
+	connectionRelease (c->sock);
+	close (c->sock);
+
+	// Other events of the batch may still refer to it
+	c->dead = 1;
+	c->next = loop->dead;
+	loop->dead = c;
+}
+
+/* The connection ended : destroy the client, or let the worker finish with it */
+static void end_client (event_loop_t * loop, client_t * c) {
+	if (c->computing) {
+		epoll_ctl (loop->epoll, EPOLL_CTL_DEL, c->sock, NULL);
+		if (c->wakeFd != -1)
+			epoll_ctl (loop->epoll, EPOLL_CTL_DEL, c->wakeFd, NULL);
+		c->closing = 1;
+	} else {
+		destroy_client (loop, c);
+	}
+}
+
+/* Starts computing a frame if one is requested, or if it can be computed ahead */
+static void schedule (event_loop_t * loop, client_t * c) {
+	if (c->computing || c->session == NULL)
+		return;
+	if (c->ready >= c->requests && c->ready >= loop->framesAhead)
+		return;
+	if (connectionQueuedFrames (c->sock) >= CONNECTION_FRAMES - 1)
+		return; // Wait for queued frames to be sent
+	submit (loop, c);
+}
+
+/* Drops the frames computed ahead with the previous viewport (or lets the current job finish
+ * first, as it uses it too)
+ */
+static void drop_ahead (client_t * c) {
+	if (c->computing) {
+		c->dropAhead = 1;
+	} else if (c->ready > 0) {
+		connectionDropQueuedFrames (c->sock);
+		c->ready = 0;
+		c->resync = 1;
+	}
+}
+
+/* Handles the result of sending. Returns 0 if the client was ended */
+static int sent (event_loop_t * loop, client_t * c, int res) {
+	if (res == -1 || res == 1) {
+		end_client (loop, c);
+		return 0;
+	}
+	if (c->wakeFd == -1 && (c->wakeFd = connectionWakeFd (c->sock)) != -1)
+		watch_wake (loop, c);
+
+	// Through the ring, the wake fd is always watched
+	int sending = res == 2 && c->wakeFd == -1;
+	if (sending != c->sending) {
+		c->sending = sending;
+		watch (loop, c, EPOLL_CTL_MOD, sending ? EPOLLIN | EPOLLOUT : EPOLLIN);
+	}
+	return 1;
+}
+
+/* Sends the computed frames which are requested, at most one per interval.
+ * Returns 0 if the client was ended.
+ */
+static int deliver (event_loop_t * loop, client_t * c) {
+	while (c->ready > 0 && c->requests > 0 && !c->paced) {
+		if (c->interval > 0) {
+			uint64_t now = now_us ();
+			if (now < c->lastSent + c->interval) {
+				pace (loop, c, c->lastSent + c->interval);
+				return 1;
+			}
+			c->lastSent = now;
+		}
+		c->ready--;
+		c->requests--;
+		if (!sent (loop, c, connectionSendQueuedFrame (c->sock)))
+			return 0;
+	}
+	return 1;
+}
+
+static void accept_clients (event_loop_t * loop, int serverSock) {
+	while (1) {
+		int sock = accept (serverSock, NULL, NULL);
+		if (sock == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				perror ("accept");
+			return;
+		}
+		if (connectionSetNonBlocking (sock) != 0) {
+			close (sock);
+			continue;
+		}
+
+		client_t * c = calloc (1, sizeof (client_t));
+		assert (c != NULL);
+		c->sock = sock;
+		c->wakeFd = -1;
+		watch (loop, c, EPOLL_CTL_ADD, EPOLLIN);
+	}
+}
+
+static void client_readable (event_loop_t * loop, client_t * c) {
+	int res;
+
+	if (!c->initialized) {
+		c->features = SESSION_FEATURES | F_FRAME_BATCH;
+		res = connectionWaitForInitEx (c->sock, &c->xsize, &c->ysize, &c->sampling, &c->features,
+				&c->name, &c->firstMap, &c->mapPath);
+		if (res == 2)
+			return;
+		if (res != 0) {
+			end_client (loop, c);
+			return;
+		}
+		c->initialized = 1;
+
+		// The init acknowledgement may not be completely sent
+		if (!sent (loop, c, connectionFlush (c->sock)))
+			return;
+		submit (loop, c); // Create the session
+	}
+
+	// Count frame requests, and serve them with ready frames
+	uint32_t count, viewport[5];
+	memcpy (viewport, c->viewport, sizeof (viewport)); // only changed by R_VIEWPORT
+	while ((res = connectionWaitFrameRequestEx (c->sock, &count, &c->interval, viewport)) == 0) {
+		if (count == 0 && memcmp (viewport, c->viewport, sizeof (viewport)) != 0) {
+			memcpy (c->viewport, viewport, sizeof (viewport));
+			c->viewportChanged = 1;
+			drop_ahead (c);
+		}
+		c->requests = c->requests + count < c->requests ? UINT32_MAX : c->requests + count;
+		if (!deliver (loop, c))
+			return;
+	}
+	if (res != 2)
+		end_client (loop, c);
+	else
+		schedule (loop, c);
+}
+
+static void client_writable (event_loop_t * loop, client_t * c) {
+	if (sent (loop, c, connectionFlush (c->sock)))
+		schedule (loop, c); // Room may have been made for frames ahead
+}
+
+static void session_created (event_loop_t * loop, client_t * c) {
+	// Answer an init from a map file, now that its sizes are known
+	if (c->mapPath != NULL) {
+		free (c->mapPath);
+		c->mapPath = NULL;
+		if (!sent (loop, c, connectionSendInitAck (c->sock, c->features, c->xsize, c->ysize)))
+			return;
+	}
+	schedule (loop, c);
+}
+
+/* Workers finished some jobs */
+static void jobs_done (event_loop_t * loop) {
+	uint64_t count;
+	if (read (loop->eventFd, &count, sizeof (count)) == -1 && errno != EAGAIN)
+		perror ("read");
+
+	pthread_mutex_lock (&loop->lock);
+	client_t * c = loop->done;
+	loop->done = NULL;
+	pthread_mutex_unlock (&loop->lock);
+
+	while (c != NULL) {
+		client_t * next = c->next;
+		c->computing = 0;
+		int dropAhead = c->dropAhead;
+		c->dropAhead = 0;
+
+		if (c->closing || c->result != 0) {
+			destroy_client (loop, c);
+		} else if (!c->frameDone) {
+			session_created (loop, c);
+		} else {
+			// Send it now if already requested (unless the viewport changed meanwhile)
+			c->ready++;
+			if (dropAhead)
+				drop_ahead (c);
+			if (deliver (loop, c))
+				schedule (loop, c);
+		}
+		c = next;
+	}
+}
+
+/* Paced clients may send their next frame */
+static void timer_expired (event_loop_t * loop) {
+	uint64_t count;
+	if (read (loop->timerFd, &count, sizeof (count)) == -1 && errno != EAGAIN)
+		perror ("read");
+
+	// Take the due clients out, as delivering may pace them again
+	uint64_t now = now_us ();
+	client_t * due = NULL, ** p = &loop->paced;
+	while (*p != NULL) {
+		client_t * c = *p;
+		if (c->due <= now) {
+			*p = c->nextPaced;
+			c->paced = 0;
+			c->nextPaced = due;
+			due = c;
+		} else {
+			p = &c->nextPaced;
+		}
+	}
+	arm_timer (loop);
+
+	while (due != NULL) {
+		client_t * c = due;
+		due = c->nextPaced;
+		if (!c->closing && deliver (loop, c))
+			schedule (loop, c);
+	}
+}
+
+int eventLoopRun (int serverSock, int localSock, const session_settings_t * settings,
+		uint32_t workers, uint32_t framesAhead) {
+	event_loop_t loop;
+	loop.serverSock = serverSock;
+	loop.localSock = localSock;
+	loop.settings = settings;
+	loop.framesAhead = framesAhead;
+	loop.jobs = NULL;
+	loop.lastJob = NULL;
+	loop.done = NULL;
+	loop.dead = NULL;
+	loop.paced = NULL;
+	pthread_mutex_init (&loop.lock, NULL);
+	pthread_cond_init (&loop.hasJobs, NULL);
+
+	loop.epoll = epoll_create1 (EPOLL_CLOEXEC);
+	loop.eventFd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	loop.timerFd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (loop.epoll == -1 || loop.eventFd == -1 || loop.timerFd == -1 ||
+			connectionSetNonBlocking (serverSock) != 0 ||
+			(localSock != -1 && connectionSetNonBlocking (localSock) != 0)) {
+		perror ("event loop");
+		return -1;
+	}
+
+	// Server socket, workers signal and timer are told apart from clients by their address
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &loop.serverSock;
+	epoll_ctl (loop.epoll, EPOLL_CTL_ADD, serverSock, &ev);
+	if (localSock != -1) {
+		ev.data.ptr = &loop.localSock;
+		epoll_ctl (loop.epoll, EPOLL_CTL_ADD, localSock, &ev);
+	}
+	ev.data.ptr = &loop.eventFd;
+	epoll_ctl (loop.epoll, EPOLL_CTL_ADD, loop.eventFd, &ev);
+	ev.data.ptr = &loop.timerFd;
+	epoll_ctl (loop.epoll, EPOLL_CTL_ADD, loop.timerFd, &ev);
+
+	// Start workers
+	if (workers == 0) {
+		long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+		workers = cpus > 0 ? cpus : 1;
+	}
+	uint32_t i;
+	for (i = 0; i < workers; ++i) {
+		pthread_t thread;
+		if (pthread_create (&thread, NULL, worker, &loop) != 0) {
+			fprintf (stderr, "Unable to start compute workers\n");
+			return -1;
+		}
+		pthread_detach (thread);
+	}
+
+	struct epoll_event events[MAX_EVENTS];
+	while (1) {
+		int n = epoll_wait (loop.epoll, events, MAX_EVENTS, -1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			perror ("epoll_wait");
+			return -1;
+		}
+
+		int e;
+		for (e = 0; e < n; ++e) {
+			void * ptr = events[e].data.ptr;
+			if (ptr == &loop.serverSock) {
+				accept_clients (&loop, loop.serverSock);
+			} else if (ptr == &loop.localSock) {
+				accept_clients (&loop, loop.localSock);
+			} else if (ptr == &loop.eventFd) {
+				jobs_done (&loop);
+			} else if (ptr == &loop.timerFd) {
+				timer_expired (&loop);
+			} else if ((uintptr_t) ptr & 1) {
+				client_t * c = (client_t *) ((uintptr_t) ptr & ~(uintptr_t) 1);
+				if (!c->dead)
+					client_writable (&loop, c);
+			} else {
+				client_t * c = ptr;
+				if (c->dead)
+					continue;
+				if (events[e].events & EPOLLOUT)
+					client_writable (&loop, c);
+				else if (events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+					client_readable (&loop, c);
+			}
+		}
+
+		while (loop.dead != NULL) {
+			client_t * c = loop.dead;
+			loop.dead = c->next;
+			free (c);
+		}
+	}
+}
@@ -0,0 +1,22 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include "session.h"
+
+/* Event loop.
+ *
+ * Serves every connection of the server socket in this process : an epoll loop handles the
+ * sockets (non blocking) and the protocol state of each connection, and the sessions are
+ * created and advanced by a bounded pool of compute workers.
+ * Up to 'framesAhead' frames are computed before being requested, so that computing overlaps
+ * the network round trips (0 computes frames only when requested).
+ */
+
+/* Runs the server loop, with 'workers' compute threads (0 means one per online cpu).
+ * Connections are also accepted from 'localSock' (serverInitLocal), unless it is -1.
+ * Only returns on fatal error (-1).
+ */
+int eventLoopRun (int serverSock, int localSock, const session_settings_t * settings,
+		uint32_t workers, uint32_t framesAhead);
+
+#endif
@@ -0,0 +1,175 @@
+#include "engine.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../protocol/protocol.h"
+
+/* Event-driven engine.
+ *
+ * Only heads, tails, and wires next to a head can change. The engine keeps the list of heads
+ * and the list of tails (as indexes in a bordered map), and at each generation :
+ * - counts the heads around each wire neighbour of a head (the candidates),
+ * - turns the candidates with 1 or 2 heads into the new heads,
+ * - turns the heads into tails, and the tails into wires.
+ * So the cost of a generation is proportional to the number of heads and tails, and does not
+ * depend on the size of the map.
+ */
+
+typedef struct {
+	uint32_t * cells;
+	uint32_t size, capacity;
+} cell_list_t;
+
+typedef struct {
+	engine_t base;
+	char * map; // bordered map, updated in place
+	uint8_t * counts; // heads around each candidate, 0 elsewhere
+
+	cell_list_t heads, tails, candidates, next;
+	int offsets[8];
+
+	uint64_t hash; // updated incrementally
+} frontier_engine_t;
+
+static void list_init (cell_list_t * list) {
+	list->size = 0;
+	list->capacity = 64;
+	list->cells = malloc (list->capacity * sizeof (uint32_t));
+	assert (list->cells != NULL);
+}
+
+static inline void list_push (cell_list_t * list, uint32_t cell) {
+	if (list->size == list->capacity) {
+		list->capacity *= 2;
+		list->cells = realloc (list->cells, list->capacity * sizeof (uint32_t));
+		assert (list->cells != NULL);
+	}
+	list->cells[list->size++] = cell;
+}
+
+static void list_swap (cell_list_t * a, cell_list_t * b) {
+	cell_list_t tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+static engine_t * frontier_create (const char * borderedMap, uint32_t xsize, uint32_t ysize,
+		const engine_params_t * params) {
+	(void) params;
+	frontier_engine_t * e = malloc (sizeof (frontier_engine_t));
+	assert (e != NULL);
+
+	uint32_t stride = xsize + 2;
+	uint32_t size = stride * (ysize + 2);
+	e->map = engineAllocMap (xsize, ysize);
+	memcpy (e->map, borderedMap, size * sizeof (char));
+	e->counts = calloc (size, sizeof (uint8_t));
+	assert (e->counts != NULL);
+
+	list_init (&e->heads);
+	list_init (&e->tails);
+	list_init (&e->candidates);
+	list_init (&e->next);
+
+	uint32_t i;
+	for (i = 0; i < size; ++i) {
+		if (e->map[i] == C_HEAD)
+			list_push (&e->heads, i);
+		else if (e->map[i] == C_TAIL)
+			list_push (&e->tails, i);
+	}
+	e->hash = engineHashMap (e->map, xsize, ysize);
+
+	int k = 0, dx, dy;
+	for (dy = -1; dy <= 1; ++dy)
+		for (dx = -1; dx <= 1; ++dx)
+			if (dx != 0 || dy != 0)
+				e->offsets[k++] = dx + dy * (int) stride;
+	return &e->base;
+}
+
+static int frontier_step (engine_t * engine, uint32_t generations) {
+	frontier_engine_t * e = (frontier_engine_t *) engine;
+	char * map = e->map;
+	uint8_t * counts = e->counts;
+	uint32_t g, i;
+	int k;
+
+	for (g = 0; g < generations; ++g) {
+		// Count heads around wires (borders are insulators, so no bound check needed)
+		e->candidates.size = 0;
+		for (i = 0; i < e->heads.size; ++i) {
+			uint32_t h = e->heads.cells[i];
+			for (k = 0; k < 8; ++k) {
+				uint32_t n = h + e->offsets[k];
+				if (map[n] == C_WIRE && counts[n]++ == 0)
+					list_push (&e->candidates, n);
+			}
+		}
+
+		// Select new heads, and clean counters
+		e->next.size = 0;
+		for (i = 0; i < e->candidates.size; ++i) {
+			uint32_t c = e->candidates.cells[i];
+			if (counts[c] <= 2)
+				list_push (&e->next, c);
+			counts[c] = 0;
+		}
+
+		// Apply changes, and update the hash
+		uint64_t hash = e->hash;
+		for (i = 0; i < e->tails.size; ++i) {
+			uint32_t c = e->tails.cells[i];
+			map[c] = C_WIRE;
+			hash -= engineCellHash (c, C_TAIL);
+		}
+		for (i = 0; i < e->heads.size; ++i) {
+			uint32_t c = e->heads.cells[i];
+			map[c] = C_TAIL;
+			hash += engineCellHash (c, C_TAIL) - engineCellHash (c, C_HEAD);
+		}
+		for (i = 0; i < e->next.size; ++i) {
+			uint32_t c = e->next.cells[i];
+			map[c] = C_HEAD;
+			hash += engineCellHash (c, C_HEAD);
+		}
+		e->hash = hash;
+
+		// heads -> tails, next -> heads, and the old tail list is reused
+		list_swap (&e->tails, &e->heads);
+		list_swap (&e->heads, &e->next);
+	}
+	return 0;
+}
+
+static char * frontier_export (engine_t * engine, char * scratch) {
+	(void) scratch;
+	return ((frontier_engine_t *) engine)->map;
+}
+
+static uint64_t frontier_activity (engine_t * engine) {
+	frontier_engine_t * e = (frontier_engine_t *) engine;
+	return e->heads.size + e->tails.size;
+}
+
+static uint64_t frontier_hash (engine_t * engine) {
+	return ((frontier_engine_t *) engine)->hash;
+}
+
+static void frontier_destroy (engine_t * engine) {
+	frontier_engine_t * e = (frontier_engine_t *) engine;
+	free (e->heads.cells);
+	free (e->tails.cells);
+	free (e->candidates.cells);
+	free (e->next.cells);
+	free (e->counts);
+	free (e->map);
+	free (e);
+}
+
+const engine_ops_t frontierEngine = {
+	"frontier", frontier_create, frontier_step, frontier_export, NULL, frontier_activity,
+	frontier_hash, frontier_destroy
+};
@@ -0,0 +1,177 @@
+#include "engine.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../protocol/protocol.h"
+
+/* Compiled graph engine.
+ *
+ * Insulators never change and conductors never move, so the topology is compiled once at
+ * creation : conductors are numbered in row order, and their conductor neighbours are stored
+ * in a compressed sparse row array (the neighbours of conductor i are
+ * neighbours[offsets[i]] to neighbours[offsets[i + 1]] excluded).
+ * The simulation only works on per-conductor state arrays, so memory and bandwidth depend on
+ * the number of conductors and not on the bounding box of the circuit.
+ */
+
+typedef struct {
+	engine_t base;
+
+	uint32_t nbConductors;
+	uint32_t * positions; // index of each conductor in a bordered map
+	uint32_t * offsets;
+	uint32_t * neighbours;
+
+	uint8_t * states[2];
+	int dir;
+	uint64_t activity;
+} graph_engine_t;
+
+static engine_t * graph_create (const char * borderedMap, uint32_t xsize, uint32_t ysize,
+		const engine_params_t * params) {
+	(void) params;
+	graph_engine_t * e = malloc (sizeof (graph_engine_t));
+	assert (e != NULL);
+
+	uint32_t stride = xsize + 2;
+	uint32_t size = stride * (ysize + 2);
+	uint32_t i, n;
+
+	// Number conductors (temporary map from bordered index to conductor number)
+	uint32_t * numbers = malloc (size * sizeof (uint32_t));
+	assert (numbers != NULL);
+	e->nbConductors = 0;
+	for (i = 0; i < size; ++i)
+		if (borderedMap[i] != C_INSULATOR)
+			numbers[i] = e->nbConductors++;
+
+	e->positions = malloc ((e->nbConductors + 1) * sizeof (uint32_t));
+	e->offsets = malloc ((e->nbConductors + 1) * sizeof (uint32_t));
+	e->states[0] = malloc ((e->nbConductors + 1) * sizeof (uint8_t));
+	e->states[1] = malloc ((e->nbConductors + 1) * sizeof (uint8_t));
+	assert (e->positions != NULL && e->offsets != NULL);
+	assert (e->states[0] != NULL && e->states[1] != NULL);
+	e->dir = 0;
+	e->activity = 0;
+
+	// Build arrays, with at most 8 neighbours per conductor
+	uint32_t capacity = 8 * e->nbConductors + 1;
+	e->neighbours = malloc (capacity * sizeof (uint32_t));
+	assert (e->neighbours != NULL);
+
+	const int deltas[8] = {
+		-1 - (int) stride, -(int) stride, 1 - (int) stride,
+		-1, 1,
+		-1 + (int) stride, (int) stride, 1 + (int) stride
+	};
+
+	uint32_t nbEdges = 0;
+	n = 0;
+	for (i = 0; i < size; ++i) {
+		if (borderedMap[i] == C_INSULATOR)
+			continue;
+
+		e->positions[n] = i;
+		e->states[0][n] = borderedMap[i];
+		if (borderedMap[i] != C_WIRE)
+			e->activity++;
+
+		e->offsets[n] = nbEdges;
+		int k;
+		for (k = 0; k < 8; ++k) {
+			uint32_t neighbour = i + deltas[k];
+			if (borderedMap[neighbour] != C_INSULATOR)
+				e->neighbours[nbEdges++] = numbers[neighbour];
+		}
+		n++;
+	}
+	e->offsets[n] = nbEdges;
+	free (numbers);
+
+	// Release unused neighbour space
+	uint32_t * shrunk = realloc (e->neighbours, (nbEdges + 1) * sizeof (uint32_t));
+	if (shrunk != NULL)
+		e->neighbours = shrunk;
+
+	return &e->base;
+}
+
+static int graph_step (engine_t * engine, uint32_t generations) {
+	graph_engine_t * e = (graph_engine_t *) engine;
+	const uint32_t * offsets = e->offsets;
+	const uint32_t * neighbours = e->neighbours;
+	uint32_t g, i, j;
+
+	for (g = 0; g < generations; ++g) {
+		const uint8_t * from = e->states[e->dir];
+		uint8_t * to = e->states[1 - e->dir];
+		uint64_t activity = 0;
+
+		for (i = 0; i < e->nbConductors; ++i) {
+			uint8_t state = from[i];
+			if (state == C_WIRE) {
+				int nbHeads = 0;
+				for (j = offsets[i]; j < offsets[i + 1]; ++j)
+					nbHeads += (from[neighbours[j]] == C_HEAD);
+				if (nbHeads == 1 || nbHeads == 2) {
+					to[i] = C_HEAD;
+					activity++;
+				} else {
+					to[i] = C_WIRE;
+				}
+			} else if (state == C_HEAD) {
+				to[i] = C_TAIL;
+				activity++;
+			} else { // C_TAIL
+				to[i] = C_WIRE;
+			}
+		}
+
+		e->dir = 1 - e->dir;
+		e->activity = activity;
+	}
+	return 0;
+}
+
+static char * graph_export (engine_t * engine, char * scratch) {
+	graph_engine_t * e = (graph_engine_t *) engine;
+	const uint8_t * states = e->states[e->dir];
+	uint32_t i;
+
+	memset (scratch, C_INSULATOR, engineMapCells (engine->xsize, engine->ysize) * sizeof (char));
+	for (i = 0; i < e->nbConductors; ++i)
+		scratch[e->positions[i]] = states[i];
+	return scratch;
+}
+
+static uint64_t graph_activity (engine_t * engine) {
+	return ((graph_engine_t *) engine)->activity;
+}
+
+static uint64_t graph_hash (engine_t * engine) {
+	graph_engine_t * e = (graph_engine_t *) engine;
+	const uint8_t * states = e->states[e->dir];
+	uint64_t hash = 0;
+	uint32_t i;
+	for (i = 0; i < e->nbConductors; ++i)
+		if (states[i] != C_WIRE)
+			hash += engineCellHash (e->positions[i], states[i]);
+	return hash;
+}
+
+static void graph_destroy (engine_t * engine) {
+	graph_engine_t * e = (graph_engine_t *) engine;
+	free (e->positions);
+	free (e->offsets);
+	free (e->neighbours);
+	free (e->states[0]);
+	free (e->states[1]);
+	free (e);
+}
+
+const engine_ops_t graphEngine = {
+	"graph", graph_create, graph_step, graph_export, NULL, graph_activity, graph_hash,
+	graph_destroy
+};
@@ -0,0 +1,463 @@
+#include "engine.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../protocol/protocol.h"
+
+/* HashLife engine.
+ *
+ * The map is stored as a quadtree of canonical nodes : a node of level k covers 2^k * 2^k cells,
+ * level 0 nodes are the 4 cell states, and identical subtrees are shared through a hash table.
+ * For a node of level k >= 2, the result of advancing its center square (of level k - 1) by
+ * 2^j generations (j <= k - 2) is memoized, keyed by (node, j). Repeated structures are then
+ * simulated once, and advancing by 2^j generations costs about the same as advancing by one,
+ * so a step of n generations costs O(log n) advances (one per bit of n).
+ *
+ * Nodes without heads or tails never change, so their result is directly their center.
+ * In Wireworld nothing ever grows out of the conductors : the root just needs to be twice as
+ * large as the map, with the map in its center square, and the advanced center is put back in
+ * the middle of an empty root after each advance.
+ *
+ * Nodes are never freed individually : when there are too many of them, the state is exported
+ * and the whole tree rebuilt, which drops everything unused.
+ */
+
+#define MAX_LEVEL 40
+#define MAX_NODES (1u << 22) // minimum collection threshold, in nodes and results
+#define CHUNK_SIZE (1u << 20)
+
+#define NODE_CONDUCTOR 1 // contains conductors
+#define NODE_ACTIVE 2 // contains heads or tails
+
+typedef struct node node_t;
+struct node {
+	node_t * nw, * ne, * sw, * se;
+	node_t * next; // hash chain
+	uint8_t level;
+	uint8_t state; // cell state, for level 0
+	uint8_t flags;
+};
+
+typedef struct result result_t;
+struct result {
+	node_t * node;
+	node_t * value;
+	result_t * next; // hash chain
+	uint32_t step; // log2 of the number of generations
+};
+
+/* Chunk allocator for nodes and results */
+typedef struct chunk chunk_t;
+struct chunk {
+	chunk_t * next;
+	size_t used;
+	char data[];
+};
+
+typedef struct {
+	void ** buckets;
+	uint32_t mask;
+	uint32_t count;
+} table_t;
+
+typedef struct {
+	engine_t base;
+
+	chunk_t * chunks;
+	table_t nodes;
+	table_t results;
+
+	node_t leaves[4];
+	node_t * empties[MAX_LEVEL];
+
+	node_t * root;
+	uint32_t origin; // position of the map in the root, for both x and y
+
+	uint32_t collectThreshold;
+} hashlife_engine_t;
+
+static void reset (hashlife_engine_t * h);
+static void clear (hashlife_engine_t * h);
+static void build_root (hashlife_engine_t * h, const char * borderedMap);
+static node_t * advance (hashlife_engine_t * h, node_t * n, uint32_t step);
+
+/* Allocation and hash tables */
+
+static void * chunk_alloc (hashlife_engine_t * h, size_t size) {
+	if (h->chunks == NULL || h->chunks->used + size > CHUNK_SIZE) {
+		chunk_t * c = malloc (sizeof (chunk_t) + CHUNK_SIZE);
+		assert (c != NULL);
+		c->next = h->chunks;
+		c->used = 0;
+		h->chunks = c;
+	}
+	void * p = &h->chunks->data[h->chunks->used];
+	h->chunks->used += size;
+	return p;
+}
+
+static void table_init (table_t * t) {
+	t->mask = (1u << 16) - 1;
+	t->count = 0;
+	t->buckets = calloc (t->mask + 1, sizeof (void *));
+	assert (t->buckets != NULL);
+}
+
+static inline uint32_t hash_node (node_t * nw, node_t * ne, node_t * sw, node_t * se) {
+	uint64_t k = (uintptr_t) nw * 0x9E3779B97F4A7C15ull;
+	k ^= (uintptr_t) ne * 0xC2B2AE3D27D4EB4Full;
+	k ^= (uintptr_t) sw * 0x165667B19E3779F9ull;
+	k ^= (uintptr_t) se * 0x27D4EB2F165667C5ull;
+	return k ^ (k >> 29);
+}
+
+static inline uint32_t hash_result (node_t * n, uint32_t step) {
+	uint64_t k = ((uintptr_t) n + step) * 0x9E3779B97F4A7C15ull;
+	return k ^ (k >> 29);
+}
+
+static void node_table_grow (table_t * t) {
+	uint32_t mask = t->mask * 2 + 1;
+	void ** buckets = calloc (mask + 1, sizeof (void *));
+	assert (buckets != NULL);
+
+	uint32_t i;
+	for (i = 0; i <= t->mask; ++i) {
+		node_t * n = t->buckets[i];
+		while (n != NULL) {
+			node_t * next = n->next;
+			uint32_t b = hash_node (n->nw, n->ne, n->sw, n->se) & mask;
+			n->next = buckets[b];
+			buckets[b] = n;
+			n = next;
+		}
+	}
+	free (t->buckets);
+	t->buckets = buckets;
+	t->mask = mask;
+}
+
+static void result_table_grow (table_t * t) {
+	uint32_t mask = t->mask * 2 + 1;
+	void ** buckets = calloc (mask + 1, sizeof (void *));
+	assert (buckets != NULL);
+
+	uint32_t i;
+	for (i = 0; i <= t->mask; ++i) {
+		result_t * r = t->buckets[i];
+		while (r != NULL) {
+			result_t * next = r->next;
+			uint32_t b = hash_result (r->node, r->step) & mask;
+			r->next = buckets[b];
+			buckets[b] = r;
+			r = next;
+		}
+	}
+	free (t->buckets);
+	t->buckets = buckets;
+	t->mask = mask;
+}
+
+/* Returns the canonical node with the given children */
+static node_t * make_node (hashlife_engine_t * h, node_t * nw, node_t * ne, node_t * sw, node_t * se) {
+	uint32_t b = hash_node (nw, ne, sw, se) & h->nodes.mask;
+	node_t * n;
+	for (n = h->nodes.buckets[b]; n != NULL; n = n->next)
+		if (n->nw == nw && n->ne == ne && n->sw == sw && n->se == se)
+			return n;
+
+	n = chunk_alloc (h, sizeof (node_t));
+	n->nw = nw;
+	n->ne = ne;
+	n->sw = sw;
+	n->se = se;
+	n->level = nw->level + 1;
+	n->state = C_INSULATOR;
+	n->flags = nw->flags | ne->flags | sw->flags | se->flags;
+	n->next = h->nodes.buckets[b];
+	h->nodes.buckets[b] = n;
+
+	if (++h->nodes.count > h->nodes.mask)
+		node_table_grow (&h->nodes);
+	return n;
+}
+
+static node_t * find_result (hashlife_engine_t * h, node_t * n, uint32_t step) {
+	result_t * r;
+	for (r = h->results.buckets[hash_result (n, step) & h->results.mask]; r != NULL; r = r->next)
+		if (r->node == n && r->step == step)
+			return r->value;
+	return NULL;
+}
+
+static void add_result (hashlife_engine_t * h, node_t * n, uint32_t step, node_t * value) {
+	uint32_t b = hash_result (n, step) & h->results.mask;
+	result_t * r = chunk_alloc (h, sizeof (result_t));
+	r->node = n;
+	r->step = step;
+	r->value = value;
+	r->next = h->results.buckets[b];
+	h->results.buckets[b] = r;
+
+	if (++h->results.count > h->results.mask)
+		result_table_grow (&h->results);
+}
+
+/* Tree manipulation */
+
+static node_t * center (hashlife_engine_t * h, node_t * n) {
+	return make_node (h, n->nw->se, n->ne->sw, n->sw->ne, n->se->nw);
+}
+
+/* Puts a node of level k in the center of an empty node of level k + 1 */
+static node_t * expand (hashlife_engine_t * h, node_t * n) {
+	node_t * e = h->empties[n->level - 1];
+	return make_node (h,
+			make_node (h, e, e, e, n->nw),
+			make_node (h, e, e, n->ne, e),
+			make_node (h, e, n->sw, e, e),
+			make_node (h, n->se, e, e, e));
+}
+
+/* One generation of the center 2x2 cells of a 4x4 node */
+static node_t * base_step (hashlife_engine_t * h, node_t * n) {
+	uint8_t cells[4][4];
+	node_t * quads[2][2] = { { n->nw, n->ne }, { n->sw, n->se } };
+	int qx, qy, x, y;
+	for (qy = 0; qy < 2; ++qy)
+		for (qx = 0; qx < 2; ++qx) {
+			node_t * q = quads[qy][qx];
+			cells[2 * qy][2 * qx] = q->nw->state;
+			cells[2 * qy][2 * qx + 1] = q->ne->state;
+			cells[2 * qy + 1][2 * qx] = q->sw->state;
+			cells[2 * qy + 1][2 * qx + 1] = q->se->state;
+		}
+
+	node_t * out[2][2];
+	for (y = 1; y < 3; ++y)
+		for (x = 1; x < 3; ++x) {
+			uint8_t state = cells[y][x];
+			if (state == C_WIRE) {
+				int nbHeads = 0, dx, dy;
+				for (dy = -1; dy <= 1; ++dy)
+					for (dx = -1; dx <= 1; ++dx)
+						nbHeads += (cells[y + dy][x + dx] == C_HEAD);
+				state = (nbHeads == 1 || nbHeads == 2) ? C_HEAD : C_WIRE;
+			} else if (state == C_HEAD) {
+				state = C_TAIL;
+			} else if (state == C_TAIL) {
+				state = C_WIRE;
+			}
+			out[y - 1][x - 1] = &h->leaves[state];
+		}
+	return make_node (h, out[0][0], out[0][1], out[1][0], out[1][1]);
+}
+
+/* Center of a node of level k, advanced by 2^step generations (step <= k - 2) */
+static node_t * advance (hashlife_engine_t * h, node_t * n, uint32_t step) {
+	if (!(n->flags & NODE_ACTIVE))
+		return center (h, n);
+
+	node_t * r = find_result (h, n, step);
+	if (r != NULL)
+		return r;
+
+	if (n->level == 2) {
+		r = base_step (h, n);
+	} else {
+		// 9 overlapping sub-nodes of level k - 1
+		node_t * n00 = n->nw;
+		node_t * n01 = make_node (h, n->nw->ne, n->ne->nw, n->nw->se, n->ne->sw);
+		node_t * n02 = n->ne;
+		node_t * n10 = make_node (h, n->nw->sw, n->nw->se, n->sw->nw, n->sw->ne);
+		node_t * n11 = center (h, n);
+		node_t * n12 = make_node (h, n->ne->sw, n->ne->se, n->se->nw, n->se->ne);
+		node_t * n20 = n->sw;
+		node_t * n21 = make_node (h, n->sw->ne, n->se->nw, n->sw->se, n->se->sw);
+		node_t * n22 = n->se;
+
+		uint32_t next;
+		if (step == n->level - 2u) {
+			// Full speed : two half steps
+			next = step - 1;
+			n00 = advance (h, n00, next);
+			n01 = advance (h, n01, next);
+			n02 = advance (h, n02, next);
+			n10 = advance (h, n10, next);
+			n11 = advance (h, n11, next);
+			n12 = advance (h, n12, next);
+			n20 = advance (h, n20, next);
+			n21 = advance (h, n21, next);
+			n22 = advance (h, n22, next);
+		} else {
+			// Slower : only the second half does the whole step
+			next = step;
+			n00 = center (h, n00);
+			n01 = center (h, n01);
+			n02 = center (h, n02);
+			n10 = center (h, n10);
+			n11 = center (h, n11);
+			n12 = center (h, n12);
+			n20 = center (h, n20);
+			n21 = center (h, n21);
+			n22 = center (h, n22);
+		}
+
+		r = make_node (h,
+				advance (h, make_node (h, n00, n01, n10, n11), next),
+				advance (h, make_node (h, n01, n02, n11, n12), next),
+				advance (h, make_node (h, n10, n11, n20, n21), next),
+				advance (h, make_node (h, n11, n12, n21, n22), next));
+	}
+
+	add_result (h, n, step, r);
+	return r;
+}
+
+/* Conversion from/to bordered maps */
+
+static node_t * build (hashlife_engine_t * h, const char * borderedMap,
+		uint32_t level, int64_t x0, int64_t y0) {
+	// Map coordinates of the node
+	int64_t size = (int64_t) 1 << level;
+	if (x0 + size <= 0 || y0 + size <= 0 || x0 >= h->base.xsize || y0 >= h->base.ysize)
+		return h->empties[level];
+
+	if (level == 0)
+		return &h->leaves[(uint8_t) borderedMap[(x0 + 1) + (y0 + 1) * (h->base.xsize + 2)]];
+
+	int64_t half = size / 2;
+	return make_node (h,
+			build (h, borderedMap, level - 1, x0, y0),
+			build (h, borderedMap, level - 1, x0 + half, y0),
+			build (h, borderedMap, level - 1, x0, y0 + half),
+			build (h, borderedMap, level - 1, x0 + half, y0 + half));
+}
+
+static void build_root (hashlife_engine_t * h, const char * borderedMap) {
+	// Smallest root with the map in its center square
+	uint32_t size = h->base.xsize > h->base.ysize ? h->base.xsize : h->base.ysize;
+	uint32_t level = 2;
+	while (((uint64_t) 1 << (level - 1)) < size)
+		level++;
+
+	h->origin = 1u << (level - 2);
+	h->root = build (h, borderedMap, level, -(int64_t) h->origin, -(int64_t) h->origin);
+
+	// Collect when the tree has at least doubled
+	h->collectThreshold = 2 * h->nodes.count > MAX_NODES ? 2 * h->nodes.count : MAX_NODES;
+}
+
+static void write_node (hashlife_engine_t * h, node_t * n, char * borderedMap, int64_t x0, int64_t y0) {
+	if (!(n->flags & NODE_CONDUCTOR))
+		return;
+
+	if (n->level == 0) {
+		if (0 <= x0 && x0 < h->base.xsize && 0 <= y0 && y0 < h->base.ysize)
+			borderedMap[(x0 + 1) + (y0 + 1) * (h->base.xsize + 2)] = n->state;
+		return;
+	}
+
+	int64_t half = (int64_t) 1 << (n->level - 1);
+	write_node (h, n->nw, borderedMap, x0, y0);
+	write_node (h, n->ne, borderedMap, x0 + half, y0);
+	write_node (h, n->sw, borderedMap, x0, y0 + half);
+	write_node (h, n->se, borderedMap, x0 + half, y0 + half);
+}
+
+/* Engine */
+
+static void reset (hashlife_engine_t * h) {
+	h->chunks = NULL;
+	table_init (&h->nodes);
+	table_init (&h->results);
+
+	int i;
+	for (i = 0; i < 4; ++i) {
+		node_t * leaf = &h->leaves[i];
+		memset (leaf, 0, sizeof (node_t));
+		leaf->state = i;
+		leaf->flags = (i != C_INSULATOR ? NODE_CONDUCTOR : 0) |
+			(i == C_HEAD || i == C_TAIL ? NODE_ACTIVE : 0);
+	}
+
+	h->empties[0] = &h->leaves[C_INSULATOR];
+	for (i = 1; i < MAX_LEVEL; ++i) {
+		node_t * e = h->empties[i - 1];
+		h->empties[i] = make_node (h, e, e, e, e);
+	}
+}
+
+static void clear (hashlife_engine_t * h) {
+	while (h->chunks != NULL) {
+		chunk_t * next = h->chunks->next;
+		free (h->chunks);
+		h->chunks = next;
+	}
+	free (h->nodes.buckets);
+	free (h->results.buckets);
+}
+
+static engine_t * hashlife_create (const char * borderedMap, uint32_t xsize, uint32_t ysize,
+		const engine_params_t * params) {
+	(void) params;
+	hashlife_engine_t * h = malloc (sizeof (hashlife_engine_t));
+	assert (h != NULL);
+
+	// Needed by build before engineCreate sets them
+	h->base.xsize = xsize;
+	h->base.ysize = ysize;
+
+	reset (h);
+	build_root (h, borderedMap);
+	return &h->base;
+}
+
+static char * hashlife_export (engine_t * engine, char * scratch) {
+	hashlife_engine_t * h = (hashlife_engine_t *) engine;
+	memset (scratch, C_INSULATOR, engineMapCells (engine->xsize, engine->ysize) * sizeof (char));
+	write_node (h, h->root, scratch, -(int64_t) h->origin, -(int64_t) h->origin);
+	return scratch;
+}
+
+static int hashlife_step (engine_t * engine, uint32_t generations) {
+	hashlife_engine_t * h = (hashlife_engine_t *) engine;
+	uint32_t step;
+
+	for (step = 0; step < 32; ++step) {
+		if (!(generations & (1u << step)))
+			continue;
+
+		// The root must be of level step + 2 at least
+		while (h->root->level < step + 2) {
+			h->origin += 1u << (h->root->level - 1);
+			h->root = expand (h, h->root);
+		}
+
+		h->root = expand (h, advance (h, h->root, step));
+
+		// Garbage collection by rebuilding everything
+		if (h->nodes.count + h->results.count > h->collectThreshold) {
+			char * tmp = engineAllocMap (engine->xsize, engine->ysize);
+			hashlife_export (engine, tmp);
+			clear (h);
+			reset (h);
+			build_root (h, tmp);
+			free (tmp);
+		}
+	}
+	return 0;
+}
+
+static void hashlife_destroy (engine_t * engine) {
+	hashlife_engine_t * h = (hashlife_engine_t *) engine;
+	clear (h);
+	free (h);
+}
+
+const engine_ops_t hashlifeEngine = {
+	"hashlife", hashlife_create, hashlife_step, hashlife_export, NULL, NULL, NULL,
+	hashlife_destroy
+};
@@ -1,135 +1,120 @@
 #include "server.h"
-
-#include <sys/wait.h>
-#include <signal.h>
-
-/* Proto/macro */
-void perform_simulation (int sock);
-void update_map (int * dir, char ** maps, uint32_t xs, uint32_t ys);
+#include "engine.h"
+#include "eventloop.h"
+#include "../protocol/cellpack.h"
 
 /* Small utils */
-static inline char * map (char * tab, int x, int y, int xsize) { return &tab[x + y * xsize]; }
-static void grim_reaper (int sig) { (void) sig; wait (NULL); }
+static void usage (const char * prog);
 
 /* main */
-int main (void) {
-	int serverSock = serverInit (8000);
-	signal (SIGCHLD, grim_reaper);
-	while (serverSock != -1) {
-		int res = serverAccept (serverSock);
-		if (res > 0) {
-			if(fork () == 0) {
-				close (serverSock);
-				serverSock = -1;
-				perform_simulation (res);
-			}
-			close(res);
-		} else {
-			close (serverSock);
-			serverSock = -1;
-		}
-	}
-	return EXIT_SUCCESS;
-}
-
-/* Simulation */
-void perform_simulation (int sock) {
-	uint32_t xsize, ysize;
-	uint32_t sampling;
-	char * firstMap;
-
-	if (connectionWaitForInit (sock, &xsize, &ysize, &sampling, &firstMap) == 0) {
-		// Init double buffers with insulator borders
-		char * maps[2];
-		int j;
-		for (j = 0; j < 2; ++j) {
-			maps[j] = malloc ((xsize + 2) * (ysize + 2) * sizeof (char));
-			assert (maps[j] != NULL); 
-
-			uint32_t i;
-			// horiz lines
-			for (i = 0; i < xsize + 2; ++i) {
-				*map (maps[j], i, 0, xsize + 2) = C_INSULATOR;
-				*map (maps[j], i, ysize + 1, xsize + 2) = C_INSULATOR;
-			}
-			// vert lines
-			for (i = 0; i < ysize + 2; ++i) {
-				*map (maps[j], 0, i, xsize + 2) = C_INSULATOR;
-				*map (maps[j], xsize + 1, i, xsize + 2) = C_INSULATOR;
-			}
-		}
-
-		// Copy first frame into maps[0]
-		uint32_t x, y;
-		for (y = 0; y < ysize; ++y)
-			for (x = 0; x < xsize; ++x)
-				*map (maps[0], x + 1, y + 1, xsize + 2) = *map (firstMap, x, y, xsize);
-
-		free (firstMap);
-
-		int updatedMap = 0;
-		while (1) {
-			// Wait R_FRAME
-			if (connectionWaitFrameRequest (sock) != 0)
+int main (int argc, char * argv[]) {
+	int port = 8000;
+	int local = 0;
+	uint32_t workers = 0;
+	uint32_t framesAhead = 5;
+	session_settings_t settings;
+	int opt;
+
+	settings.engine = engineDefault ();
+	settings.params.threads = 0;
+	settings.params.processes = 0;
+	settings.cycleMemory = 0;
+	settings.mapDirectory = NULL;
+	settings.checkpointInterval = 0;
+	while ((opt = getopt (argc, argv, "p:le:t:s:c:w:a:m:k:h")) != -1) {
+		switch (opt) {
+			case 'p':
+				port = atoi (optarg);
 				break;
-
-			// Compute new step
-			uint32_t k;
-			for (k = 0; k < sampling; ++k)
-				update_map (&updatedMap, maps, xsize, ysize);
-
-			// Send new map
-			if (connectionSendFullUpdate (sock,
-						maps[updatedMap], xsize + 2, ysize + 2,
-						1, 1, xsize + 1, ysize + 1) != 0)
+			case 'l':
+				local = 1;
 				break;
+			case 'e':
+				settings.engine = engineFind (optarg);
+				if (settings.engine == NULL) {
+					fprintf (stderr, "Unknown engine : %s\n", optarg);
+					usage (argv[0]);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 't':
+				settings.params.threads = atoi (optarg);
+				break;
+			case 's':
+				settings.params.processes = atoi (optarg);
+				break;
+			case 'c':
+				settings.cycleMemory = (size_t) atoi (optarg) << 20;
+				break;
+			case 'w':
+				workers = atoi (optarg);
+				break;
+			case 'a':
+				framesAhead = atoi (optarg);
+				break;
+			case 'm':
+				settings.mapDirectory = optarg;
+				break;
+			case 'k':
+				settings.checkpointInterval = strtoull (optarg, NULL, 10);
+				break;
+			default:
+				usage (argv[0]);
+				return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
 		}
-
-		free (maps[0]);
-		free (maps[1]);
 	}
-}
 
-void update_map (int * dir, char ** maps, uint32_t xs, uint32_t ys) {
-	char * fromMap = maps[*dir];
-	char * toMap = maps[1 - *dir];
-	uint32_t i, j;
+	if (settings.cycleMemory > 0 && settings.engine->hash == NULL) {
+		fprintf (stderr, "Cycle detection needs state hashes, which the %s engine lacks\n",
+				settings.engine->name);
+		return EXIT_FAILURE;
+	}
 
-	static const int diffs[][2] = {
-		{ -1, -1 },
-		{ 0, -1 },
-		{ 1, -1 },
-		{ 1, 0 },
-		{ 1, 1 },
-		{ 0, 1 },
-		{ -1, 1 },
-		{ -1, 0 }
-	};
+	int serverSock = serverInit (port);
+	if (serverSock == -1)
+		return EXIT_FAILURE;
 
-	for (i = 1; i < xs + 1; ++i)
-		for (j = 1; j < ys + 1; ++j) {
-			char state = *map (fromMap, i, j, xs + 2);
-			char * out = map (toMap, i, j, xs + 2);
+	int localSock = -1;
+	if (local) {
+		localSock = serverInitLocal (port);
+		if (localSock == -1)
+			return EXIT_FAILURE;
+	}
 
-			if (state == C_INSULATOR) {
-				*out = C_INSULATOR;
-			} else if (state == C_WIRE) {
-				int nbHeads = 0;
-				int k;
-				for (k = 0; k < 8; ++k)
-					if (*map (fromMap, i + diffs[k][0], j + diffs[k][1], xs + 2) == C_HEAD)
-						nbHeads++;
-				if (nbHeads == 1 || nbHeads == 2)
-					*out = C_HEAD;
-				else
-					*out = C_WIRE;
-			} else if (state == C_HEAD) {
-				*out = C_TAIL;
-			} else { // C_TAIL
-				*out = C_WIRE;
-			}
-		}
+	// Diagnostics : the kernels depend on the cpu
+	fprintf (stderr, "Listening on port %d : %s engine, %s cell packing\n", port,
+			settings.engine->name, cellPackKernel ());
 
-	*dir = 1 - *dir;
+	eventLoopRun (serverSock, localSock, &settings, workers, framesAhead);
+	close (serverSock);
+	if (localSock != -1)
+		close (localSock);
+	return EXIT_FAILURE;
 }
 
+static void usage (const char * prog) {
+	fprintf (stderr, "Usage : %s [-p port] [-l] [-e engine] [-t threads] [-s processes]"
+			" [-c megabytes] [-w workers] [-a frames] [-m directory] [-k generations]\n", prog);
+	fprintf (stderr, "  -p port      : listening port (default 8000)\n");
+	fprintf (stderr, "  -l           : also listen on the local socket /tmp/wireworld-<port>.sock,\n");
+	fprintf (stderr, "                 where guis of this host may share memory with the server\n");
+	fprintf (stderr, "  -e engine    : simulation engine, among : ");
+	engineList (stderr);
+	fprintf (stderr, " (default %s)\n", engineDefault ()->name);
+	fprintf (stderr, "  -t threads   : threads of parallel engines (default 0 : one per cpu)\n");
+	fprintf (stderr, "  -s processes : processes of the strips engine, each simulating a strip\n");
+	fprintf (stderr, "                 of the map (default 0 : one per cpu)\n");
+	fprintf (stderr, "  -c megabytes : detect cycles, and store up to 'megabytes' of cycle states\n");
+	fprintf (stderr, "                 to replay them without computing (default 0 : disabled,\n");
+	fprintf (stderr, "                 needs an engine with state hashes)\n");
+	fprintf (stderr, "  -w workers   : threads computing frames for all connections\n");
+	fprintf (stderr, "                 (default 0 : one per cpu)\n");
+	fprintf (stderr, "  -a frames    : frames computed ahead of requests, at most %d (default 5,\n",
+			CONNECTION_FRAMES - 1);
+	fprintf (stderr, "                 which is the number of frames the gui requests in advance)\n");
+	fprintf (stderr, "  -m directory : directory of the map files guis may load on the server\n");
+	fprintf (stderr, "                 (default : none, map files are refused)\n");
+	fprintf (stderr, "  -k generations : generations between checkpoints of simulations loaded\n");
+	fprintf (stderr, "                   from map files, resumed when loading them again\n");
+	fprintf (stderr, "                   (default 0 : disabled)\n");
+}
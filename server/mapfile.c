@@ -0,0 +1,241 @@
+#include "mapfile.h"
+#include "engine.h"
+
+#include <assert.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../protocol/protocol.h"
+#include "../protocol/cellpack.h"
+
+#define HEADER_SIZE 4 // words before the slots of a map file
+#define CHECKPOINT_HEADER_SIZE 5 // and of a checkpoint, which also has its source
+#define SLOT_HEADER_SIZE 3 // words before the frame of a slot
+#define CELLS_PER_WORD (M_BIT_SIZE / C_BIT_SIZE)
+
+struct map_checkpoint {
+	int fd;
+	uint32_t * file;
+	size_t fileSize;
+	uint32_t xsize, ysize;
+	uint32_t next; // slot written next
+};
+
+/* Frame size in words (computed in size_t, as maps loaded from files may be huge) */
+static size_t frame_words (uint32_t xsize, uint32_t ysize) {
+	return (size_t) xsize * ysize / CELLS_PER_WORD + 1;
+}
+
+/* Header size in words (checkpoints are the files with two slots) */
+static size_t header_words (uint32_t nbSlots) {
+	return nbSlots == 2 ? CHECKPOINT_HEADER_SIZE : HEADER_SIZE;
+}
+
+static size_t file_words (uint32_t xsize, uint32_t ysize, uint32_t nbSlots) {
+	return header_words (nbSlots) + nbSlots * (SLOT_HEADER_SIZE + frame_words (xsize, ysize));
+}
+
+static uint64_t slot_generation (const uint32_t * slot) {
+	return le32toh (slot[0]) | (uint64_t) le32toh (slot[1]) << 32;
+}
+
+static uint32_t checksum (const uint32_t * slot, size_t frameWords) {
+	uint32_t h = 2166136261u;
+	size_t i;
+	h = (h ^ le32toh (slot[0])) * 16777619u;
+	h = (h ^ le32toh (slot[1])) * 16777619u;
+	for (i = 0; i < frameWords; ++i)
+		h = (h ^ le32toh (slot[SLOT_HEADER_SIZE + i])) * 16777619u;
+	return h;
+}
+
+/* Returns the valid slot with the latest generation, NULL if there is none */
+static const uint32_t * latest_slot (const uint32_t * file, uint32_t xsize, uint32_t ysize,
+		uint32_t nbSlots) {
+	size_t frameWords = frame_words (xsize, ysize);
+	const uint32_t * latest = NULL;
+	uint32_t i;
+	for (i = 0; i < nbSlots; ++i) {
+		const uint32_t * slot = &file[header_words (nbSlots) + i * (SLOT_HEADER_SIZE + frameWords)];
+		if (le32toh (slot[2]) == checksum (slot, frameWords) &&
+				(latest == NULL || slot_generation (slot) > slot_generation (latest)))
+			latest = slot;
+	}
+	return latest;
+}
+
+/* Unpacks a frame of the file into a bordered map (its words are little endian, so they are
+ * converted into a copy first on big endian hosts)
+ */
+static void unpack (const uint32_t * frame, char * borderedMap, uint32_t xsize, uint32_t ysize) {
+	const uint32_t * words = frame;
+#if __BYTE_ORDER != __LITTLE_ENDIAN
+	size_t i, frameWords = frame_words (xsize, ysize);
+	uint32_t * copy = malloc (frameWords * sizeof (uint32_t));
+	assert (copy != NULL);
+	for (i = 0; i < frameWords; ++i)
+		copy[i] = le32toh (frame[i]);
+	words = copy;
+#endif
+	uint32_t y;
+	for (y = 0; y < ysize; ++y)
+		cellUnpack (words, (uint64_t) y * xsize,
+				&borderedMap[(size_t) (y + 1) * (xsize + 2) + 1], xsize);
+#if __BYTE_ORDER != __LITTLE_ENDIAN
+	free (copy);
+#endif
+}
+
+/* Packs a bordered map into a frame of the file, then converts its words to little endian */
+static void pack (const char * borderedMap, uint32_t * frame, uint32_t xsize, uint32_t ysize) {
+	size_t i, frameWords = frame_words (xsize, ysize);
+	enginePackMap (borderedMap, xsize, ysize, frame);
+	for (i = 0; i < frameWords; ++i)
+		frame[i] = htole32 (frame[i]);
+}
+
+char * mapFileLoad (const char * path, uint32_t * xsize, uint32_t * ysize, uint64_t * generation,
+		uint32_t * source, int quiet) {
+	int fd = open (path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1) {
+		if (!quiet)
+			perror (path);
+		return NULL;
+	}
+	struct stat st;
+	if (fstat (fd, &st) == -1 || (size_t) st.st_size < HEADER_SIZE * sizeof (uint32_t)) {
+		if (!quiet)
+			fprintf (stderr, "%s : invalid map file\n", path);
+		close (fd);
+		return NULL;
+	}
+	size_t fileSize = st.st_size;
+	const uint32_t * file = mmap (NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (file == MAP_FAILED) {
+		if (!quiet)
+			perror ("mmap");
+		return NULL;
+	}
+	madvise ((void *) file, fileSize, MADV_SEQUENTIAL);
+
+	// Check the header, then use the latest valid slot
+	const uint32_t * slot = NULL;
+	uint32_t nbSlots = le32toh (file[3]);
+	*xsize = le32toh (file[1]);
+	*ysize = le32toh (file[2]);
+	if (le32toh (file[0]) == MAP_FILE_MAGIC && *xsize > 0 && *ysize > 0 &&
+			engineMapCells (*xsize, *ysize) <= ENGINE_MAX_MAP_CELLS &&
+			nbSlots > 0 && nbSlots <= 2 &&
+			fileSize == file_words (*xsize, *ysize, nbSlots) * sizeof (uint32_t))
+		slot = latest_slot (file, *xsize, *ysize, nbSlots);
+
+	char * map = NULL;
+	if (slot != NULL) {
+		map = engineAllocMap (*xsize, *ysize);
+		unpack (&slot[SLOT_HEADER_SIZE], map, *xsize, *ysize);
+		*generation = slot_generation (slot);
+		*source = le32toh (nbSlots == 2 ? file[HEADER_SIZE] : slot[2]);
+	} else if (!quiet) {
+		fprintf (stderr, "%s : invalid map file\n", path);
+	}
+	munmap ((void *) file, fileSize);
+	return map;
+}
+
+int mapFileSource (const char * path, uint32_t * source) {
+	int fd = open (path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	uint32_t headers[HEADER_SIZE + SLOT_HEADER_SIZE];
+	int valid = pread (fd, headers, sizeof (headers), 0) == sizeof (headers) &&
+		le32toh (headers[0]) == MAP_FILE_MAGIC && le32toh (headers[3]) == 1;
+	close (fd);
+	if (!valid)
+		return -1;
+	*source = le32toh (headers[HEADER_SIZE + 2]);
+	return 0;
+}
+
+map_checkpoint_t * mapCheckpointOpen (const char * path, uint32_t xsize, uint32_t ysize,
+		uint32_t source) {
+	int fd = open (path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		perror (path);
+		return NULL;
+	}
+	if (flock (fd, LOCK_EX | LOCK_NB) == -1) {
+		close (fd); // Used by another simulation
+		return NULL;
+	}
+
+	// Keep the slots of a checkpoint of the same map file, or start from a blank one
+	uint32_t header[CHECKPOINT_HEADER_SIZE];
+	size_t fileSize = file_words (xsize, ysize, 2) * sizeof (uint32_t);
+	struct stat st;
+	int reuse = fstat (fd, &st) == 0 && (size_t) st.st_size == fileSize &&
+		pread (fd, header, sizeof (header), 0) == sizeof (header) &&
+		le32toh (header[0]) == MAP_FILE_MAGIC && le32toh (header[1]) == xsize &&
+		le32toh (header[2]) == ysize && le32toh (header[3]) == 2 &&
+		le32toh (header[4]) == source;
+	if (!reuse && (ftruncate (fd, 0) == -1 || ftruncate (fd, fileSize) == -1)) {
+		perror (path);
+		close (fd);
+		return NULL;
+	}
+
+	uint32_t * file = mmap (NULL, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (file == MAP_FAILED) {
+		perror ("mmap");
+		close (fd);
+		return NULL;
+	}
+
+	map_checkpoint_t * cp = malloc (sizeof (map_checkpoint_t));
+	assert (cp != NULL);
+	cp->fd = fd;
+	cp->file = file;
+	cp->fileSize = fileSize;
+	cp->xsize = xsize;
+	cp->ysize = ysize;
+
+	if (reuse) {
+		// Overwrite the other slot than the latest valid one
+		const uint32_t * latest = latest_slot (file, xsize, ysize, 2);
+		cp->next = latest == &file[CHECKPOINT_HEADER_SIZE] ? 1 : 0;
+	} else {
+		file[0] = htole32 (MAP_FILE_MAGIC);
+		file[1] = htole32 (xsize);
+		file[2] = htole32 (ysize);
+		file[3] = htole32 (2);
+		file[4] = htole32 (source);
+		cp->next = 0;
+	}
+	return cp;
+}
+
+void mapCheckpointWrite (map_checkpoint_t * cp, const char * borderedMap, uint64_t generation) {
+	size_t frameWords = frame_words (cp->xsize, cp->ysize);
+	uint32_t * slot = &cp->file[CHECKPOINT_HEADER_SIZE + cp->next * (SLOT_HEADER_SIZE + frameWords)];
+
+	// The checksum only matches once the whole slot is written, the other one stays valid
+	pack (borderedMap, &slot[SLOT_HEADER_SIZE], cp->xsize, cp->ysize);
+	slot[0] = htole32 ((uint32_t) generation);
+	slot[1] = htole32 ((uint32_t) (generation >> 32));
+	slot[2] = htole32 (checksum (slot, frameWords));
+	msync (cp->file, cp->fileSize, MS_ASYNC);
+	cp->next = 1 - cp->next;
+}
+
+void mapCheckpointClose (map_checkpoint_t * cp) {
+	munmap (cp->file, cp->fileSize);
+	close (cp->fd); // Releases the lock
+	free (cp);
+}
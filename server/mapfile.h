@@ -0,0 +1,62 @@
+#ifndef MAPFILE_H
+#define MAPFILE_H
+
+#include <stdint.h>
+
+/* Server local map files.
+ *
+ * Maps too large to be sent by the gui are read from files on the server, by memory mapping
+ * them, and simulations are checkpointed in the same format, so that a checkpoint can be loaded
+ * like a map. All fields are little endian uint32_t :
+ *	   magic   : 1 [MAP_FILE_MAGIC]
+ *	   xsize   : 1
+ *	   ysize   : 1
+ *	   nbSlots : 1
+ *	   source  : 1 (checkpoints only, see below)
+ *	   slots   : nbSlots * (3 + xsize * ysize * C_BIT_SIZE / M_BIT_SIZE + 1)
+ * Each slot is a state of the map :
+ *	   generation : 2 (low word first)
+ *	   checksum   : 1 (FNV-1a of the generation and frame words)
+ *	   frame      : in the R_INIT frame format
+ * A map file has one slot, at generation 0. A checkpoint has two, written alternately, so that
+ * a valid one remains if the server stops while writing the other. The latest valid slot is
+ * loaded.
+ * Files are opened without following symbolic links : their paths are resolved by the caller,
+ * and a link planted as a checkpoint must not be written through.
+ * The source of a checkpoint is the checksum of the slot of the map file it was started from,
+ * so that a checkpoint is not resumed once its map file is edited or replaced.
+ */
+
+#define MAP_FILE_MAGIC 0x50414d57u // "WMAP"
+
+typedef struct map_checkpoint map_checkpoint_t;
+
+/* Loads a map file (or a checkpoint) into a new bordered map (see engine.h), refusing maps too
+ * large for the engines. *source is set to the source of the map : the checksum of its slot for
+ * a map file, or the source of a checkpoint.
+ * Returns NULL on error (and prints an error message, unless 'quiet' is set).
+ */
+char * mapFileLoad (const char * path, uint32_t * xsize, uint32_t * ysize, uint64_t * generation,
+		uint32_t * source, int quiet);
+
+/* Reads the source of a map file (as mapFileLoad, but only reading its headers).
+ * Returns -1 on error, 0 on success.
+ */
+int mapFileSource (const char * path, uint32_t * source);
+
+/* Opens the checkpoint file of a simulation started from the map file of the given source,
+ * creating it if needed (its slots are only kept if they come from the same map file). The file
+ * is locked while it is open, so that two simulations do not write the same checkpoint.
+ * Returns NULL on error, or if another simulation is using it.
+ */
+map_checkpoint_t * mapCheckpointOpen (const char * path, uint32_t xsize, uint32_t ysize,
+		uint32_t source);
+
+/* Writes a state of the simulation, replacing the oldest one.
+ */
+void mapCheckpointWrite (map_checkpoint_t * checkpoint, const char * borderedMap,
+		uint64_t generation);
+
+void mapCheckpointClose (map_checkpoint_t * checkpoint);
+
+#endif
@@ -0,0 +1,232 @@
+#include "engine.h"
+#include "bitadder.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../protocol/protocol.h"
+
+/* Packed engine.
+ *
+ * The map is stored with the cell encoding of the protocol frames : 2 bits per cell, 32 cells
+ * per word, the cell x of a row being at bits 2 * (x % 32) of its word x / 32. Rows are padded
+ * to whole words, with a ghost word on each side, and there is a ghost row above and below the
+ * map, all insulators. So the state takes 4 times less memory than a char map, and a frame is
+ * made by concatenating the rows with word shifts, without looking at the cells.
+ *
+ * Generations are computed in place, row by row, with the bitwise adder of bitadder.h (shared
+ * with the bitslice engine) over head masks (one bit per cell, the low bit of its pair). The masks
+ * of the row above are computed before it is updated, so they are the only state kept aside.
+ */
+
+#define WORD_CELLS 32
+#define LOW_BITS 0x5555555555555555ull
+
+typedef struct {
+	engine_t base;
+
+	uint32_t stride; // words per row, ghost words included
+	uint64_t * cells;
+	uint64_t * masks[3]; // head masks of 3 rows, ghost words included
+} packed_engine_t;
+
+static inline uint64_t * row (uint64_t * cells, uint32_t y, uint32_t stride) {
+	// Points to the first real word of map row y (ghost row is y = -1)
+	return &cells[(size_t) (y + 1) * stride + 1];
+}
+
+/* Heads are 10 : high bit set, low bit clear */
+static void head_masks (uint64_t * restrict masks, const uint64_t * restrict line, int nwords) {
+	int k;
+	for (k = 0; k < nwords; ++k)
+		masks[k] = (line[k] >> 1) & ~line[k] & LOW_BITS;
+}
+
+static engine_t * packed_create (const char * borderedMap, uint32_t xsize, uint32_t ysize,
+		const engine_params_t * params) {
+	(void) params;
+	packed_engine_t * e = malloc (sizeof (packed_engine_t));
+	assert (e != NULL);
+
+	e->stride = (xsize + WORD_CELLS - 1) / WORD_CELLS + 2;
+	e->cells = calloc ((size_t) e->stride * (ysize + 2), sizeof (uint64_t));
+	assert (e->cells != NULL);
+	int i;
+	for (i = 0; i < 3; ++i) {
+		e->masks[i] = calloc (e->stride, sizeof (uint64_t));
+		assert (e->masks[i] != NULL);
+	}
+
+	uint32_t x, y;
+	for (y = 0; y < ysize; ++y) {
+		const char * line = &borderedMap[(size_t) (y + 1) * (xsize + 2) + 1];
+		uint64_t * cells = row (e->cells, y, e->stride);
+		for (x = 0; x < xsize; ++x)
+			cells[x / WORD_CELLS] |= (uint64_t) line[x] << (C_BIT_SIZE * (x % WORD_CELLS));
+	}
+	return &e->base;
+}
+
+/* Computes the next state of a row, in place.
+ * up, mid, down are the head masks of the rows around it, before their update ;
+ * all pointers point to the first real word, and [-1] and [nwords] of masks must be readable.
+ */
+KERNEL_CLONES
+static void packed_row (uint64_t * restrict cells,
+		const uint64_t * restrict up, const uint64_t * restrict mid, const uint64_t * restrict down,
+		int nwords) {
+	int k;
+	for (k = 0; k < nwords; ++k) {
+		// Neighbour masks : left neighbour (x - 1) is obtained by a shift towards high bits
+		uint64_t uL = (up[k] << 2) | (up[k - 1] >> 62);
+		uint64_t uC = up[k];
+		uint64_t uR = (up[k] >> 2) | (up[k + 1] << 62);
+		uint64_t mL = (mid[k] << 2) | (mid[k - 1] >> 62);
+		uint64_t mR = (mid[k] >> 2) | (mid[k + 1] << 62);
+		uint64_t dL = (down[k] << 2) | (down[k - 1] >> 62);
+		uint64_t dC = down[k];
+		uint64_t dR = (down[k] >> 2) | (down[k + 1] << 62);
+
+		// Wires (01) with 1 or 2 heads become heads (10), heads become tails (11), and tails
+		// become wires
+		uint64_t low = cells[k] & LOW_BITS, high = (cells[k] >> 1) & LOW_BITS;
+		uint64_t birth = bitAdderOneOrTwo (uL, uC, uR, mL, mR, dL, dC, dR) & low & ~high;
+		uint64_t nextLow = (low | high) & ~birth;
+		uint64_t nextHigh = birth | (high & ~low);
+		cells[k] = nextLow | (nextHigh << 1);
+	}
+}
+
+static int packed_step (engine_t * engine, uint32_t generations) {
+	packed_engine_t * e = (packed_engine_t *) engine;
+	int nwords = e->stride - 2;
+	uint32_t g, y;
+
+	for (g = 0; g < generations; ++g) {
+		uint64_t * up = &e->masks[0][1], * mid = &e->masks[1][1], * down = &e->masks[2][1];
+		memset (up, 0, nwords * sizeof (uint64_t)); // ghost row
+		head_masks (mid, row (e->cells, 0, e->stride), nwords);
+
+		for (y = 0; y < engine->ysize; ++y) {
+			if (y + 1 < engine->ysize)
+				head_masks (down, row (e->cells, y + 1, e->stride), nwords);
+			else
+				memset (down, 0, nwords * sizeof (uint64_t));
+			packed_row (row (e->cells, y, e->stride), up, mid, down, nwords);
+
+			uint64_t * tmp = up;
+			up = mid;
+			mid = down;
+			down = tmp;
+		}
+	}
+	return 0;
+}
+
+static char * packed_export (engine_t * engine, char * scratch) {
+	packed_engine_t * e = (packed_engine_t *) engine;
+	uint32_t xsize = engine->xsize;
+	uint32_t x, y;
+
+	for (y = 0; y < engine->ysize; ++y) {
+		char * line = &scratch[(size_t) (y + 1) * (xsize + 2) + 1];
+		const uint64_t * cells = row (e->cells, y, e->stride);
+		for (x = 0; x < xsize; x += WORD_CELLS) {
+			uint64_t word = cells[x / WORD_CELLS];
+			uint32_t n = xsize - x < WORD_CELLS ? xsize - x : WORD_CELLS;
+			uint32_t i;
+			if (word == 0) {
+				memset (&line[x], C_INSULATOR, n);
+				continue;
+			}
+			for (i = 0; i < n; ++i, word >>= C_BIT_SIZE)
+				line[x + i] = word & C_BIT_MASK;
+		}
+	}
+	return scratch;
+}
+
+/* Appends the nbBits low bits of bits to the frame. 'pending' holds less than 32 bits which are
+ * not written yet, and nbBits is at most 32, so it never overflows.
+ */
+static inline void append (uint32_t * frame, size_t * n, uint64_t * pending, uint32_t * nbPending,
+		uint32_t bits, uint32_t nbBits) {
+	*pending |= (uint64_t) bits << *nbPending;
+	*nbPending += nbBits;
+	if (*nbPending >= 32) {
+		frame[(*n)++] = (uint32_t) *pending;
+		*pending >>= 32;
+		*nbPending -= 32;
+	}
+}
+
+static int packed_pack (engine_t * engine, uint32_t * frame) {
+	packed_engine_t * e = (packed_engine_t *) engine;
+	uint32_t nwords = e->stride - 2;
+	uint32_t lastBits = C_BIT_SIZE * (engine->xsize - (nwords - 1) * WORD_CELLS);
+	size_t n = 0, size = (size_t) engine->xsize * engine->ysize * C_BIT_SIZE / M_BIT_SIZE + 1;
+	uint64_t pending = 0;
+	uint32_t nbPending = 0, y, k;
+
+	// Rows are concatenated : padding bits of the last word of a row are dropped
+	for (y = 0; y < engine->ysize; ++y) {
+		const uint64_t * cells = row (e->cells, y, e->stride);
+		for (k = 0; k < nwords; ++k) {
+			uint32_t nbBits = k == nwords - 1 ? lastBits : 64;
+			append (frame, &n, &pending, &nbPending, (uint32_t) cells[k],
+					nbBits < 32 ? nbBits : 32);
+			if (nbBits > 32)
+				append (frame, &n, &pending, &nbPending, (uint32_t) (cells[k] >> 32), nbBits - 32);
+		}
+	}
+	while (n < size) {
+		frame[n++] = (uint32_t) pending;
+		pending = 0;
+	}
+	return 0;
+}
+
+static uint64_t packed_activity (engine_t * engine) {
+	packed_engine_t * e = (packed_engine_t *) engine;
+	size_t i, size = (size_t) e->stride * (engine->ysize + 2);
+	uint64_t count = 0;
+	for (i = 0; i < size; ++i)
+		count += __builtin_popcountll ((e->cells[i] >> 1) & LOW_BITS);
+	return count;
+}
+
+static uint64_t packed_hash (engine_t * engine) {
+	packed_engine_t * e = (packed_engine_t *) engine;
+	uint32_t xsize = engine->xsize;
+	uint64_t hash = 0;
+	uint32_t y, k;
+	for (y = 0; y < engine->ysize; ++y) {
+		const uint64_t * cells = row (e->cells, y, e->stride);
+		for (k = 0; k < e->stride - 2; ++k) {
+			uint64_t bits = (cells[k] >> 1) & LOW_BITS; // heads and tails
+			while (bits != 0) {
+				uint32_t b = __builtin_ctzll (bits);
+				uint32_t x = k * WORD_CELLS + b / C_BIT_SIZE;
+				hash += engineCellHash ((x + 1) + (y + 1) * (xsize + 2),
+						(cells[k] >> b) & 1 ? C_TAIL : C_HEAD);
+				bits &= bits - 1;
+			}
+		}
+	}
+	return hash;
+}
+
+static void packed_destroy (engine_t * engine) {
+	packed_engine_t * e = (packed_engine_t *) engine;
+	free (e->cells);
+	free (e->masks[0]);
+	free (e->masks[1]);
+	free (e->masks[2]);
+	free (e);
+}
+
+const engine_ops_t packedEngine = {
+	"packed", packed_create, packed_step, packed_export, packed_pack, packed_activity,
+	packed_hash, packed_destroy
+};
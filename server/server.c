@@ -6,16 +6,78 @@ static char * cmap (char * map, uint32_t x, uint32_t y, uint32_t width) {
 	return &map[x + y * width];
 }
 
-/* Recv/send with endianness conversion */
-static int recvMessages (int sock, wireworld_message_t * buffer, uint32_t count);
-static int sendMessages (int sock, wireworld_message_t * buffer, uint32_t count);
+/* Per connection state, indexed by socket.
+ * Answers are encoded in place (already converted to the wire byte order) in frame buffers
+ * which are reused from frame to frame, and a whole frame is sent in one system call.
+ * Frame buffers form a ring : frames[first] to frames[first + queued - 1] are complete
+ * (the 'released' first ones may be sent), and the next one is being encoded. So one thread
+ * can encode frames while another sends the previous ones.
+ * Requests are read in an input buffer, and only decoded once complete, so that non blocking
+ * sockets can be resumed where they stopped.
+ * The table is shared by all threads (the event loop and compute workers), so it is protected
+ * by a lock.
+ */
+typedef struct {
+	wireworld_message_t * messages;
+	uint32_t length, capacity;
+} frame_buffer_t;
 
-/* Network to char map conversion */
-static void networkToCharMap (wireworld_message_t * networkMap, char * charMap,
+typedef struct {
+	frame_buffer_t frames[CONNECTION_FRAMES];
+	uint32_t first, queued, released; // protected by lock
+	size_t sent; // bytes of frames[first] already sent
+	pthread_mutex_t lock;
+
+	// Row of blocks of the A_LOD_UPDATE being encoded (kept from one update to the next)
+	char * lodRow;
+	uint32_t lodRowCapacity;
+	int littleEndian; // F_LITTLE_ENDIAN accepted
+	uint32_t features; // accepted features (sizes of the requests which depend on them)
+
+	char * input;
+	size_t inputStart, inputLength, inputCapacity; // received bytes, from inputStart
+
+	// Init message being received : its frame is decoded as it arrives (see receiveInitFrame)
+	wireworld_message_t initType;
+	uint32_t initWidth, initHeight, initSampling, initFeatures, initName;
+	char * initMap; // bordered, NULL until the header is received
+	uint64_t initDecoded; // messages of the frame
+	uint32_t initX, initY; // next cell
+
+	// Shared memory ring (F_SHARED_MEMORY) : its file descriptors are passed with the A_INIT_ACK
+	// message (ringFd is then closed), and it replaces the socket for the next answers
+	shm_ring_t ring; // not mapped if ring.base is NULL
+	int ringFd, notifyFd, wakeFd;
+	int ringActive;
+} connection_t;
+
+static connection_t ** connections = NULL;
+static int nbConnections = 0;
+static pthread_mutex_t connectionsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static connection_t * getConnection (int sock);
+static frame_buffer_t * encodedFrame (connection_t * conn);
+static wireworld_message_t * reserveMessages (connection_t * conn, uint32_t count);
+static void convertMessages (connection_t * conn, wireworld_message_t * buffer, uint32_t count);
+static void queueFrame (connection_t * conn, int release);
+static int waitForInitFile (int connSock, connection_t * conn,
+		uint32_t * sampling, uint32_t * features, uint32_t * name, char ** mapPath);
+static int sendInitAck (int connSock, connection_t * conn,
+		wireworld_message_t * ack, uint32_t size, uint32_t features);
+static int flushMessages (int sock, connection_t * conn);
+static uint32_t localFeatures (int sock);
+static uint32_t setupSharedMemory (connection_t * conn, uint32_t features,
 		uint32_t width, uint32_t height);
-void charToNetworkMap (wireworld_message_t * networkMap, char * charMap,
-		uint32_t width, uint32_t height,
-		uint32_t xs, uint32_t ys, uint32_t xe, uint32_t ye);
+static ssize_t sendWithRing (int sock, connection_t * conn, const char * data, size_t size);
+
+/* Received requests access (in wire byte order) */
+static int peekMessages (int sock, connection_t * conn, uint32_t count,
+		wireworld_message_t ** messages);
+static void consumeMessages (connection_t * conn, uint32_t count);
+
+/* Init frame decoding */
+static char * allocBorderedMap (uint32_t width, uint32_t height);
+static int receiveInitFrame (int sock, connection_t * conn);
 
 /* Server functions */
 
@@ -49,6 +111,31 @@ int serverInit (int port) {
 	return -1;
 }
 
+int serverInitLocal (int port) {
+	struct sockaddr_un saddr;
+	memset (&saddr, 0, sizeof (saddr));
+	saddr.sun_family = AF_UNIX;
+	snprintf (saddr.sun_path, sizeof (saddr.sun_path), LOCAL_SOCKET_PATH, port);
+
+	int sock = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (sock == -1) {
+		perror ("socket");
+		return -1;
+	}
+	unlink (saddr.sun_path); // left by a previous server
+	if (bind (sock, (const struct sockaddr *) &saddr, sizeof (saddr)) == -1) {
+		perror ("bind");
+		close (sock);
+		return -1;
+	}
+	if (listen (sock, SERVER_BACKLOG) == -1) {
+		perror ("listen");
+		close (sock);
+		return -1;
+	}
+	return sock;
+}
+
 int serverAccept (int serverSock) {
 	assert (serverSock != -1);
 	int sock = accept (serverSock, NULL, NULL);
@@ -58,47 +145,134 @@ int serverAccept (int serverSock) {
 }
 
 /* Connection functions */
-int connectionWaitForInit (int connSock,
-		uint32_t * width, uint32_t * height, uint32_t * sampling, char ** firstFrame) {
-	wireworld_message_t message[4];
+int connectionWaitForInitEx (int connSock,
+		uint32_t * width, uint32_t * height, uint32_t * sampling, uint32_t * features,
+		uint32_t * name, char ** firstFrame, char ** mapPath) {
+	connection_t * conn = getConnection (connSock);
+	int res;
 
 	assert (width != NULL);
 	assert (height != NULL);
 	assert (sampling != NULL);
+	assert (features != NULL);
+	assert (name != NULL);
 	assert (firstFrame != NULL);
 
-	if (recvMessages (connSock, message, 4) == 0 && message[0] == R_INIT) {
-		// If init message, retrieve sizes and sampling
-		*width = message[1];
-		*height = message[2];
-		*sampling = message[3];
-
-		// Prepare buffer to read init map
-		uint32_t data_size = wireworldFrameMessageSize (*width, *height);
-		wireworld_message_t * buf = malloc (data_size * sizeof (wireworld_message_t));
-		assert (buf != NULL);
-
-		// Read map
-		if (recvMessages (connSock, buf, data_size) == 0) {
-			// Alloc char map
-			*firstFrame = malloc (*width * *height * sizeof (char));
-			assert (*firstFrame != NULL);
+	// Header (consumed once complete, then the frame is decoded as it is received)
+	if (conn->initMap == NULL) {
+		wireworld_message_t message[6] = { 0 };
+		wireworld_message_t * raw;
+		uint32_t i, headerSize = 4;
+		res = peekMessages (connSock, conn, headerSize, &raw);
+		if (res == 0) {
+			for (i = 0; i < headerSize; ++i)
+				message[i] = ntohl (raw[i]);
+			if (message[0] == R_INIT_EX) {
+				headerSize = 5;
+				res = peekMessages (connSock, conn, headerSize, &raw);
+				if (res == 0)
+					message[4] = ntohl (raw[4]);
+				if (res == 0 && (message[4] & F_SHARED_SESSION)) {
+					headerSize = 6;
+					res = peekMessages (connSock, conn, headerSize, &raw);
+					if (res == 0)
+						message[5] = ntohl (raw[5]);
+				}
+			}
+		}
+		if (res == 2)
+			return 2;
 
-			// Convert network map to char map
-			networkToCharMap (buf, *firstFrame, *width, *height);
+		if (res == 0 && message[0] == R_INIT_FILE && mapPath != NULL) {
+			*firstFrame = NULL;
+			return waitForInitFile (connSock, conn, sampling, features, name, mapPath);
+		} else if (res == 0 && (message[0] == R_INIT || message[0] == R_INIT_EX)) {
+			// If init message, retrieve sizes, sampling, and features
+			conn->initType = message[0];
+			conn->initWidth = message[1];
+			conn->initHeight = message[2];
+			conn->initSampling = message[3];
+			conn->initFeatures = 0;
+			if (message[0] == R_INIT_EX) {
+				conn->initFeatures = (*features | F_LITTLE_ENDIAN | localFeatures (connSock)) &
+					message[4];
+				if (conn->initSampling != 1)
+					conn->initFeatures &= ~F_HEADS_ONLY;
+				if (conn->initFeatures & F_SHARED_SESSION)
+					conn->initName = message[5];
+			}
+			if (conn->initWidth == 0 || conn->initHeight == 0 ||
+					(uint64_t) conn->initWidth * conn->initHeight > INIT_MAX_CELLS) {
+				fprintf (stderr, "Invalid map size : %ux%u\n", conn->initWidth,
+						conn->initHeight);
+				return -1;
+			}
+			consumeMessages (conn, headerSize);
 
-			// destroy temp buffer
-			free (buf);
-			return 0;
+			conn->initMap = allocBorderedMap (conn->initWidth, conn->initHeight);
+			if (conn->initMap == NULL) {
+				fprintf (stderr, "Unable to allocate a %ux%u map\n", conn->initWidth,
+						conn->initHeight);
+				return -1;
+			}
+			conn->initDecoded = 0;
+			conn->initX = 0;
+			conn->initY = 0;
 		} else {
-			fprintf (stderr, "Unable to read the first frame\n");
-			free (buf);
+			fprintf (stderr, "Received something which is not an init message\n");
 			return -1;
 		}
-	} else {
-		fprintf (stderr, "Received something which is not an init message\n");
+	}
+
+	// Frame
+	res = receiveInitFrame (connSock, conn);
+	if (res == 2)
+		return 2;
+	if (res != 0) {
+		fprintf (stderr, "Unable to read the first frame\n");
+		free (conn->initMap);
+		conn->initMap = NULL;
 		return -1;
 	}
+
+	*width = conn->initWidth;
+	*height = conn->initHeight;
+	*sampling = conn->initSampling;
+	*features = conn->initFeatures;
+	if (*features & F_SHARED_SESSION)
+		*name = conn->initName;
+	*firstFrame = conn->initMap;
+	conn->initMap = NULL;
+
+	// Acknowledge extended init
+	if (conn->initType == R_INIT_EX) {
+		*features = setupSharedMemory (conn, *features, *width, *height);
+		wireworld_message_t * ack = reserveMessages (conn, 2);
+		ack[0] = A_INIT_ACK;
+		ack[1] = *features;
+		res = sendInitAck (connSock, conn, ack, 2, *features);
+		if (res != 0 && res != 2) {
+			fprintf (stderr, "Unable to send A_INIT_ACK\n");
+			free (*firstFrame);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int connectionSendInitAck (int connSock, uint32_t features, uint32_t width, uint32_t height) {
+	assert (connSock != -1);
+	connection_t * conn = getConnection (connSock);
+	features = setupSharedMemory (conn, features, width, height);
+	wireworld_message_t * ack = reserveMessages (conn, 4);
+	ack[0] = A_INIT_ACK;
+	ack[1] = features;
+	ack[2] = width;
+	ack[3] = height;
+	int res = sendInitAck (connSock, conn, ack, 4, features);
+	if (res == -1)
+		fprintf (stderr, "Unable to send A_INIT_ACK\n");
+	return res;
 }
 
 int connectionSendFullUpdate (int connSock,
@@ -114,6 +288,8 @@ int connectionSendFullUpdate (int connSock,
 	// Checking time
 	if (res == 0 && res2 == 0) {
 		return 0; // All went well
+	} else if (res == 0 && res2 == 2) {
+		return 2; // Non blocking, not sent yet
 	} else if (res == 1 || res2 == 1) {
 		return 1; // End of connection
 	} else {
@@ -125,80 +301,277 @@ int connectionSendFullUpdate (int connSock,
 int connectionWaitFrameRequest (int connSock) {
 	assert (connSock != -1);
 
-	wireworld_message_t message;
-	int res = recvMessages (connSock, &message, 1);
+	wireworld_message_t * raw;
+	int res = peekMessages (connSock, getConnection (connSock), 1, &raw);
 	if (res == 0) {
+		wireworld_message_t message = ntohl (*raw);
+		consumeMessages (getConnection (connSock), 1);
 		if (message == R_FRAME) {
 			return 0;
 		} else {
 			fprintf (stderr, "Expected R_FRAME message but got something else : %u\n", message);
 		}
-	} else if (res == 1) {
-		return 1;
+	} else if (res == 1 || res == 2) {
+		return res;
 	} else {
 		fprintf (stderr, "Error while receiving R_FRAME request\n");
 	}
 	return -1;
 }
 
+int connectionWaitFrameRequestEx (int connSock, uint32_t * count, uint32_t * interval,
+		uint32_t * viewport) {
+	assert (connSock != -1);
+	assert (count != NULL && interval != NULL);
+	connection_t * conn = getConnection (connSock);
+
+	// Get the type, then the whole request
+	wireworld_message_t * raw;
+	int res = peekMessages (connSock, conn, 1, &raw);
+	if (res == 0) {
+		wireworld_message_t message = ntohl (raw[0]);
+		uint32_t viewportSize = conn->features & F_LEVEL_OF_DETAIL ? 6 : 5;
+		uint32_t size = message == R_FRAME_N ? 2 : message == R_STREAM ? 3 :
+			message == R_VIEWPORT && viewport != NULL ? viewportSize : 1;
+		if (size > 1)
+			res = peekMessages (connSock, conn, size, &raw);
+		if (res == 0) {
+			consumeMessages (conn, size);
+			if (message == R_FRAME) {
+				*count = 1;
+				return 0;
+			} else if (message == R_FRAME_N) {
+				*count = ntohl (raw[1]);
+				return 0;
+			} else if (message == R_STREAM) {
+				*count = ntohl (raw[1]);
+				*interval = ntohl (raw[2]);
+				return 0;
+			} else if (message == R_VIEWPORT && viewport != NULL) {
+				uint32_t i;
+				for (i = 0; i < 4; ++i)
+					viewport[i] = ntohl (raw[1 + i]);
+				viewport[4] = viewportSize == 6 ? ntohl (raw[5]) : 0;
+				*count = 0;
+				return 0;
+			} else {
+				fprintf (stderr, "Expected a frame request but got something else : %u\n", message);
+				return -1;
+			}
+		}
+	}
+	if (res == 1 || res == 2)
+		return res;
+	fprintf (stderr, "Error while receiving frame request\n");
+	return -1;
+}
+
 int connectionSendRectUpdate (int connSock,
 		char * charMap, uint32_t width, uint32_t height,
 		uint32_t localXStart, uint32_t localYStart, uint32_t localXEnd, uint32_t localYEnd,
 		uint32_t realXStart, uint32_t realYStart) {
-	int ret = -1;
 	assert (connSock != -1);
 	assert (charMap != NULL && width > 0 && height > 0);
 	assert (0 < localXStart && localXStart < localXEnd && localXEnd < width);
 	assert (0 < localYStart && localYStart < localYEnd && localYEnd < height);
 
-	// Init header message
-	wireworld_message_t message[5];
+	connection_t * conn = getConnection (connSock);
+	uint32_t data_size = wireworldFrameMessageSize (
+			localXEnd - localXStart,
+			localYEnd - localYStart);
+	wireworld_message_t * message = reserveMessages (conn, 5 + data_size);
+
+	// Header
 	message[0] = A_RECT_UPDATE;
 	message[1] = realXStart;
 	message[2] = realYStart;
 	message[3] = realXStart + localXEnd - localXStart;
 	message[4] = realYStart + localYEnd - localYStart;
-	
-	// Send it
-	int res = sendMessages (connSock, message, 5);
-	if (res == 0) {
-		// Prepare buffer
-		uint32_t data_size = wireworldFrameMessageSize (
-				localXEnd - localXStart,
-				localYEnd - localYStart);
-		wireworld_message_t * buf = malloc (data_size * sizeof (wireworld_message_t));
-		assert (buf != NULL);
-
-		// Convert
-		charToNetworkMap (buf,
-				charMap, width, height,
-				localXStart, localYStart, localXEnd, localYEnd);
-
-		// Send data
-		int res2 = sendMessages (connSock, buf, data_size);
-		if (res2 == 0) {
-			ret = 0;
-		} else if (res2 == 1) {
-			ret = 1;
-		} else {
-			fprintf (stderr, "Error while sending A_RECT_UPDATE data\n");
+
+	// Data, right after it
+	charToNetworkMap (&message[5],
+			charMap, width, height,
+			localXStart, localYStart, localXEnd, localYEnd);
+
+	convertMessages (conn, message, 5 + data_size);
+	return 0;
+}
+
+int connectionSendLodUpdate (int connSock,
+		const char * borderedMap, uint32_t xsize, uint32_t ysize, uint32_t level,
+		uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2) {
+	assert (connSock != -1);
+	assert (borderedMap != NULL && level <= LOD_MAX_LEVEL);
+	assert (x1 < x2 && y1 < y2);
+	assert (((uint64_t) (x2 - 1) << level) < xsize && ((uint64_t) (y2 - 1) << level) < ysize);
+
+	connection_t * conn = getConnection (connSock);
+	uint32_t width = x2 - x1, height = y2 - y1;
+	uint32_t data_size = wireworldFrameMessageSize (width, height);
+	wireworld_message_t * message = reserveMessages (conn, 6 + data_size);
+
+	// Header
+	message[0] = A_LOD_UPDATE;
+	message[1] = level;
+	message[2] = x1;
+	message[3] = y1;
+	message[4] = x2;
+	message[5] = y2;
+
+	// Blocks are reduced row by row to the highest rank of their cells (insulator < wire < tail
+	// < head), which is then turned back to a state
+	static const char rank[4] = { 0, 1, 3, 2 }; // of C_INSULATOR, C_WIRE, C_HEAD, C_TAIL
+	static const char state[4] = { C_INSULATOR, C_WIRE, C_TAIL, C_HEAD };
+	uint64_t xStart = (uint64_t) x1 << level;
+	uint64_t xEnd = (uint64_t) x2 << level < xsize ? (uint64_t) x2 << level : xsize;
+	if (width > conn->lodRowCapacity) {
+		conn->lodRowCapacity = conn->lodRowCapacity * 2 > width ? conn->lodRowCapacity * 2 : width;
+		conn->lodRow = realloc (conn->lodRow, conn->lodRowCapacity);
+		assert (conn->lodRow != NULL);
+	}
+	char * blocks = conn->lodRow;
+	message[5 + data_size] = 0;
+	uint32_t j;
+	for (j = 0; j < height; ++j) {
+		uint64_t y = (uint64_t) (y1 + j) << level;
+		uint64_t yEnd = (uint64_t) (y1 + j + 1) << level < ysize ? (uint64_t) (y1 + j + 1) << level : ysize;
+		memset (blocks, 0, width);
+		for (; y < yEnd; ++y) {
+			const char * line = &borderedMap[(y + 1) * (xsize + 2) + 1];
+			uint64_t x;
+			for (x = xStart; x < xEnd; ++x) {
+				char r = rank[(int) line[x]];
+				char * block = &blocks[(x >> level) - x1];
+				if (r > *block)
+					*block = r;
+			}
 		}
+		uint32_t i;
+		for (i = 0; i < width; ++i)
+			blocks[i] = state[(int) blocks[i]];
+		cellPack (&message[6], (uint64_t) j * width, blocks, width);
+	}
 
-		free (buf);
-	} else if (res == 1) {
-		ret = 1;
-	} else {
-		fprintf (stderr, "Error while sending A_RECT_UPDATE header\n");
+	convertMessages (conn, message, 6 + data_size);
+	return 0;
+}
+
+int connectionSendDeltaUpdate (int connSock,
+		const wireworld_message_t * frame, const wireworld_message_t * previousFrame,
+		uint32_t size) {
+	assert (connSock != -1);
+	assert (frame != NULL && previousFrame != NULL);
+
+	// Worst case is a single run covering the frame
+	connection_t * conn = getConnection (connSock);
+	frame_buffer_t * encoded = encodedFrame (conn);
+	uint32_t start = encoded->length;
+	wireworld_message_t * buf = reserveMessages (conn, size + 4);
+	buf[0] = A_DELTA_UPDATE;
+
+	// Encode runs. Gaps of 1 or 2 zero words are cheaper inside a run than as a new run header.
+	uint32_t length = 2, i = 0, last = 0;
+	while (i < size) {
+		if (frame[i] == previousFrame[i]) {
+			i++;
+			continue;
+		}
+
+		// New run
+		uint32_t * count = &buf[length + 1];
+		buf[length] = i - last;
+		*count = 0;
+		length += 2;
+		uint32_t zeros = 0;
+		while (i < size && zeros <= 2) {
+			wireworld_message_t word = frame[i] ^ previousFrame[i];
+			zeros = word == 0 ? zeros + 1 : 0;
+			buf[length++] = word;
+			(*count)++;
+			i++;
+		}
+		// Trailing zero words are not part of the run
+		length -= zeros;
+		*count -= zeros;
+		last = i - zeros;
 	}
-	return ret;
+	buf[1] = length - 2;
+
+	encoded->length = start + length;
+	convertMessages (conn, buf, length);
+	return 0;
+}
+
+int connectionSendHeadsUpdate (int connSock,
+		char * charMap, uint32_t width, uint32_t height,
+		uint32_t localXStart, uint32_t localYStart, uint32_t localXEnd, uint32_t localYEnd) {
+	assert (connSock != -1);
+	assert (charMap != NULL && width > 0 && height > 0);
+	assert (0 < localXStart && localXStart < localXEnd && localXEnd < width);
+	assert (0 < localYStart && localYStart < localYEnd && localYEnd < height);
+
+	uint32_t xsize = localXEnd - localXStart;
+	uint32_t ysize = localYEnd - localYStart;
+	uint32_t bitmapSize = (uint64_t) xsize * ysize / M_BIT_SIZE + 1;
+
+	connection_t * conn = getConnection (connSock);
+	frame_buffer_t * encoded = encodedFrame (conn);
+	uint32_t start = encoded->length;
+	wireworld_message_t * buf = reserveMessages (conn, bitmapSize + 3);
+	wireworld_message_t * heads = &buf[3];
+	buf[0] = A_HEADS_UPDATE;
+	buf[1] = H_LIST;
+
+	// List of heads, unless it becomes larger than a bitmap
+	uint32_t nbHeads = 0;
+	uint32_t x, y;
+	for (y = 0; y < ysize && buf[1] == H_LIST; ++y) {
+		const char * line = cmap (charMap, localXStart, localYStart + y, width);
+		for (x = 0; x < xsize; ++x) {
+			if (line[x] != C_HEAD)
+				continue;
+			if (nbHeads == bitmapSize) {
+				buf[1] = H_BITMAP;
+				break;
+			}
+			heads[nbHeads++] = x + y * xsize;
+		}
+	}
+
+	// Too many heads, restart with a bitmap
+	if (buf[1] == H_BITMAP) {
+		memset (heads, 0, bitmapSize * sizeof (wireworld_message_t));
+		for (y = 0; y < ysize; ++y) {
+			const char * line = cmap (charMap, localXStart, localYStart + y, width);
+			for (x = 0; x < xsize; ++x) {
+				uint32_t index = x + y * xsize;
+				if (line[x] == C_HEAD)
+					heads[index / M_BIT_SIZE] |= 1u << (index % M_BIT_SIZE);
+			}
+		}
+		nbHeads = bitmapSize;
+	}
+	buf[2] = nbHeads;
+
+	encoded->length = start + 3 + nbHeads;
+	convertMessages (conn, buf, 3 + nbHeads);
+	return 0;
 }
 
 int connectionSendFrameEnd (int connSock) {
 	assert (connSock != -1);
-	wireworld_message_t message = A_FRAME_END;
-	int res = sendMessages (connSock, &message, 1);
+	connection_t * conn = getConnection (connSock);
+	wireworld_message_t * message = reserveMessages (conn, 1);
+	*message = A_FRAME_END;
+	convertMessages (conn, message, 1);
+	queueFrame (conn, 1);
+
+	// Send the whole frame
+	int res = flushMessages (connSock, conn);
+	if (res == 2)
+		return 2; // Still being sent
 	if (res == -1) {
-		fprintf (stderr, "Error while sending A_FRAME_END\n");
+		fprintf (stderr, "Error while sending frame\n");
 		return -1;
 	} else if (res == 1) {
 		return 1; // End of connection
@@ -207,93 +580,455 @@ int connectionSendFrameEnd (int connSock) {
 	}
 }
 
-/* Static functions */
+int connectionSetNonBlocking (int connSock) {
+	int flags = fcntl (connSock, F_GETFL);
+	if (flags == -1 || fcntl (connSock, F_SETFL, flags | O_NONBLOCK) == -1) {
+		perror ("fcntl");
+		return -1;
+	}
+	return 0;
+}
+
+int connectionQueueFrameEnd (int connSock) {
+	assert (connSock != -1);
+	connection_t * conn = getConnection (connSock);
+	wireworld_message_t * message = reserveMessages (conn, 1);
+	*message = A_FRAME_END;
+	convertMessages (conn, message, 1);
+	queueFrame (conn, 0);
+	return 0;
+}
 
-static int recvMessages (int sock, wireworld_message_t * buffer, uint32_t count) {
-	uint32_t bytes_to_read = count * sizeof (wireworld_message_t);
-	wireworld_message_t * tmp_buf = malloc (bytes_to_read);
-	assert (tmp_buf != NULL);
+uint32_t connectionQueuedFrames (int connSock) {
+	connection_t * conn = getConnection (connSock);
+	pthread_mutex_lock (&conn->lock);
+	uint32_t queued = conn->queued;
+	pthread_mutex_unlock (&conn->lock);
+	return queued;
+}
 
-	// Read raw data
-	char * it = (char *) tmp_buf;
-	while (bytes_to_read > 0) {
-		int res = read (sock, it, bytes_to_read);
-		if (res == 0) {
-			free (tmp_buf);
-			return 1; // End of file
-		} else if (res == -1) {
+int connectionSendQueuedFrame (int connSock) {
+	connection_t * conn = getConnection (connSock);
+	pthread_mutex_lock (&conn->lock);
+	assert (conn->released < conn->queued);
+	conn->released++;
+	pthread_mutex_unlock (&conn->lock);
+	return connectionFlush (connSock);
+}
+
+uint32_t connectionDropQueuedFrames (int connSock) {
+	connection_t * conn = getConnection (connSock);
+	pthread_mutex_lock (&conn->lock);
+	uint32_t dropped = conn->queued - conn->released, f;
+	for (f = conn->released; f < conn->queued; ++f)
+		conn->frames[(conn->first + f) % CONNECTION_FRAMES].length = 0;
+	conn->queued = conn->released;
+	pthread_mutex_unlock (&conn->lock);
+	return dropped;
+}
+
+int connectionFlush (int connSock) {
+	connection_t * conn = getConnection (connSock);
+	if (conn->ringActive) {
+		uint64_t count;
+		if (read (conn->wakeFd, &count, sizeof (count)) == -1 && errno != EAGAIN)
 			perror ("read");
-			free (tmp_buf);
-			return -1;
-		}	
-		it += res;
-		bytes_to_read -= res;
 	}
+	int res = flushMessages (connSock, conn);
+	if (res == -1)
+		fprintf (stderr, "Error while sending frame\n");
+	return res;
+}
 
-	// Convert endianness
-	uint32_t i;
-	for (i = 0; i < count; ++i)
-		buffer[i] = ntohl (tmp_buf[i]);
+int connectionWakeFd (int connSock) {
+	connection_t * conn = getConnection (connSock);
+	return conn->ringActive ? conn->wakeFd : -1;
+}
 
-	free (tmp_buf);
+void connectionRelease (int connSock) {
+	pthread_mutex_lock (&connectionsLock);
+	if (connSock >= 0 && connSock < nbConnections && connections[connSock] != NULL) {
+		connection_t * conn = connections[connSock];
+		if (conn->ring.base != NULL) {
+			shmRingUnmap (&conn->ring);
+			if (conn->ringFd != -1)
+				close (conn->ringFd);
+			close (conn->notifyFd);
+			close (conn->wakeFd);
+		}
+		int f;
+		for (f = 0; f < CONNECTION_FRAMES; ++f)
+			free (conn->frames[f].messages);
+		free (conn->lodRow);
+		free (conn->input);
+		free (conn->initMap);
+		pthread_mutex_destroy (&conn->lock);
+		free (conn);
+		connections[connSock] = NULL;
+	}
+	pthread_mutex_unlock (&connectionsLock);
+}
+
+/* Static functions */
+
+static connection_t * getConnection (int sock) {
+	assert (sock >= 0);
+	pthread_mutex_lock (&connectionsLock);
+	if (sock >= nbConnections) {
+		int n = sock + 16;
+		connections = realloc (connections, n * sizeof (connection_t *));
+		assert (connections != NULL);
+		memset (&connections[nbConnections], 0, (n - nbConnections) * sizeof (connection_t *));
+		nbConnections = n;
+	}
+	if (connections[sock] == NULL) {
+		connections[sock] = calloc (1, sizeof (connection_t));
+		assert (connections[sock] != NULL);
+		pthread_mutex_init (&connections[sock]->lock, NULL);
+	}
+	connection_t * conn = connections[sock];
+	pthread_mutex_unlock (&connectionsLock);
+	return conn;
+}
+
+/* Frame buffer being encoded */
+static frame_buffer_t * encodedFrame (connection_t * conn) {
+	pthread_mutex_lock (&conn->lock);
+	frame_buffer_t * frame = &conn->frames[(conn->first + conn->queued) % CONNECTION_FRAMES];
+	pthread_mutex_unlock (&conn->lock);
+	return frame;
+}
 
+/* Appends count messages to the frame being encoded, and returns them.
+ * The pointer is valid until the next call.
+ */
+static wireworld_message_t * reserveMessages (connection_t * conn, uint32_t count) {
+	frame_buffer_t * frame = encodedFrame (conn);
+	if (frame->length + count > frame->capacity) {
+		frame->capacity = frame->capacity * 2 > frame->length + count ?
+			frame->capacity * 2 : frame->length + count;
+		frame->messages = realloc (frame->messages, frame->capacity * sizeof (wireworld_message_t));
+		assert (frame->messages != NULL);
+	}
+	wireworld_message_t * messages = &frame->messages[frame->length];
+	frame->length += count;
+	return messages;
+}
+
+/* Ends the frame being encoded, allowing to send it or not */
+static void queueFrame (connection_t * conn, int release) {
+	pthread_mutex_lock (&conn->lock);
+	assert (conn->queued < CONNECTION_FRAMES - 1);
+	conn->queued++;
+	if (release)
+		conn->released = conn->queued;
+	pthread_mutex_unlock (&conn->lock);
+}
+
+/* Reads a R_INIT_FILE message, whose 4 first messages are received.
+ * Returns -1 on error, 0 on success, 1 on connection closed, 2 if not received yet.
+ */
+static int waitForInitFile (int connSock, connection_t * conn,
+		uint32_t * sampling, uint32_t * features, uint32_t * name, char ** mapPath) {
+	wireworld_message_t * raw;
+	uint32_t headerSize = 4;
+	int res = peekMessages (connSock, conn, headerSize, &raw);
+	if (res != 0)
+		return res;
+	uint32_t requested = ntohl (raw[2]);
+	if (requested & F_SHARED_SESSION) {
+		headerSize = 5;
+		res = peekMessages (connSock, conn, headerSize, &raw);
+		if (res != 0)
+			return res;
+	}
+
+	// Path
+	uint32_t length = ntohl (raw[headerSize - 1]);
+	if (length == 0 || length > PATH_MAX) {
+		fprintf (stderr, "Invalid map file path length : %u\n", length);
+		return -1;
+	}
+	res = peekMessages (connSock, conn, headerSize + length / 4 + 1, &raw);
+	if (res != 0)
+		return res;
+
+	*sampling = ntohl (raw[1]);
+	*features = (*features | F_LITTLE_ENDIAN | localFeatures (connSock)) & requested;
+	if (*sampling != 1)
+		*features &= ~F_HEADS_ONLY;
+	if (*features & F_SHARED_SESSION)
+		*name = ntohl (raw[4]);
+	*mapPath = malloc (length + 1);
+	assert (*mapPath != NULL);
+	memcpy (*mapPath, &raw[headerSize], length);
+	(*mapPath)[length] = '\0';
+	consumeMessages (conn, headerSize + length / 4 + 1);
 	return 0;
 }
 
-static int sendMessages (int sock, wireworld_message_t * buffer, uint32_t count) {
-	uint32_t bytes_to_send = count * sizeof (wireworld_message_t);
-	wireworld_message_t * tmp_buf = malloc (bytes_to_send);
-	assert (tmp_buf != NULL);
+/* Sends an acknowledgement (in big endian, the following answers may not be), and switches to
+ * the byte order of the accepted features. On non blocking sockets, the end of it may be sent
+ * with the next frame.
+ */
+static int sendInitAck (int connSock, connection_t * conn,
+		wireworld_message_t * ack, uint32_t size, uint32_t features) {
+	convertMessages (conn, ack, size);
+	queueFrame (conn, 1);
+	int res = flushMessages (connSock, conn);
+	conn->littleEndian = (features & F_LITTLE_ENDIAN) != 0;
+	conn->features = features;
+	return res;
+}
 
-	// Convert endianness
+/* Converts in place to the wire byte order (nothing to do for little endian on x86) */
+static void convertMessages (connection_t * conn, wireworld_message_t * buffer, uint32_t count) {
 	uint32_t i;
-	for (i = 0; i < count; ++i)
-		tmp_buf[i] = htonl (buffer[i]);
-
-	// Send raw data
-	char * it = (char *) tmp_buf;
-	while (bytes_to_send > 0) {
-		int res = send (sock, it, bytes_to_send, MSG_NOSIGNAL);
-		if (res == -1) {
-			if (errno == EPIPE || errno == ECONNRESET) {
-				// On end of connection
-				return 1;
-			} else {
-				// Real error
+	if (conn->littleEndian) {
+		for (i = 0; i < count; ++i)
+			buffer[i] = htole32 (buffer[i]);
+	} else {
+		for (i = 0; i < count; ++i)
+			buffer[i] = htonl (buffer[i]);
+	}
+}
+
+/* Sends the released frames.
+ * Returns -1 on error, 0 on success, 1 on connection closed, 2 if the socket would block (the
+ * rest is sent by the next call).
+ */
+static int flushMessages (int sock, connection_t * conn) {
+	while (1) {
+		pthread_mutex_lock (&conn->lock);
+		frame_buffer_t * frame = conn->released > 0 ? &conn->frames[conn->first] : NULL;
+		pthread_mutex_unlock (&conn->lock);
+		if (frame == NULL)
+			return 0;
+
+		size_t total = frame->length * sizeof (wireworld_message_t);
+		if (conn->ringActive) {
+			// Written in place for the gui, which is told there is something to read
+			conn->sent += shmRingWrite (&conn->ring, (char *) frame->messages + conn->sent,
+					total - conn->sent);
+			uint64_t one = 1;
+			if (write (conn->notifyFd, &one, sizeof (one)) == -1 && errno != EAGAIN) {
 				perror ("write");
-				free (tmp_buf);
 				return -1;
 			}
-		}	
-		it += res;
-		bytes_to_send -= res;
+			if (conn->sent < total)
+				return 2;
+		}
+		while (conn->sent < total) {
+			ssize_t res = sendWithRing (sock, conn, (char *) frame->messages + conn->sent,
+					total - conn->sent);
+			if (res == -1) {
+				if (errno == EINTR) {
+					continue;
+				} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					return 2;
+				} else if (errno == EPIPE || errno == ECONNRESET) {
+					// On end of connection
+					return 1;
+				} else {
+					// Real error
+					perror ("write");
+					return -1;
+				}
+			}
+			conn->sent += res;
+		}
+
+		// The ring is used from the frame after the one which passed it
+		if (conn->ring.base != NULL && conn->ringFd == -1)
+			conn->ringActive = 1;
+
+		// Frame sent
+		pthread_mutex_lock (&conn->lock);
+		frame->length = 0;
+		conn->sent = 0;
+		conn->first = (conn->first + 1) % CONNECTION_FRAMES;
+		conn->queued--;
+		conn->released--;
+		pthread_mutex_unlock (&conn->lock);
 	}
-	free (tmp_buf);
+}
+
+/* Features of the transport of a socket : F_SHARED_MEMORY on local sockets */
+static uint32_t localFeatures (int sock) {
+	struct sockaddr_storage addr;
+	socklen_t length = sizeof (addr);
+	if (getsockname (sock, (struct sockaddr *) &addr, &length) == 0 && addr.ss_family == AF_UNIX)
+		return F_SHARED_MEMORY;
 	return 0;
 }
 
-static void networkToCharMap (wireworld_message_t * networkMap, char * charMap,
+/* Creates the shared memory ring if F_SHARED_MEMORY was accepted, large enough for two
+ * rectangle updates of the whole map. Returns the features, without F_SHARED_MEMORY if the
+ * ring could not be created.
+ */
+static uint32_t setupSharedMemory (connection_t * conn, uint32_t features,
 		uint32_t width, uint32_t height) {
-	// Bit packed structure iterators
-	uint32_t messageIndex = 0;
-	int bitIndex = 0;
+	if (!(features & F_SHARED_MEMORY))
+		return features;
 
-	// Iterate on coordinates and unpack data
-	uint32_t i, j;
-	for (j = 0; j < height; ++j) {
-		for (i = 0; i < width; ++i) {
-			// Set value
-			*cmap (charMap, i, j, width) = C_BIT_MASK & 
-				(networkMap[messageIndex] >> (C_BIT_SIZE * bitIndex));
-
-			// Update counters
-			bitIndex++;
-			if (bitIndex == M_BIT_SIZE / C_BIT_SIZE) {
-				messageIndex++;
-				bitIndex = 0;
+	uint64_t frameBytes = ((uint64_t) width * height * C_BIT_SIZE / M_BIT_SIZE + 16) *
+		sizeof (wireworld_message_t);
+	conn->ringFd = shmRingCreate (&conn->ring, 2 * frameBytes);
+	if (conn->ringFd == -1) {
+		perror ("shared memory ring");
+		return features & ~F_SHARED_MEMORY;
+	}
+	conn->notifyFd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	conn->wakeFd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (conn->notifyFd == -1 || conn->wakeFd == -1) {
+		perror ("eventfd");
+		if (conn->notifyFd != -1)
+			close (conn->notifyFd);
+		if (conn->wakeFd != -1)
+			close (conn->wakeFd);
+		close (conn->ringFd);
+		shmRingUnmap (&conn->ring);
+		return features & ~F_SHARED_MEMORY;
+	}
+	return features;
+}
+
+/* Sends on the socket, passing the file descriptors of the ring with the first bytes after it
+ * is created (the A_INIT_ACK message). Same return value as send.
+ */
+static ssize_t sendWithRing (int sock, connection_t * conn, const char * data, size_t size) {
+	if (conn->ring.base == NULL || conn->ringFd == -1)
+		return send (sock, data, size, MSG_NOSIGNAL);
+
+	int fds[3] = { conn->ringFd, conn->notifyFd, conn->wakeFd };
+	char control[CMSG_SPACE (sizeof (fds))];
+	struct iovec iov = { (void *) data, size };
+	struct msghdr msg;
+	memset (&msg, 0, sizeof (msg));
+	memset (control, 0, sizeof (control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof (control);
+	struct cmsghdr * cmsg = CMSG_FIRSTHDR (&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN (sizeof (fds));
+	memcpy (CMSG_DATA (cmsg), fds, sizeof (fds));
+
+	ssize_t res = sendmsg (sock, &msg, MSG_NOSIGNAL);
+	if (res >= 0) {
+		// The gui has its own descriptor, and the mapping stays
+		close (conn->ringFd);
+		conn->ringFd = -1;
+	}
+	return res;
+}
+
+/* Makes count received messages available (reading the socket if needed), and sets *messages
+ * to them. They are valid until the next call, and stay there until consumed.
+ * Returns -1 on error, 0 on success, 1 on connection closed, 2 if the socket would block.
+ */
+static int peekMessages (int sock, connection_t * conn, uint32_t count,
+		wireworld_message_t ** messages) {
+	size_t bytes = count * sizeof (wireworld_message_t);
+
+	while (conn->inputLength < bytes) {
+		// Move received data to the start, and make room for the whole request
+		if (conn->inputStart > 0) {
+			memmove (conn->input, &conn->input[conn->inputStart], conn->inputLength);
+			conn->inputStart = 0;
+		}
+		if (conn->inputCapacity < bytes) {
+			conn->inputCapacity = bytes > 4096 ? bytes : 4096;
+			conn->input = realloc (conn->input, conn->inputCapacity);
+			assert (conn->input != NULL);
+		}
+
+		ssize_t res = read (sock, &conn->input[conn->inputLength],
+				conn->inputCapacity - conn->inputLength);
+		if (res == 0) {
+			return 1; // End of file
+		} else if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 2;
+			perror ("read");
+			return -1;
+		}
+		conn->inputLength += res;
+	}
+
+	*messages = (wireworld_message_t *) &conn->input[conn->inputStart];
+	return 0;
+}
+
+static void consumeMessages (connection_t * conn, uint32_t count) {
+	conn->inputStart += count * sizeof (wireworld_message_t);
+	conn->inputLength -= count * sizeof (wireworld_message_t);
+	if (conn->inputLength == 0)
+		conn->inputStart = 0;
+}
+
+/* Returns NULL if the map cannot be allocated */
+static char * allocBorderedMap (uint32_t width, uint32_t height) {
+	size_t stride = (size_t) width + 2;
+	char * map = malloc (stride * ((size_t) height + 2) * sizeof (char));
+	if (map == NULL)
+		return NULL;
+
+	uint32_t y;
+	memset (map, C_INSULATOR, stride * sizeof (char));
+	memset (&map[stride * (height + 1)], C_INSULATOR, stride * sizeof (char));
+	for (y = 1; y <= height; ++y) {
+		map[stride * y] = C_INSULATOR;
+		map[stride * y + width + 1] = C_INSULATOR;
+	}
+	return map;
+}
+
+/* Decodes the received messages of the init frame, into the bordered map, by chunks of at
+ * most INIT_CHUNK messages : so the input buffer stays small, whatever the map size.
+ * Returns -1 on error, 0 once the frame is decoded, 1 on connection closed, 2 if the socket
+ * would block.
+ */
+static int receiveInitFrame (int sock, connection_t * conn) {
+	uint32_t width = conn->initWidth, height = conn->initHeight;
+	uint64_t size = (uint64_t) width * height * C_BIT_SIZE / M_BIT_SIZE + 1;
+
+	while (conn->initDecoded < size) {
+		uint32_t i, count = size - conn->initDecoded < INIT_CHUNK ?
+			size - conn->initDecoded : INIT_CHUNK;
+		wireworld_message_t * raw;
+		int res = peekMessages (sock, conn, count, &raw);
+		if (res != 0)
+			return res;
+		for (i = 0; i < count; ++i)
+			raw[i] = ntohl (raw[i]);
+
+		// Unpack the cells of the chunk, row by row (the last message may be padding)
+		uint64_t first = conn->initDecoded * (M_BIT_SIZE / C_BIT_SIZE), cell = first;
+		uint64_t end = (conn->initDecoded + count) * (M_BIT_SIZE / C_BIT_SIZE);
+		if (end > (uint64_t) width * height)
+			end = (uint64_t) width * height;
+		uint32_t x = conn->initX, y = conn->initY;
+		while (cell < end) {
+			uint32_t n = end - cell < width - x ? end - cell : width - x;
+			cellUnpack (raw, cell - first, cmap (conn->initMap, x + 1, y + 1, width + 2), n);
+			cell += n;
+			x += n;
+			if (x == width) {
+				x = 0;
+				y++;
 			}
 		}
+		conn->initX = x;
+		conn->initY = y;
+		conn->initDecoded += count;
+		consumeMessages (conn, count);
 	}
+	return 0;
 }
 
 void charToNetworkMap (wireworld_message_t * networkMap, char * charMap,
@@ -301,27 +1036,10 @@ void charToNetworkMap (wireworld_message_t * networkMap, char * charMap,
 		uint32_t xs, uint32_t ys, uint32_t xe, uint32_t ye) {
 	(void) height;
 
-	// iterators
-	uint32_t messageIndex = 0;
-	int bitIndex = 0;
-	uint32_t i, j;
-
-	networkMap[0] = 0;
-	for (j = ys; j < ye; ++j) {
-		for (i = xs; i < xe ; ++i) {
-			// Set value
-			networkMap[messageIndex] |=
-				*cmap (charMap, i, j, width) <<
-				(C_BIT_SIZE * bitIndex);
-
-			// Update counters, and init next word
-			bitIndex++;
-			if (bitIndex == M_BIT_SIZE / C_BIT_SIZE) {
-				messageIndex++;
-				networkMap[messageIndex] = 0;
-				bitIndex = 0;
-			}
-		}
-	}
+	// Row by row, the last word may have no cell
+	uint32_t j;
+	networkMap[wireworldFrameMessageSize (xe - xs, ye - ys) - 1] = 0;
+	for (j = ys; j < ye; ++j)
+		cellPack (networkMap, (uint64_t) (j - ys) * (xe - xs), cmap (charMap, xs, j, width), xe - xs);
 }
 
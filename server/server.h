@@ -5,17 +5,28 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <errno.h>
+#include <limits.h>
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 
 #include "../protocol/protocol.h"
+#include "../protocol/cellpack.h"
+#include "../protocol/shmring.h"
 
 /* Param */
-#define SERVER_BACKLOG 5
+#define SERVER_BACKLOG SOMAXCONN
+#define CONNECTION_FRAMES 8 // frame buffers per connection (see connectionQueueFrameEnd)
+#define INIT_CHUNK 4096 // messages of the init frame received and decoded at once
+#define INIT_MAX_CELLS (1ull << 30) // cells of a map sent by a gui (larger ones are map files)
 
 /* Functions - server */
 
@@ -24,6 +35,12 @@
  */
 int serverInit (int port);
 
+/* Also listens on the local socket of the port (LOCAL_SOCKET_PATH), a Unix socket over which
+ * guis of the same host may use the shared memory transport (F_SHARED_MEMORY).
+ * Returns -1 on error (and print an error message), the server socket (>0) on success.
+ */
+int serverInitLocal (int port);
+
 /* Wait for a connection.
  * Returns : -1 on error (+error message), a new socket (>0) on success.
  */
@@ -31,15 +48,35 @@ int serverAccept (int serverSock);
 
 /* Functions - connection */
 
-/* After a connection is opened, call this function to get the initial frame,
- * and other settings (width, height, and sampling parameters).
- * Returns -1 on error, 0 on success.
- *
+/* After a connection is opened, call this function to get the initial frame, and other
+ * settings (width, height, and sampling parameters), from a R_INIT or R_INIT_EX message.
  * *firstFrame will contain a malloc-ed array after the call, which should be freed later.
- * Access to cell at coordinates (x, y) is done using *firstFrame[x + y * (*height)]
+ * The frame is decoded as it is received, straight into *firstFrame, which is a bordered map :
+ * the cell (x, y) is at (x + 1) + (y + 1) * (*width + 2), and the map is surrounded by a line of
+ * C_INSULATOR cells (the layout used by engines, see engine.h). So receiving it only needs the
+ * map itself, and a few kilobytes. Maps of more than INIT_MAX_CELLS cells are refused, and so
+ * are maps which cannot be allocated (only this connection fails).
+ * *features must contain the features supported by the caller (F_* flags), and is set to the
+ * features accepted for this connection (requested by the gui and supported).
+ * F_HEADS_ONLY is only accepted if sampling is 1, and F_LITTLE_ENDIAN is handled by the connection
+ * functions, so it is always accepted. So is F_SHARED_MEMORY on local sockets, if its ring can
+ * be created.
+ * If F_SHARED_SESSION is accepted, *name is set to the session name.
+ * For an extended init message, the A_INIT_ACK answer is sent before returning.
+ *
+ * If mapPath is not NULL, R_INIT_FILE messages are accepted too : then *mapPath is set to the
+ * requested path (malloc-ed), and *firstFrame to NULL. The sizes are not set, and the caller must
+ * answer with connectionSendInitAck once it has loaded the map.
+ * Returns -1 on error, 0 on success.
  */
-int connectionWaitForInit (int connSock,
-		uint32_t * width, uint32_t * height, uint32_t * sampling, char ** firstFrame);
+int connectionWaitForInitEx (int connSock,
+		uint32_t * width, uint32_t * height, uint32_t * sampling, uint32_t * features,
+		uint32_t * name, char ** firstFrame, char ** mapPath);
+
+/* Answers a R_INIT_FILE message, with the accepted features and the sizes of the map.
+ * Returns -1 on error, 0 on success, 1 on connection closed.
+ */
+int connectionSendInitAck (int connSock, uint32_t features, uint32_t width, uint32_t height);
 
 /* Call this function to send the new entire frame which was computed.
  * It will send the rectangle from point (localXStart, localYStart) included to point
@@ -56,12 +93,28 @@ int connectionSendFullUpdate (int connSock,
  */
 int connectionWaitFrameRequest (int connSock);
 
+/* Same as connectionWaitFrameRequest, also accepting R_FRAME_N and R_STREAM requests (which
+ * are only valid if F_FRAME_BATCH was accepted), and R_VIEWPORT requests if viewport is not NULL
+ * (only valid if F_VIEWPORT was accepted).
+ * *count is set to the number of requested frames (1 for R_FRAME, the window for R_STREAM, 0
+ * for R_VIEWPORT), *interval to the interval of a R_STREAM request, and viewport (5 words :
+ * x1, y1, x2, y2, level) to the rectangle and level of a R_VIEWPORT request (level is 0 if
+ * F_LEVEL_OF_DETAIL was not accepted). They are left unchanged by other requests.
+ * Returns -1 on error, 0 on success, and 1 on connection closed.
+ */
+int connectionWaitFrameRequestEx (int connSock, uint32_t * count, uint32_t * interval,
+		uint32_t * viewport);
+
 /* Functions - connection - advanced
  *
  * For people who want to only update parts of the image (and don't consume bandwidth for
  * constant cells). You can send a sequence of updates of rectangular regions of the global
  * buffer, from any temporary buffer which is a 2d-array of char. You must end the sequence
  * with a A_FRAME_END message, using connectionSendFrameEnd().
+ *
+ * Updates are encoded in a per connection buffer, reused from frame to frame, and the whole frame
+ * is sent by connectionSendFrameEnd() in a single system call. So errors and connection closing
+ * are only reported by connectionSendFrameEnd().
  */
 
 /* These function will send a rectangle update (not necessarily the entire frame), with
@@ -75,10 +128,104 @@ int connectionSendRectUpdate (int connSock,
 		uint32_t localXStart, uint32_t localYStart, uint32_t localXEnd, uint32_t localYEnd,
 		uint32_t realXStart, uint32_t realYStart);
 
+/* Sends a level of detail update (see A_LOD_UPDATE) of the blocks [x1, x2) * [y1, y2) of
+ * 2^level cells of a side, from 'borderedMap' (xsize * ysize cells with a border of one cell).
+ * The last block of a row or column may be clipped by the map, but not empty.
+ * Returns -1 on error, 0 on success, 1 on connection closed.
+ */
+int connectionSendLodUpdate (int connSock,
+		const char * borderedMap, uint32_t xsize, uint32_t ysize, uint32_t level,
+		uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2);
+
+/* Sends a delta update (requires the F_DELTA_UPDATE feature) : 'frame' and 'previousFrame'
+ * are the new and last sent frames, as arrays of 'size' wireworld_message_t in the R_INIT frame
+ * format (see charToNetworkMap).
+ * Returns -1 on error, 0 on success, 1 on connection closed.
+ */
+int connectionSendDeltaUpdate (int connSock,
+		const wireworld_message_t * frame, const wireworld_message_t * previousFrame,
+		uint32_t size);
+
+/* Sends the heads of the new frame (requires the F_HEADS_ONLY feature), from the rectangle
+ * of 'charMap' with the same semantics as connectionSendFullUpdate (it must cover the map).
+ * Returns -1 on error, 0 on success, 1 on connection closed.
+ */
+int connectionSendHeadsUpdate (int connSock,
+		char * charMap, uint32_t width, uint32_t height,
+		uint32_t localXStart, uint32_t localYStart, uint32_t localXEnd, uint32_t localYEnd);
+
+/* Packs the rectangle from (xs, ys) included to (xe, ye) excluded of 'charMap' (with width
+ * 'width' and height 'height') into 'networkMap', in the frame format.
+ * networkMap must have wireworldFrameMessageSize (xe - xs, ye - ys) elements.
+ */
+void charToNetworkMap (wireworld_message_t * networkMap, char * charMap,
+		uint32_t width, uint32_t height,
+		uint32_t xs, uint32_t ys, uint32_t xe, uint32_t ye);
+
 /* This function will mark the end of the sequence of modifications of this frame.
  * Returns -1 on error, 0 on success, 1 on connection closed.
  */
 int connectionSendFrameEnd (int connSock);
 
+/* Frees the buffers of a connection. Call it before closing the socket.
+ */
+void connectionRelease (int connSock);
+
+/* Functions - connection - non blocking
+ *
+ * For servers multiplexing connections. Once a connection socket is non blocking, the functions
+ * above never block : when they would, they return 2 instead, keeping what was received or
+ * encoded so far, and should be called again once the socket is readable (connectionWaitForInitEx,
+ * connectionWaitFrameRequest, connectionWaitFrameRequestEx), or connectionFlush once it is writable (connectionSendFrameEnd,
+ * connectionSendFullUpdate, connectionSendInitAck).
+ * A connection must only be used by one thread at a time (except when computing ahead, see below).
+ */
+
+/* Makes the connection socket non blocking.
+ * Returns -1 on error, 0 on success.
+ */
+int connectionSetNonBlocking (int connSock);
+
+/* Sends what is left of the last frame.
+ * Returns -1 on error, 0 on success, 1 on connection closed, 2 if not finished.
+ */
+int connectionFlush (int connSock);
+
+/* Once the answers of a connection go through a shared memory ring (F_SHARED_MEMORY), returns
+ * the file descriptor which becomes readable when the gui made room in it : connectionFlush
+ * must then be called instead of waiting for the socket to be writable. Returns -1 otherwise.
+ */
+int connectionWakeFd (int connSock);
+
+/* Functions - connection - computing ahead
+ *
+ * Frames can be computed before they are requested : connectionQueueFrameEnd ends the frame
+ * like connectionSendFrameEnd, but keeps it queued instead of sending it, so that the next one
+ * can be encoded meanwhile. Then connectionSendQueuedFrame starts sending the oldest one.
+ * Up to CONNECTION_FRAMES - 1 frames (queued, or being sent) can be kept ; the encoding thread
+ * must check there is room left with connectionQueuedFrames.
+ * This is the only case where two threads may use a connection at the same time : one encoding
+ * frames, and one sending them.
+ */
+
+/* Ends the frame being encoded, and keeps it queued.
+ * Returns 0.
+ */
+int connectionQueueFrameEnd (int connSock);
+
+/* Returns the number of queued frames, including the one being sent.
+ */
+uint32_t connectionQueuedFrames (int connSock);
+
+/* Starts sending the oldest queued frame (which must exist).
+ * Returns -1 on error, 0 on success, 1 on connection closed, 2 if not finished.
+ */
+int connectionSendQueuedFrame (int connSock);
+
+/* Drops the queued frames which are not being sent (computed ahead, but now outdated).
+ * Must not be called while a frame is encoded. Returns the number of dropped frames.
+ */
+uint32_t connectionDropQueuedFrames (int connSock);
+
 #endif
 
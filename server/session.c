@@ -0,0 +1,727 @@
+#include "session.h"
+#include "server.h"
+#include "dirty.h"
+#include "mapfile.h"
+#include "../protocol/cellpack.h"
+
+#define SHARED_HISTORY CONNECTION_FRAMES // frames kept for the sessions of a shared simulation
+
+/* A simulation, shared by the sessions of the same name (or owned by one session) */
+typedef struct simulation {
+	pthread_mutex_t lock; // sessions of different connections use it concurrently
+	engine_t * engine;
+	char * scratch; // bordered map for engines which need one to export, allocated when needed
+	uint32_t xsize, ysize;
+	uint32_t sampling;
+	uint64_t generation; // number of frames computed
+	char * latest; // exported map of the last generation, NULL until needed (see latest_map)
+	int failed; // the engine failed : the sessions end, and no other one attaches
+
+	// Checkpoints of simulations loaded from map files (generations count engine steps, from
+	// the map file)
+	map_checkpoint_t * checkpoint;
+	uint64_t baseGeneration, nextCheckpoint, checkpointInterval;
+
+	// Packed maps of the last generations from historyStart (shared simulations only, once a
+	// second session attached), so that sessions slightly behind do not skip frames, and the
+	// bordered map they are unpacked into
+	wireworld_message_t * history[SHARED_HISTORY];
+	uint64_t historyStart;
+	char * pastMap;
+
+	// Shared simulations registry : clients attach to a simulation by its name and by what it
+	// started from (the resolved path of its map file, which may have been resumed from a
+	// checkpoint, or else its packed first map), which the server checks itself
+	int shared;
+	uint32_t name;
+	char * path;
+	void * origin;
+	size_t originSize;
+	uint32_t nbSessions;
+	struct simulation * next;
+} simulation_t;
+
+struct session {
+	int sock;
+	simulation_t * sim;
+	uint32_t features;
+
+	// Generation of the last encoded frame, if synced with the simulation (an attached session
+	// starts from the frame of its gui, not from a generation)
+	uint64_t generation;
+	int synced;
+
+	// The last encoded frame : packed for delta updates, or tracked by dirty regions
+	// otherwise (heads only frames need neither). Dirty regions also track it while there is
+	// a viewport.
+	dirty_tracker_t * dirty;
+	wireworld_message_t * frames[2];
+
+	// Rectangle displayed by the gui (empty for the whole map), its level of detail, and
+	// whether the gui only has the frames of the previous ones
+	rect_t viewport;
+	uint32_t level;
+	int viewportChanged;
+};
+
+static simulation_t * simulations = NULL;
+static pthread_mutex_t simulationsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static simulation_t * attach_simulation (uint32_t xsize, uint32_t ysize, uint32_t sampling,
+		int shared, uint32_t name, const char * path, const char * borderedMap,
+		const session_settings_t * settings, int * created);
+static simulation_t * create_simulation (uint32_t xsize, uint32_t ysize, uint32_t sampling,
+		const char * borderedMap, const session_settings_t * settings);
+static simulation_t * find_simulation (uint32_t xsize, uint32_t ysize, uint32_t sampling,
+		uint32_t name, const char * path, const void * origin, size_t originSize);
+static void share_history (simulation_t * sim);
+static void detach_simulation (simulation_t * sim);
+static void destroy_simulation (simulation_t * sim);
+static int advance (simulation_t * sim);
+static char * latest_map (simulation_t * sim);
+static char * past_map (simulation_t * sim, const wireworld_message_t * frame);
+static int pack_latest (simulation_t * sim, wireworld_message_t * frame);
+static session_t * create_session (int sock,
+		uint32_t xsize, uint32_t ysize, uint32_t sampling, uint32_t features, uint32_t name,
+		const char * path, const char * borderedMap, char * baseline,
+		const session_settings_t * settings);
+static session_t * open_session (int sock, simulation_t * sim, int synced, uint32_t features,
+		char * baseline);
+static char * resolve_map_path (const char * directory, const char * path);
+
+static int encode_changes (session_t * s, char * borderedMap);
+static int encode_delta (session_t * s);
+static int encode_heads (session_t * s, char * borderedMap);
+static int encode_full (session_t * s, char * borderedMap);
+static int encode_viewport (session_t * s, char * borderedMap);
+static int send_region (session_t * s, char * borderedMap, const rect_t * r);
+static void resync (session_t * s, char * borderedMap);
+
+session_t * sessionCreate (int sock,
+		uint32_t xsize, uint32_t ysize, uint32_t sampling, uint32_t features, uint32_t name,
+		char * firstMap, const session_settings_t * settings) {
+	session_t * s = create_session (sock, xsize, ysize, sampling, features, name, NULL,
+			firstMap, firstMap, settings);
+	free (firstMap);
+	return s;
+}
+
+session_t * sessionCreateFromFile (int sock,
+		const char * path, uint32_t sampling, uint32_t features, uint32_t name,
+		const session_settings_t * settings, uint32_t * xsize, uint32_t * ysize) {
+	if (settings->mapDirectory == NULL) {
+		fprintf (stderr, "Map files are not allowed\n");
+		return NULL;
+	}
+	char * mapPath = resolve_map_path (settings->mapDirectory, path);
+	if (mapPath == NULL)
+		return NULL;
+
+	// A shared simulation of the map file is used as it is, without loading the map
+	session_t * s = NULL;
+	if (features & F_SHARED_SESSION) {
+		pthread_mutex_lock (&simulationsLock);
+		simulation_t * sim = find_simulation (0, 0, sampling, name, mapPath, NULL, 0);
+		pthread_mutex_unlock (&simulationsLock);
+		if (sim != NULL) {
+			share_history (sim);
+			*xsize = sim->xsize;
+			*ysize = sim->ysize;
+			char * empty = engineAllocMap (*xsize, *ysize);
+			memset (empty, C_INSULATOR, engineMapCells (*xsize, *ysize) * sizeof (char));
+			s = open_session (sock, sim, 0, features, empty);
+			free (empty);
+			free (mapPath);
+			return s;
+		}
+	}
+
+	size_t length = strlen (mapPath) + 12;
+	char * checkpointPath = malloc (length);
+	assert (checkpointPath != NULL);
+	snprintf (checkpointPath, length, "%s.checkpoint", mapPath);
+
+	// Resume from the last checkpoint if it was started from this map file, or start from the map
+	uint64_t generation = 0;
+	uint32_t source, checkpointSource;
+	char * map = NULL;
+	if (settings->checkpointInterval > 0 && mapFileSource (mapPath, &source) == 0) {
+		map = mapFileLoad (checkpointPath, xsize, ysize, &generation, &checkpointSource, 1);
+		if (map != NULL && checkpointSource != source) {
+			free (map);
+			map = NULL;
+		}
+	}
+	if (map == NULL)
+		map = mapFileLoad (mapPath, xsize, ysize, &generation, &source, 0);
+	if (map != NULL) {
+		char * empty = engineAllocMap (*xsize, *ysize);
+		memset (empty, C_INSULATOR, engineMapCells (*xsize, *ysize) * sizeof (char));
+		s = create_session (sock, *xsize, *ysize, sampling, features, name, mapPath, map, empty,
+				settings);
+		free (empty);
+		free (map);
+	}
+
+	if (s != NULL && s->synced && settings->checkpointInterval > 0) {
+		simulation_t * sim = s->sim;
+		pthread_mutex_lock (&sim->lock);
+		sim->checkpoint = mapCheckpointOpen (checkpointPath, *xsize, *ysize, source);
+		sim->baseGeneration = generation;
+		sim->checkpointInterval = settings->checkpointInterval;
+		sim->nextCheckpoint = generation - generation % sim->checkpointInterval +
+			sim->checkpointInterval;
+		pthread_mutex_unlock (&sim->lock);
+	}
+	if (s != NULL)
+		s->synced = 0; // The gui does not have the map yet
+	free (mapPath);
+	free (checkpointPath);
+	return s;
+}
+
+/* Returns the resolved path of a map file, which must be in the map directory once symbolic
+ * links are resolved (malloc-ed), NULL if it is not.
+ */
+static char * resolve_map_path (const char * directory, const char * path) {
+	size_t length = strlen (directory) + strlen (path) + 2;
+	char * joined = malloc (length);
+	assert (joined != NULL);
+	snprintf (joined, length, "%s/%s", directory, path);
+	char * resolved = realpath (joined, NULL);
+	char * resolvedDirectory = realpath (directory, NULL);
+	free (joined);
+	if (resolved == NULL || resolvedDirectory == NULL) {
+		perror (resolved == NULL ? path : directory);
+	} else {
+		size_t prefix = strlen (resolvedDirectory);
+		if (strncmp (resolved, resolvedDirectory, prefix) != 0 ||
+				(resolved[prefix] != '/' && resolvedDirectory[prefix - 1] != '/')) {
+			fprintf (stderr, "Invalid map file path : %s\n", path);
+			free (resolved);
+			resolved = NULL;
+		}
+	}
+	free (resolvedDirectory);
+	return resolved;
+}
+
+/* Creates a session of the simulation of borderedMap (loaded from the map file at path, if not
+ * NULL), for a gui which has baseline.
+ * Returns NULL on error.
+ */
+static session_t * create_session (int sock,
+		uint32_t xsize, uint32_t ysize, uint32_t sampling, uint32_t features, uint32_t name,
+		const char * path, const char * borderedMap, char * baseline,
+		const session_settings_t * settings) {
+	int synced;
+	simulation_t * sim = attach_simulation (xsize, ysize, sampling,
+			(features & F_SHARED_SESSION) != 0, name, path, borderedMap, settings, &synced);
+	if (sim == NULL)
+		return NULL;
+	return open_session (sock, sim, synced, features, baseline);
+}
+
+/* Creates a session of an attached simulation, for a gui which has baseline */
+static session_t * open_session (int sock, simulation_t * sim, int synced, uint32_t features,
+		char * baseline) {
+	uint32_t xsize = sim->xsize, ysize = sim->ysize;
+	session_t * s = malloc (sizeof (session_t));
+	assert (s != NULL);
+	s->sock = sock;
+	s->features = features;
+	s->sim = sim;
+	s->synced = synced;
+	s->generation = 0; // only used once synced
+	memset (&s->viewport, 0, sizeof (rect_t));
+	s->level = 0;
+	s->viewportChanged = 0;
+
+	// Encoders start from the map of the gui
+	s->dirty = NULL;
+	s->frames[0] = NULL;
+	s->frames[1] = NULL;
+	if (s->features & F_HEADS_ONLY) {
+		s->features &= ~F_DELTA_UPDATE;
+	} else if (s->features & F_DELTA_UPDATE) {
+		uint32_t frameSize = wireworldFrameMessageSize (xsize, ysize);
+		s->frames[0] = malloc (frameSize * sizeof (wireworld_message_t));
+		s->frames[1] = malloc (frameSize * sizeof (wireworld_message_t));
+		assert (s->frames[0] != NULL && s->frames[1] != NULL);
+		charToNetworkMap (s->frames[0], baseline, xsize + 2, ysize + 2, 1, 1, xsize + 1, ysize + 1);
+	} else {
+		s->dirty = dirtyCreate (baseline, xsize, ysize);
+	}
+	return s;
+}
+
+int sessionNextFrame (session_t * s) {
+	simulation_t * sim = s->sim;
+	pthread_mutex_lock (&sim->lock);
+
+	// Advance the simulation, unless another session already did. Then the frame is taken from
+	// the history, or this session is too late and skips to the last generation.
+	uint64_t target = s->synced ? s->generation + 1 : sim->generation;
+	if (sim->failed || (target > sim->generation && advance (sim) != 0)) {
+		pthread_mutex_unlock (&sim->lock);
+		return -1;
+	} else if (sim->history[0] == NULL || target < sim->historyStart ||
+			sim->generation - target >= SHARED_HISTORY)
+		target = sim->generation;
+	int skipped = !s->synced || target != s->generation + 1;
+	s->generation = target;
+	s->synced = 1;
+
+	// Encode changes of the new map. The last generation is exported only if needed : delta
+	// updates take it packed straight from engines which store it in the frame format.
+	const wireworld_message_t * past = target == sim->generation ? NULL :
+		sim->history[target % SHARED_HISTORY];
+	char * current = NULL;
+	int res;
+	if (s->viewport.x1 < s->viewport.x2 || s->level > 0 || s->viewportChanged) {
+		current = past != NULL ? past_map (sim, past) : latest_map (sim);
+		res = current != NULL ? encode_viewport (s, current) : -1;
+	} else if (s->features & F_DELTA_UPDATE) {
+		res = 0;
+		if (past == NULL)
+			res = pack_latest (sim, s->frames[1]);
+		else
+			memcpy (s->frames[1], past, wireworldFrameMessageSize (sim->xsize, sim->ysize) *
+					sizeof (wireworld_message_t));
+		if (res == 0)
+			res = encode_delta (s);
+	} else {
+		current = past != NULL ? past_map (sim, past) : latest_map (sim);
+		if (current == NULL)
+			res = -1;
+		else if (s->features & F_HEADS_ONLY)
+			res = skipped ? encode_full (s, current) : encode_heads (s, current);
+		else
+			res = encode_changes (s, current);
+	}
+
+	pthread_mutex_unlock (&sim->lock);
+	return res;
+}
+
+void sessionSetViewport (session_t * s, const uint32_t * viewport) {
+	rect_t v;
+	v.x1 = viewport[0];
+	v.y1 = viewport[1];
+	v.x2 = viewport[2] < s->sim->xsize ? viewport[2] : s->sim->xsize;
+	v.y2 = viewport[3] < s->sim->ysize ? viewport[3] : s->sim->ysize;
+	if (v.x1 >= v.x2 || v.y1 >= v.y2)
+		memset (&v, 0, sizeof (rect_t)); // The whole map
+	uint32_t level = viewport[4] < LOD_MAX_LEVEL ? viewport[4] : LOD_MAX_LEVEL;
+
+	if (memcmp (&v, &s->viewport, sizeof (rect_t)) != 0 || level != s->level) {
+		s->viewport = v;
+		s->level = level;
+		s->viewportChanged = 1;
+	}
+}
+
+void sessionResync (session_t * s) {
+	s->viewportChanged = 1;
+}
+
+void sessionDestroy (session_t * s) {
+	if (s->dirty != NULL)
+		dirtyDestroy (s->dirty);
+	free (s->frames[0]);
+	free (s->frames[1]);
+	detach_simulation (s->sim);
+	free (s);
+}
+
+/* Returns the shared simulation matching the parameters, or a new one created from borderedMap
+ * (*created tells which). A simulation loaded from a map file matches by path, and otherwise by
+ * its first map.
+ * Returns NULL on error.
+ */
+static simulation_t * attach_simulation (uint32_t xsize, uint32_t ysize, uint32_t sampling,
+		int shared, uint32_t name, const char * path, const char * borderedMap,
+		const session_settings_t * settings, int * created) {
+	simulation_t * sim = NULL;
+
+	// What a shared simulation starts from, its first map being packed to keep it small
+	void * origin = NULL;
+	size_t originSize = 0;
+	if (shared) {
+		if (path == NULL) {
+			originSize = wireworldFrameMessageSize (xsize, ysize) * sizeof (wireworld_message_t);
+			origin = malloc (originSize);
+			assert (origin != NULL);
+			enginePackMap (borderedMap, xsize, ysize, origin);
+		}
+
+		pthread_mutex_lock (&simulationsLock);
+		sim = find_simulation (xsize, ysize, sampling, name, path, origin, originSize);
+		pthread_mutex_unlock (&simulationsLock);
+	}
+
+	// Create it without the registry locked, as engines may take long to set up : another
+	// connection may meanwhile have created the same one, which is then used instead
+	*created = 0;
+	if (sim == NULL) {
+		simulation_t * newSim = create_simulation (xsize, ysize, sampling, borderedMap, settings);
+		if (newSim == NULL) {
+			free (origin);
+			return NULL;
+		}
+		newSim->shared = shared;
+		newSim->name = name;
+		newSim->path = path != NULL ? strdup (path) : NULL;
+		newSim->origin = origin;
+		newSim->originSize = originSize;
+		if (!shared) {
+			*created = 1;
+			return newSim;
+		}
+
+		pthread_mutex_lock (&simulationsLock);
+		sim = find_simulation (xsize, ysize, sampling, name, path, origin, originSize);
+		if (sim == NULL) {
+			newSim->next = simulations;
+			simulations = newSim;
+			pthread_mutex_unlock (&simulationsLock);
+			*created = 1;
+			return newSim;
+		}
+		sim->nbSessions++;
+		pthread_mutex_unlock (&simulationsLock);
+		destroy_simulation (newSim);
+	} else {
+		free (origin);
+	}
+	share_history (sim);
+	return sim;
+}
+
+/* Creates a simulation of borderedMap, with one session.
+ * Returns NULL on error.
+ */
+static simulation_t * create_simulation (uint32_t xsize, uint32_t ysize, uint32_t sampling,
+		const char * borderedMap, const session_settings_t * settings) {
+	simulation_t * sim = malloc (sizeof (simulation_t));
+	assert (sim != NULL);
+	sim->xsize = xsize;
+	sim->ysize = ysize;
+	sim->sampling = sampling;
+	sim->generation = 0;
+	sim->scratch = NULL;
+	sim->latest = NULL;
+	sim->failed = 0;
+
+	sim->engine = engineCreate (settings->engine, borderedMap, xsize, ysize, &settings->params);
+	if (sim->engine == NULL) {
+		fprintf (stderr, "Unable to create the %s engine\n", settings->engine->name);
+		free (sim);
+		return NULL;
+	}
+	if (settings->cycleMemory > 0)
+		sim->engine = cycleEngineCreate (sim->engine, settings->cycleMemory);
+
+	uint32_t i;
+	for (i = 0; i < SHARED_HISTORY; ++i)
+		sim->history[i] = NULL;
+	sim->historyStart = 0;
+	sim->pastMap = NULL;
+
+	sim->checkpoint = NULL;
+	sim->baseGeneration = 0;
+	sim->nextCheckpoint = 0;
+	sim->checkpointInterval = 0;
+	pthread_mutex_init (&sim->lock, NULL);
+	sim->shared = 0;
+	sim->name = 0;
+	sim->path = NULL;
+	sim->origin = NULL;
+	sim->originSize = 0;
+	sim->nbSessions = 1;
+	sim->next = NULL;
+	return sim;
+}
+
+/* Returns the shared simulation matching the parameters with one more session, NULL if there is
+ * none (the registry must be locked). A map file path matches whatever the sizes, which are
+ * those of the file. Failed simulations are skipped.
+ */
+static simulation_t * find_simulation (uint32_t xsize, uint32_t ysize, uint32_t sampling,
+		uint32_t name, const char * path, const void * origin, size_t originSize) {
+	simulation_t * sim;
+	for (sim = simulations; sim != NULL; sim = sim->next) {
+		if (sim->name != name || sim->sampling != sampling)
+			continue;
+		if (path != NULL ? sim->path != NULL && strcmp (sim->path, path) == 0 :
+				sim->path == NULL && sim->xsize == xsize && sim->ysize == ysize &&
+				sim->originSize == originSize &&
+				memcmp (sim->origin, origin, originSize) == 0) {
+			pthread_mutex_lock (&sim->lock);
+			int failed = sim->failed;
+			pthread_mutex_unlock (&sim->lock);
+			if (failed)
+				continue;
+			sim->nbSessions++;
+			return sim;
+		}
+	}
+	return NULL;
+}
+
+/* Starts keeping the history of a simulation, once it has several sessions (it is then kept
+ * until the simulation is destroyed)
+ */
+static void share_history (simulation_t * sim) {
+	pthread_mutex_lock (&sim->lock);
+	if (sim->history[0] == NULL) {
+		size_t frameSize = wireworldFrameMessageSize (sim->xsize, sim->ysize) *
+			sizeof (wireworld_message_t);
+		uint32_t i;
+		for (i = 0; i < SHARED_HISTORY; ++i) {
+			sim->history[i] = malloc (frameSize);
+			assert (sim->history[i] != NULL);
+		}
+		sim->historyStart = sim->generation;
+		// A failed engine ends the sessions at their next frame
+		pack_latest (sim, sim->history[sim->generation % SHARED_HISTORY]);
+	}
+	pthread_mutex_unlock (&sim->lock);
+}
+
+/* Destroys the simulation with its last session */
+static void detach_simulation (simulation_t * sim) {
+	pthread_mutex_lock (&simulationsLock);
+	if (--sim->nbSessions > 0) {
+		pthread_mutex_unlock (&simulationsLock);
+		return;
+	}
+	if (sim->shared) {
+		simulation_t ** p = &simulations;
+		while (*p != sim)
+			p = &(*p)->next;
+		*p = sim->next;
+	}
+	pthread_mutex_unlock (&simulationsLock);
+
+	// Last checkpoint, unless the state was lost
+	if (sim->checkpoint != NULL) {
+		char * map = sim->failed ? NULL : latest_map (sim);
+		if (map != NULL)
+			mapCheckpointWrite (sim->checkpoint, map,
+					sim->baseGeneration + sim->generation * sim->sampling);
+		mapCheckpointClose (sim->checkpoint);
+	}
+	destroy_simulation (sim);
+}
+
+static void destroy_simulation (simulation_t * sim) {
+	uint32_t i;
+	for (i = 0; i < SHARED_HISTORY; ++i)
+		free (sim->history[i]);
+	engineDestroy (sim->engine);
+	pthread_mutex_destroy (&sim->lock);
+	free (sim->path);
+	free (sim->origin);
+	free (sim->pastMap);
+	free (sim->scratch);
+	free (sim);
+}
+
+/* Computes the next generation, keeps it in the history of shared simulations, and checkpoints
+ * it when it is time to.
+ * Returns 0 on success, -1 if the engine failed.
+ */
+static int advance (simulation_t * sim) {
+	if (engineStep (sim->engine, sim->sampling) != 0) {
+		sim->failed = 1;
+		return -1;
+	}
+	sim->generation++;
+	sim->latest = NULL;
+	if (sim->history[0] != NULL &&
+			pack_latest (sim, sim->history[sim->generation % SHARED_HISTORY]) != 0)
+		return -1;
+
+	uint64_t generation = sim->baseGeneration + sim->generation * sim->sampling;
+	if (sim->checkpoint != NULL && generation >= sim->nextCheckpoint) {
+		char * map = latest_map (sim);
+		if (map == NULL)
+			return -1;
+		mapCheckpointWrite (sim->checkpoint, map, generation);
+		sim->nextCheckpoint = generation - generation % sim->checkpointInterval +
+			sim->checkpointInterval;
+	}
+	return 0;
+}
+
+/* Exports the last generation, once per generation.
+ * Returns NULL if the engine failed.
+ */
+static char * latest_map (simulation_t * sim) {
+	if (sim->latest == NULL) {
+		if (sim->scratch == NULL)
+			sim->scratch = engineAllocMap (sim->xsize, sim->ysize);
+		sim->latest = engineExport (sim->engine, sim->scratch);
+		if (sim->latest == NULL)
+			sim->failed = 1;
+	}
+	return sim->latest;
+}
+
+/* Unpacks a generation of the history */
+static char * past_map (simulation_t * sim, const wireworld_message_t * frame) {
+	uint32_t y, xsize = sim->xsize, ysize = sim->ysize;
+	if (sim->pastMap == NULL)
+		sim->pastMap = engineAllocMap (xsize, ysize);
+	for (y = 0; y < ysize; ++y)
+		cellUnpack (frame, (uint64_t) y * xsize, &sim->pastMap[(size_t) (y + 1) * (xsize + 2) + 1],
+				xsize);
+	return sim->pastMap;
+}
+
+/* Packs the last generation in the frame format, from the engine if it can, or from its export.
+ * Returns 0 on success, -1 if the engine failed.
+ */
+static int pack_latest (simulation_t * sim, wireworld_message_t * frame) {
+	if (sim->latest == NULL && sim->engine->ops->pack != NULL) {
+		if (sim->engine->ops->pack (sim->engine, frame) != 0) {
+			sim->failed = 1;
+			return -1;
+		}
+		return 0;
+	}
+
+	char * map = latest_map (sim);
+	if (map == NULL)
+		return -1;
+	enginePackMap (map, sim->xsize, sim->ysize, frame);
+	return 0;
+}
+
+/* Encodes the rectangles which changed since the last frame, and the frame end.
+ */
+static int encode_changes (session_t * s, char * borderedMap) {
+	const rect_t * rects;
+	uint32_t i, nbRects = dirtyUpdate (s->dirty, borderedMap, &rects);
+	uint32_t xsize = s->sim->xsize, ysize = s->sim->ysize;
+	int res;
+
+	for (i = 0; i < nbRects; ++i) {
+		res = connectionSendRectUpdate (s->sock, borderedMap, xsize + 2, ysize + 2,
+				rects[i].x1 + 1, rects[i].y1 + 1, rects[i].x2 + 1, rects[i].y2 + 1,
+				rects[i].x1, rects[i].y1);
+		if (res != 0)
+			return res;
+	}
+	return connectionQueueFrameEnd (s->sock);
+}
+
+/* Encodes the xor of the new frame (packed in frames[1]) with the previous one (frames[0]), and
+ * the frame end. The new frame then replaces the previous one.
+ */
+static int encode_delta (session_t * s) {
+	uint32_t xsize = s->sim->xsize, ysize = s->sim->ysize;
+	int res = connectionSendDeltaUpdate (s->sock, s->frames[1], s->frames[0],
+			wireworldFrameMessageSize (xsize, ysize));
+
+	wireworld_message_t * tmp = s->frames[0];
+	s->frames[0] = s->frames[1];
+	s->frames[1] = tmp;
+
+	if (res != 0)
+		return res;
+	return connectionQueueFrameEnd (s->sock);
+}
+
+/* Encodes the heads of the new frame, and the frame end.
+ */
+static int encode_heads (session_t * s, char * borderedMap) {
+	uint32_t xsize = s->sim->xsize, ysize = s->sim->ysize;
+	int res = connectionSendHeadsUpdate (s->sock, borderedMap, xsize + 2, ysize + 2,
+			1, 1, xsize + 1, ysize + 1);
+	if (res != 0)
+		return res;
+	return connectionQueueFrameEnd (s->sock);
+}
+
+/* Encodes the changes of the new frame in the viewport, and the frame end. After a viewport
+ * change, the whole viewport is sent instead, or the whole map when going back to it.
+ */
+static int encode_viewport (session_t * s, char * borderedMap) {
+	rect_t v = s->viewport;
+	int res;
+
+	if (v.x1 == v.x2) {
+		// The whole map, at a level of detail
+		v.x2 = s->sim->xsize;
+		v.y2 = s->sim->ysize;
+	}
+
+	if (s->viewportChanged) {
+		s->viewportChanged = 0;
+		resync (s, borderedMap);
+		if (s->viewport.x1 == s->viewport.x2 && s->level == 0)
+			return encode_full (s, borderedMap);
+		res = send_region (s, borderedMap, &v);
+		if (res != 0)
+			return res;
+		return connectionQueueFrameEnd (s->sock);
+	}
+
+	// Changed rectangles, clipped to the viewport
+	const rect_t * rects;
+	uint32_t i, nbRects = dirtyUpdate (s->dirty, borderedMap, &rects);
+	for (i = 0; i < nbRects; ++i) {
+		rect_t r;
+		r.x1 = rects[i].x1 > v.x1 ? rects[i].x1 : v.x1;
+		r.y1 = rects[i].y1 > v.y1 ? rects[i].y1 : v.y1;
+		r.x2 = rects[i].x2 < v.x2 ? rects[i].x2 : v.x2;
+		r.y2 = rects[i].y2 < v.y2 ? rects[i].y2 : v.y2;
+		if (r.x1 >= r.x2 || r.y1 >= r.y2)
+			continue;
+		res = send_region (s, borderedMap, &r);
+		if (res != 0)
+			return res;
+	}
+	return connectionQueueFrameEnd (s->sock);
+}
+
+/* Sends the rectangle r of the map at the level of detail of the viewport : as a rectangle
+ * update, or as a level of detail update of the blocks it touches.
+ */
+static int send_region (session_t * s, char * borderedMap, const rect_t * r) {
+	uint32_t xsize = s->sim->xsize, ysize = s->sim->ysize, level = s->level;
+	if (level == 0)
+		return connectionSendRectUpdate (s->sock, borderedMap, xsize + 2, ysize + 2,
+				r->x1 + 1, r->y1 + 1, r->x2 + 1, r->y2 + 1, r->x1, r->y1);
+	return connectionSendLodUpdate (s->sock, borderedMap, xsize, ysize, level,
+			r->x1 >> level, r->y1 >> level, ((r->x2 - 1) >> level) + 1, ((r->y2 - 1) >> level) + 1);
+}
+
+/* Sets the last encoded frame of the encoders to borderedMap (which the gui is about to receive
+ * in a rectangle update).
+ */
+static void resync (session_t * s, char * borderedMap) {
+	uint32_t xsize = s->sim->xsize, ysize = s->sim->ysize;
+	if (s->dirty == NULL) {
+		s->dirty = dirtyCreate (borderedMap, xsize, ysize);
+	} else {
+		const rect_t * rects;
+		dirtyUpdate (s->dirty, borderedMap, &rects);
+	}
+	if (s->frames[0] != NULL)
+		charToNetworkMap (s->frames[0], borderedMap, xsize + 2, ysize + 2, 1, 1, xsize + 1, ysize + 1);
+}
+
+/* Encodes the whole new frame as a rectangle update, and the frame end (for heads only frames,
+ * when the previous frame is not the one the gui has).
+ */
+static int encode_full (session_t * s, char * borderedMap) {
+	uint32_t xsize = s->sim->xsize, ysize = s->sim->ysize;
+	int res = connectionSendRectUpdate (s->sock, borderedMap, xsize + 2, ysize + 2,
+			1, 1, xsize + 1, ysize + 1, 0, 0);
+	if (res != 0)
+		return res;
+	return connectionQueueFrameEnd (s->sock);
+}
@@ -0,0 +1,73 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "engine.h"
+#include "../protocol/protocol.h"
+
+/* Simulation sessions.
+ *
+ * A session is what is needed to encode the frames of one connection, in the format negotiated
+ * with the gui (see connectionWaitForInitEx), and the simulation they come from.
+ * Simulations are shared by the sessions created with the same name (F_SHARED_SESSION), so
+ * that their cost depends on the number of distinct circuits, not on the number of viewers.
+ */
+
+typedef struct session session_t;
+
+/* Server wide settings of new sessions */
+typedef struct {
+	const engine_ops_t * engine;
+	engine_params_t params;
+	size_t cycleMemory; // cycle detection memory, 0 to disable it
+	const char * mapDirectory; // directory of the map files (R_INIT_FILE), NULL to refuse them
+	uint64_t checkpointInterval; // generations between checkpoints of map files, 0 to disable
+} session_settings_t;
+
+/* Features supported by sessions, for connectionWaitForInitEx */
+#define SESSION_FEATURES (F_DELTA_UPDATE | F_HEADS_ONLY | F_SHARED_SESSION | F_VIEWPORT | \
+		F_LEVEL_OF_DETAIL)
+
+/* Creates a session from the init message data (firstMap is the bordered map received by
+ * connectionWaitForInitEx, and is freed).
+ * With F_SHARED_SESSION, it attaches to the simulation of the same name, sizes and sampling if
+ * there is one (firstMap is then only what the gui displays).
+ * Returns NULL on error.
+ */
+session_t * sessionCreate (int sock,
+		uint32_t xsize, uint32_t ysize, uint32_t sampling, uint32_t features, uint32_t name,
+		char * firstMap, const session_settings_t * settings);
+
+/* Creates a session from a map file of the map directory (see mapfile.h), or from its last
+ * checkpoint ("<path>.checkpoint") if checkpoints are enabled. The session then checkpoints the
+ * simulation if it created it. The path is relative to the map directory, and must stay in it
+ * once symbolic links are resolved. A shared session attaches to the simulation of the map file
+ * if there is one, without loading it.
+ * *xsize and *ysize are set to the map sizes. The gui starts from an empty map.
+ * Returns NULL on error.
+ */
+session_t * sessionCreateFromFile (int sock,
+		const char * path, uint32_t sampling, uint32_t features, uint32_t name,
+		const session_settings_t * settings, uint32_t * xsize, uint32_t * ysize);
+
+/* Queues the next frame on the connection (see connectionQueueFrameEnd), so that frames can be
+ * computed ahead of the requests.
+ * The simulation is advanced if this session has the latest frame. Otherwise, another session
+ * of the simulation went further, and this one skips to its latest frame.
+ * There must be room for it (connectionQueuedFrames () < CONNECTION_FRAMES - 1).
+ * Returns -1 on error, 0 on success.
+ */
+int sessionNextFrame (session_t * session);
+
+/* Sets the rectangle displayed by the gui and its level of detail (R_VIEWPORT : x1, y1, x2, y2,
+ * level), for the next frames.
+ */
+void sessionSetViewport (session_t * session, const uint32_t * viewport);
+
+/* The gui will not receive the frames encoded since its last one (they were dropped) : the
+ * next frame sends the whole viewport (or map) again.
+ */
+void sessionResync (session_t * session);
+
+void sessionDestroy (session_t * session);
+
+#endif
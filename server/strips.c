@@ -0,0 +1,428 @@
+#include "engine.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../protocol/protocol.h"
+
+/* Strips engine : the map is cut in horizontal strips, each simulated by its own process.
+ *
+ * Each worker process keeps its strip as a bordered map, whose top and bottom border rows are
+ * the ghost rows of its neighbour strips (or insulators at the map borders). After every
+ * generation, neighbours exchange their edge rows over a socket pair to update them.
+ * The engine itself only coordinates the workers through a control socket per worker, and
+ * merges their strips (or their hash and activity) when they are needed. So strips do not
+ * share memory, and each one lives on the node of its process.
+ *
+ * Workers are forked from the server : they only use system calls and their own memory, as
+ * the other threads of the server may hold locks at the time of the fork.
+ * If a worker dies, the engine fails (its next step or export returns an error), but the
+ * server and its other simulations go on.
+ */
+
+/* Requests on the control socket (host order words), and their answers */
+#define STRIP_STEP 0u // generations : 1 -> done : 1
+#define STRIP_EXPORT 1u // -> rows of the strip, borders included
+#define STRIP_ACTIVITY 2u // -> count : 2
+#define STRIP_HASH 3u // -> hash : 2
+
+typedef struct {
+	pid_t pid;
+	int control;
+	uint32_t y0, height; // rows [y0, y0 + height) of the map
+} strip_t;
+
+typedef struct {
+	engine_t base;
+	uint32_t nbStrips;
+	strip_t * strips;
+	int failed; // a worker is gone
+} strips_engine_t;
+
+/* State of a worker process */
+typedef struct {
+	int control, up, down; // up and down are -1 at the map borders
+	uint32_t xsize, y0, height;
+	char * maps[2]; // bordered strips
+	int dir;
+} strip_worker_t;
+
+/* Progress of the exchange of edge rows with a neighbour */
+typedef struct {
+	int fd;
+	const char * out;
+	char * in;
+	size_t sent, received;
+} halo_link_t;
+
+static int write_full (int fd, const void * buffer, size_t size);
+static int read_full (int fd, void * buffer, size_t size);
+static void worker_run (strip_worker_t * w);
+static void destroy_strips (strips_engine_t * e, uint32_t nbStarted);
+
+static engine_t * strips_create (const char * borderedMap, uint32_t xsize, uint32_t ysize,
+		const engine_params_t * params) {
+	strips_engine_t * e = malloc (sizeof (strips_engine_t));
+	assert (e != NULL);
+
+	e->failed = 0;
+	e->nbStrips = params->processes;
+	if (e->nbStrips == 0) {
+		long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+		e->nbStrips = cpus > 0 ? cpus : 1;
+	}
+	if (e->nbStrips > ysize)
+		e->nbStrips = ysize;
+	e->strips = malloc (e->nbStrips * sizeof (strip_t));
+	assert (e->strips != NULL);
+
+	// Socket pairs between neighbours : halos[k] links strip k (end 0) and strip k + 1 (end 1)
+	uint32_t k, n = e->nbStrips;
+	int (* halos)[2] = malloc (n * sizeof (halos[0]));
+	assert (halos != NULL);
+	for (k = 0; k + 1 < n; ++k) {
+		if (socketpair (AF_UNIX, SOCK_STREAM, 0, halos[k]) != 0) {
+			perror ("socketpair");
+			while (k-- > 0) {
+				close (halos[k][0]);
+				close (halos[k][1]);
+			}
+			free (halos);
+			free (e->strips);
+			free (e);
+			return NULL;
+		}
+	}
+
+	size_t stride = xsize + 2;
+	for (k = 0; k < n; ++k) {
+		strip_t * s = &e->strips[k];
+		s->y0 = (uint64_t) ysize * k / n;
+		s->height = (uint64_t) ysize * (k + 1) / n - s->y0;
+
+		int control[2];
+		if (socketpair (AF_UNIX, SOCK_STREAM, 0, control) != 0) {
+			perror ("socketpair");
+			break;
+		}
+
+		// Everything the worker needs is allocated before the fork. Its strip starts with
+		// the rows around it, which are the initial ghost rows.
+		strip_worker_t w;
+		size_t size = stride * (s->height + 2);
+		w.control = control[1];
+		w.up = k > 0 ? halos[k - 1][1] : -1;
+		w.down = k + 1 < n ? halos[k][0] : -1;
+		w.xsize = xsize;
+		w.y0 = s->y0;
+		w.height = s->height;
+		w.maps[0] = malloc (size);
+		w.maps[1] = malloc (size);
+		assert (w.maps[0] != NULL && w.maps[1] != NULL);
+		memcpy (w.maps[0], &borderedMap[stride * s->y0], size);
+		memcpy (w.maps[1], w.maps[0], size);
+		w.dir = 0;
+
+		s->pid = fork ();
+		if (s->pid == 0) {
+			// Only keep the sockets of the worker
+			int fd, max = sysconf (_SC_OPEN_MAX);
+			for (fd = 3; fd < max; ++fd)
+				if (fd != w.control && fd != w.up && fd != w.down)
+					close (fd);
+			worker_run (&w);
+			_exit (EXIT_SUCCESS);
+		}
+
+		free (w.maps[0]);
+		free (w.maps[1]);
+		close (control[1]);
+		if (s->pid == -1) {
+			perror ("fork");
+			close (control[0]);
+			break;
+		}
+		s->control = control[0];
+	}
+
+	uint32_t started = k;
+	for (k = 0; k + 1 < n; ++k) {
+		close (halos[k][0]);
+		close (halos[k][1]);
+	}
+	free (halos);
+
+	if (started < n) {
+		destroy_strips (e, started);
+		return NULL;
+	}
+	return &e->base;
+}
+
+/* Marks the engine as failed, as the worker k is gone. Returns -1. */
+static int fail (strips_engine_t * e, uint32_t k) {
+	fprintf (stderr, "Strip worker %u is gone\n", k);
+	e->failed = 1;
+	return -1;
+}
+
+/* Sends a request to every worker.
+ * Returns 0 on success, -1 if the engine failed.
+ */
+static int request (strips_engine_t * e, const uint32_t * message, size_t size) {
+	uint32_t k;
+	if (e->failed)
+		return -1;
+	for (k = 0; k < e->nbStrips; ++k)
+		if (write_full (e->strips[k].control, message, size * sizeof (uint32_t)) != 0)
+			return fail (e, k);
+	return 0;
+}
+
+/* Reads the answer of a worker.
+ * Returns 0 on success, -1 if the engine failed.
+ */
+static int answer (strips_engine_t * e, uint32_t k, void * buffer, size_t size) {
+	if (read_full (e->strips[k].control, buffer, size) != 0)
+		return fail (e, k);
+	return 0;
+}
+
+static int strips_step (engine_t * engine, uint32_t generations) {
+	strips_engine_t * e = (strips_engine_t *) engine;
+	uint32_t message[2] = { STRIP_STEP, generations }, done, k;
+	if (request (e, message, 2) != 0)
+		return -1;
+	for (k = 0; k < e->nbStrips; ++k)
+		if (answer (e, k, &done, sizeof (done)) != 0)
+			return -1;
+	return 0;
+}
+
+static char * strips_export (engine_t * engine, char * scratch) {
+	strips_engine_t * e = (strips_engine_t *) engine;
+	size_t stride = engine->xsize + 2;
+	uint32_t message = STRIP_EXPORT, k;
+	if (request (e, &message, 1) != 0)
+		return NULL;
+
+	// Strips are contiguous rows of the bordered map
+	for (k = 0; k < e->nbStrips; ++k) {
+		strip_t * s = &e->strips[k];
+		if (answer (e, k, &scratch[stride * (s->y0 + 1)], stride * s->height) != 0)
+			return NULL;
+	}
+	return scratch;
+}
+
+/* Sums a 64 bits answer of every worker (0 if the engine failed) */
+static uint64_t sum (strips_engine_t * e, uint32_t type) {
+	uint64_t total = 0, part;
+	uint32_t k;
+	if (request (e, &type, 1) != 0)
+		return 0;
+	for (k = 0; k < e->nbStrips; ++k) {
+		if (answer (e, k, &part, sizeof (part)) != 0)
+			return 0;
+		total += part;
+	}
+	return total;
+}
+
+static uint64_t strips_activity (engine_t * engine) {
+	return sum ((strips_engine_t *) engine, STRIP_ACTIVITY);
+}
+
+static uint64_t strips_hash (engine_t * engine) {
+	return sum ((strips_engine_t *) engine, STRIP_HASH);
+}
+
+static void strips_destroy (engine_t * engine) {
+	strips_engine_t * e = (strips_engine_t *) engine;
+	destroy_strips (e, e->nbStrips);
+}
+
+/* Workers stop when their control socket is closed */
+static void destroy_strips (strips_engine_t * e, uint32_t nbStarted) {
+	uint32_t k;
+	for (k = 0; k < nbStarted; ++k)
+		close (e->strips[k].control);
+	for (k = 0; k < nbStarted; ++k)
+		while (waitpid (e->strips[k].pid, NULL, 0) == -1 && errno == EINTR)
+			;
+	free (e->strips);
+	free (e);
+}
+
+const engine_ops_t stripsEngine = {
+	"strips", strips_create, strips_step, strips_export, NULL, strips_activity, strips_hash,
+	strips_destroy
+};
+
+/* Socket helpers, retrying on partial transfers and signals.
+ * Return 0 on success, -1 on error or closed connection.
+ */
+static int write_full (int fd, const void * buffer, size_t size) {
+	const char * data = buffer;
+	while (size > 0) {
+		ssize_t n = send (fd, data, size, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		data += n;
+		size -= n;
+	}
+	return 0;
+}
+
+static int read_full (int fd, void * buffer, size_t size) {
+	char * data = buffer;
+	while (size > 0) {
+		ssize_t n = recv (fd, data, size, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		data += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/* Worker side */
+
+/* Same rules as update_map, on the rows of a strip, in row order.
+ */
+static void update_strip (const char * fromMap, char * toMap, uint32_t xsize, uint32_t height) {
+	uint32_t stride = xsize + 2, i, j;
+	for (j = 1; j < height + 1; ++j) {
+		const char * up = &fromMap[(j - 1) * stride];
+		const char * mid = &fromMap[j * stride];
+		const char * down = &fromMap[(j + 1) * stride];
+		char * out = &toMap[j * stride];
+
+		for (i = 1; i < xsize + 1; ++i) {
+			char state = mid[i];
+			if (state == C_WIRE) {
+				int nbHeads =
+					(up[i - 1] == C_HEAD) + (up[i] == C_HEAD) + (up[i + 1] == C_HEAD) +
+					(mid[i - 1] == C_HEAD) + (mid[i + 1] == C_HEAD) +
+					(down[i - 1] == C_HEAD) + (down[i] == C_HEAD) + (down[i + 1] == C_HEAD);
+				out[i] = (nbHeads == 1 || nbHeads == 2) ? C_HEAD : C_WIRE;
+			} else if (state == C_HEAD) {
+				out[i] = C_TAIL;
+			} else if (state == C_TAIL) {
+				out[i] = C_WIRE;
+			}
+			// Insulators never change, and are already set in both buffers
+		}
+	}
+}
+
+/* Sends the edge rows of the strip to the neighbours, and receives theirs in the ghost rows.
+ * Both directions progress together, so that rows larger than the socket buffers can not
+ * block two neighbours sending to each other.
+ * Returns 0 on success, -1 if a neighbour is gone.
+ */
+static int exchange_halos (strip_worker_t * w, char * strip) {
+	size_t stride = w->xsize + 2, length = w->xsize;
+	halo_link_t links[2] = {
+		{ w->up, &strip[stride + 1], &strip[1], 0, 0 },
+		{ w->down, &strip[stride * w->height + 1], &strip[stride * (w->height + 1) + 1], 0, 0 }
+	};
+
+	for (;;) {
+		struct pollfd fds[2];
+		int i, nbFds = 0, map[2];
+		for (i = 0; i < 2; ++i) {
+			if (links[i].fd == -1)
+				continue;
+			short events = (links[i].sent < length ? POLLOUT : 0) |
+				(links[i].received < length ? POLLIN : 0);
+			if (events == 0)
+				continue;
+			fds[nbFds].fd = links[i].fd;
+			fds[nbFds].events = events;
+			map[nbFds++] = i;
+		}
+		if (nbFds == 0)
+			return 0;
+
+		if (poll (fds, nbFds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		for (i = 0; i < nbFds; ++i) {
+			halo_link_t * l = &links[map[i]];
+			ssize_t n;
+			if (fds[i].revents & (POLLIN | POLLHUP | POLLERR) && l->received < length) {
+				n = recv (l->fd, &l->in[l->received], length - l->received, MSG_DONTWAIT);
+				if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+					return -1;
+				if (n > 0)
+					l->received += n;
+			}
+			if (fds[i].revents & POLLOUT && l->sent < length) {
+				n = send (l->fd, &l->out[l->sent], length - l->sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+				if (n < 0 && errno != EAGAIN && errno != EINTR)
+					return -1;
+				if (n > 0)
+					l->sent += n;
+			}
+		}
+	}
+}
+
+static void worker_run (strip_worker_t * w) {
+	size_t stride = w->xsize + 2;
+	uint32_t message[2];
+
+	while (read_full (w->control, message, sizeof (uint32_t)) == 0) {
+		char * strip = w->maps[w->dir];
+		uint32_t i, j;
+		uint64_t result = 0;
+
+		switch (message[0]) {
+			case STRIP_STEP:
+				if (read_full (w->control, &message[1], sizeof (uint32_t)) != 0)
+					return;
+				for (i = 0; i < message[1]; ++i) {
+					update_strip (w->maps[w->dir], w->maps[1 - w->dir], w->xsize, w->height);
+					w->dir = 1 - w->dir;
+					if (exchange_halos (w, w->maps[w->dir]) != 0)
+						return;
+				}
+				if (write_full (w->control, &message[1], sizeof (uint32_t)) != 0)
+					return;
+				break;
+			case STRIP_EXPORT:
+				if (write_full (w->control, &strip[stride], stride * w->height) != 0)
+					return;
+				break;
+			case STRIP_ACTIVITY:
+			case STRIP_HASH:
+				// Cells are hashed with their index in the whole bordered map
+				for (j = 1; j < w->height + 1; ++j)
+					for (i = 1; i < w->xsize + 1; ++i) {
+						char state = strip[i + j * stride];
+						if (state != C_HEAD && state != C_TAIL)
+							continue;
+						result += message[0] == STRIP_ACTIVITY ? 1 :
+							engineCellHash (i + (w->y0 + j) * stride, state);
+					}
+				if (write_full (w->control, &result, sizeof (result)) != 0)
+					return;
+				break;
+			default:
+				return;
+		}
+	}
+}
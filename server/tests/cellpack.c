@@ -0,0 +1,99 @@
+/* The kernels are static : they are reached by including the implementation */
+#include "../../protocol/cellpack.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Checks cellPack and cellUnpack with every kernel the cpu runs, against a cell by cell
+ * conversion : runs of cells starting at every offset in a word, and ending anywhere, are
+ * packed into frames of random words (which must keep the cells before the run, clear the
+ * cells after it in its last word, and keep the following words), then unpacked back.
+ */
+
+static const kernels_t all[] = {
+	{ "scalar", pack_scalar, unpack_scalar },
+#ifdef CELLPACK_X86
+	{ "sse2", pack_sse2, unpack_sse2 },
+	{ "avx2", pack_avx2, unpack_avx2 },
+	{ "bmi2", pack_bmi2, unpack_bmi2 },
+#endif
+};
+#define NB_KERNELS (sizeof (all) / sizeof (all[0]))
+
+#define MAX_FIRST (3 * CELLS_PER_WORD)
+#define MAX_COUNT (40 * CELLS_PER_WORD + 5) // several vectors of the widest kernel
+#define FRAME_WORDS ((MAX_FIRST + MAX_COUNT) / CELLS_PER_WORD + 2)
+
+static int supported (const char * name) {
+#ifdef CELLPACK_X86
+	__builtin_cpu_init ();
+	if (strcmp (name, "avx2") == 0)
+		return __builtin_cpu_supports ("avx2");
+	if (strcmp (name, "bmi2") == 0)
+		return __builtin_cpu_supports ("bmi2");
+#else
+	(void) name;
+#endif
+	return 1;
+}
+
+/* Reference : cellPack, one cell at a time */
+static void reference_pack (wireworld_message_t * frame, uint64_t first, const char * cells,
+		size_t count) {
+	uint64_t end = first + count, i;
+	for (i = first; i < end; ++i) {
+		wireworld_message_t * word = &frame[i / CELLS_PER_WORD];
+		uint32_t shift = C_BIT_SIZE * (i % CELLS_PER_WORD);
+		*word = (*word & ~((wireworld_message_t) C_BIT_MASK << shift)) |
+			(wireworld_message_t) cells[i - first] << shift;
+	}
+	for (i = end; count > 0 && i % CELLS_PER_WORD != 0; ++i)
+		frame[i / CELLS_PER_WORD] &= ~((wireworld_message_t) C_BIT_MASK <<
+				(C_BIT_SIZE * (i % CELLS_PER_WORD)));
+}
+
+/* Returns the number of failed conversions */
+static uint32_t check_kernel (void) {
+	static char cells[MAX_COUNT], unpacked[MAX_COUNT];
+	static wireworld_message_t frame[FRAME_WORDS], expected[FRAME_WORDS];
+	uint32_t first, i, nbFailed = 0;
+	size_t count;
+
+	for (first = 0; first < MAX_FIRST; ++first)
+		for (count = 0; count <= MAX_COUNT; ++count) {
+			for (i = 0; i < count; ++i)
+				cells[i] = rand () & C_BIT_MASK;
+			for (i = 0; i < FRAME_WORDS; ++i)
+				frame[i] = expected[i] = (wireworld_message_t) rand () << 16 ^ rand ();
+
+			cellPack (frame, first, cells, count);
+			reference_pack (expected, first, cells, count);
+			memset (unpacked, 0xff, sizeof (unpacked));
+			cellUnpack (frame, first, unpacked, count);
+			if (memcmp (frame, expected, sizeof (frame)) != 0 ||
+					memcmp (unpacked, cells, count) != 0) {
+				if (nbFailed++ == 0)
+					fprintf (stderr, "%s : %zu cells from %u : wrong %s\n", kernels.name, count,
+							first, memcmp (frame, expected, sizeof (frame)) != 0 ? "frame" : "cells");
+			}
+		}
+	return nbFailed;
+}
+
+int main (void) {
+	uint32_t k, nbKernels = 0, nbFailed = 0;
+
+	srand (1);
+	for (k = 0; k < NB_KERNELS; ++k) {
+		if (!supported (all[k].name))
+			continue;
+#ifdef CELLPACK_X86
+		kernels = all[k];
+#endif
+		nbKernels++;
+		nbFailed += check_kernel ();
+	}
+
+	printf ("cellpack : %u kernels, %u failed conversions\n", nbKernels, nbFailed);
+	return nbFailed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,259 @@
+#include "../server.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../../protocol/protocol.h"
+
+/* Checks the delta, heads and level of detail encoders : random frames are sent through a
+ * socket pair (each one small enough for the socket buffer, as it is read after being sent),
+ * and decoded like a gui would, which must give them back.
+ */
+
+static const uint32_t sizes[][2] = {
+	{ 1, 1 }, { 3, 5 }, { 16, 2 }, { 17, 9 }, { 33, 31 }, { 100, 61 }
+};
+#define NB_SIZES (sizeof (sizes) / sizeof (sizes[0]))
+
+static const uint32_t densities[] = { 0, 2, 20, 60, 100 }; // percents of changed or head cells
+#define NB_DENSITIES (sizeof (densities) / sizeof (densities[0]))
+
+static int server, client; // ends of the socket pair
+
+static const char * failure;
+
+/* Reads 'count' answer words, in host order */
+static void receive (wireworld_message_t * words, uint32_t count) {
+	size_t size = count * sizeof (wireworld_message_t), done = 0;
+	while (done < size) {
+		ssize_t n = recv (client, (char *) words + done, size - done, 0);
+		if (n <= 0) {
+			perror ("recv");
+			exit (EXIT_FAILURE);
+		}
+		done += n;
+	}
+	uint32_t i;
+	for (i = 0; i < count; ++i)
+		words[i] = ntohl (words[i]);
+}
+
+static wireworld_message_t receive_word (void) {
+	wireworld_message_t word;
+	receive (&word, 1);
+	return word;
+}
+
+/* Ends the frame, and checks the A_FRAME_END after the update */
+static void end_frame (void) {
+	if (connectionSendFrameEnd (server) != 0) {
+		fprintf (stderr, "Unable to send the frame\n");
+		exit (EXIT_FAILURE);
+	}
+}
+
+static void check_frame_end (void) {
+	if (failure == NULL && receive_word () != A_FRAME_END)
+		failure = "frame end";
+}
+
+/* Fills a bordered map with random cells, 'heads' percents of them being heads */
+static void random_map (char * map, uint32_t xsize, uint32_t ysize, uint32_t heads) {
+	uint32_t x, y;
+	memset (map, C_INSULATOR, (size_t) (xsize + 2) * (ysize + 2));
+	for (y = 1; y < ysize + 1; ++y)
+		for (x = 1; x < xsize + 1; ++x)
+			map[x + y * (xsize + 2)] = (uint32_t) rand () % 100 < heads ? C_HEAD :
+				rand () % 3 == 0 ? C_INSULATOR : rand () % 2 ? C_WIRE : C_TAIL;
+}
+
+static void check_delta (uint32_t xsize, uint32_t ysize, uint32_t density) {
+	uint32_t size = wireworldFrameMessageSize (xsize, ysize), i;
+	wireworld_message_t * previous = malloc (size * sizeof (wireworld_message_t));
+	wireworld_message_t * frame = malloc (size * sizeof (wireworld_message_t));
+	wireworld_message_t * decoded = malloc (size * sizeof (wireworld_message_t));
+
+	// Words change in bursts, so that runs have gaps of every length
+	for (i = 0; i < size; ++i) {
+		previous[i] = (wireworld_message_t) rand () << 16 ^ rand ();
+		frame[i] = previous[i];
+		if ((uint32_t) rand () % 100 < density)
+			frame[i] ^= 1u << (rand () % M_BIT_SIZE);
+	}
+	frame[size - 1] = previous[size - 1] = 0; // no cell, or padding bits
+	memcpy (decoded, previous, size * sizeof (wireworld_message_t));
+
+	connectionSendDeltaUpdate (server, frame, previous, size);
+	end_frame ();
+
+	wireworld_message_t header[2];
+	receive (header, 2);
+	if (header[0] != A_DELTA_UPDATE || header[1] > size + 2) {
+		failure = "delta header";
+	} else {
+		wireworld_message_t * runs = malloc ((header[1] + 1) * sizeof (wireworld_message_t));
+		uint64_t p = 0, index = 0;
+		receive (runs, header[1]);
+		while (p < header[1] && failure == NULL) {
+			// Runs are not empty, and do not end with unchanged words
+			uint64_t count = p + 1 < header[1] ? runs[p + 1] : 0;
+			index += runs[p];
+			p += 2;
+			if (count == 0 || p + count > header[1] || index + count > size ||
+					runs[p + count - 1] == 0) {
+				failure = "delta run";
+				break;
+			}
+			for (i = 0; i < count; ++i)
+				decoded[index + i] ^= runs[p + i];
+			index += count;
+			p += count;
+		}
+		if (failure == NULL && memcmp (decoded, frame, size * sizeof (wireworld_message_t)) != 0)
+			failure = "delta frame";
+		free (runs);
+	}
+	check_frame_end ();
+
+	free (previous);
+	free (frame);
+	free (decoded);
+}
+
+static void check_heads (uint32_t xsize, uint32_t ysize, uint32_t density) {
+	char * map = malloc ((size_t) (xsize + 2) * (ysize + 2));
+	uint32_t bitmapSize = (uint64_t) xsize * ysize / M_BIT_SIZE + 1, nbHeads = 0, x, y;
+	random_map (map, xsize, ysize, density);
+	for (y = 1; y < ysize + 1; ++y)
+		for (x = 1; x < xsize + 1; ++x)
+			nbHeads += map[x + y * (xsize + 2)] == C_HEAD;
+
+	connectionSendHeadsUpdate (server, map, xsize + 2, ysize + 2, 1, 1, xsize + 1, ysize + 1);
+	end_frame ();
+
+	// The smallest format is used
+	wireworld_message_t header[3];
+	receive (header, 3);
+	uint32_t format = nbHeads <= bitmapSize ? H_LIST : H_BITMAP;
+	uint32_t size = format == H_LIST ? nbHeads : bitmapSize;
+	if (header[0] != A_HEADS_UPDATE || header[1] != format || header[2] != size) {
+		failure = "heads header";
+	} else {
+		wireworld_message_t * heads = malloc ((size + 1) * sizeof (wireworld_message_t));
+		uint32_t n = 0;
+		receive (heads, size);
+		for (y = 0; y < ysize && failure == NULL; ++y)
+			for (x = 0; x < xsize; ++x) {
+				uint32_t index = x + y * xsize;
+				int head = map[x + 1 + (y + 1) * (xsize + 2)] == C_HEAD;
+				int sent = format == H_BITMAP ? (heads[index / M_BIT_SIZE] >> (index % M_BIT_SIZE)) & 1 :
+					n < size && heads[n] == index;
+				if (head != sent) {
+					failure = "heads";
+					break;
+				}
+				if (format == H_LIST && sent)
+					n++;
+			}
+		free (heads);
+	}
+	check_frame_end ();
+	free (map);
+}
+
+/* Most visible cell of a block : head, then tail, then wire */
+static char reference_block (const char * map, uint32_t xsize, uint32_t ysize, uint32_t level,
+		uint32_t bx, uint32_t by) {
+	static const int rank[4] = { 0, 1, 3, 2 }; // of C_INSULATOR, C_WIRE, C_HEAD, C_TAIL
+	char best = C_INSULATOR;
+	uint64_t x, y;
+	for (y = (uint64_t) by << level; y < ((uint64_t) by + 1) << level && y < ysize; ++y)
+		for (x = (uint64_t) bx << level; x < ((uint64_t) bx + 1) << level && x < xsize; ++x) {
+			char state = map[x + 1 + (y + 1) * (xsize + 2)];
+			if (rank[(int) state] > rank[(int) best])
+				best = state;
+		}
+	return best;
+}
+
+static void check_lod (uint32_t xsize, uint32_t ysize, uint32_t density, uint32_t level) {
+	char * map = malloc ((size_t) (xsize + 2) * (ysize + 2));
+	random_map (map, xsize, ysize, density);
+
+	// Random rectangle of the blocks of the map
+	uint32_t nbx = ((xsize - 1) >> level) + 1, nby = ((ysize - 1) >> level) + 1;
+	uint32_t x1 = rand () % nbx, y1 = rand () % nby;
+	uint32_t x2 = x1 + 1 + rand () % (nbx - x1), y2 = y1 + 1 + rand () % (nby - y1);
+	connectionSendLodUpdate (server, map, xsize, ysize, level, x1, y1, x2, y2);
+	end_frame ();
+
+	wireworld_message_t header[6];
+	receive (header, 6);
+	if (header[0] != A_LOD_UPDATE || header[1] != level || header[2] != x1 || header[3] != y1 ||
+			header[4] != x2 || header[5] != y2) {
+		failure = "lod header";
+	} else {
+		uint32_t size = wireworldFrameMessageSize (x2 - x1, y2 - y1), x, y;
+		wireworld_message_t * blocks = malloc (size * sizeof (wireworld_message_t));
+		receive (blocks, size);
+		for (y = y1; y < y2 && failure == NULL; ++y)
+			for (x = x1; x < x2; ++x) {
+				uint32_t index = (x - x1) + (y - y1) * (x2 - x1);
+				char sent = (blocks[index / (M_BIT_SIZE / C_BIT_SIZE)] >>
+						(C_BIT_SIZE * (index % (M_BIT_SIZE / C_BIT_SIZE)))) & C_BIT_MASK;
+				if (sent != reference_block (map, xsize, ysize, level, x, y)) {
+					failure = "lod blocks";
+					break;
+				}
+			}
+		free (blocks);
+	}
+	check_frame_end ();
+	free (map);
+}
+
+int main (void) {
+	int fds[2];
+	uint32_t i, d, level, nbChecks = 0, nbFailed = 0;
+
+	if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+		perror ("socketpair");
+		return EXIT_FAILURE;
+	}
+	server = fds[0];
+	client = fds[1];
+
+	srand (1);
+	for (i = 0; i < NB_SIZES; ++i)
+		for (d = 0; d < NB_DENSITIES; ++d)
+			for (level = 0; level <= 5; ++level) {
+				uint32_t xsize = sizes[i][0], ysize = sizes[i][1];
+				failure = NULL;
+				if (level == 0) {
+					check_delta (xsize, ysize, densities[d]);
+					if (failure == NULL)
+						check_heads (xsize, ysize, densities[d]);
+				} else {
+					check_lod (xsize, ysize, densities[d], level);
+				}
+				nbChecks++;
+				if (failure != NULL) {
+					// The stream is out of sync : stop there
+					fprintf (stderr, "%ux%u map, %u%% density, level %u : wrong %s\n",
+							xsize, ysize, densities[d], level, failure);
+					nbFailed++;
+					goto end;
+				}
+			}
+
+end:
+	connectionRelease (server);
+	close (server);
+	close (client);
+	printf ("encoders : %u checks, %u failed\n", nbChecks, nbFailed);
+	return nbFailed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
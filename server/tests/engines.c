@@ -0,0 +1,136 @@
+#include "../engine.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../protocol/protocol.h"
+
+/* Checks every engine (alone, and wrapped by the cycle detection if it can hash its state)
+ * against update_map : random maps of odd sizes and of sizes around the word widths are stepped
+ * by several numbers of generations, and after each step the export, the packed frame, the
+ * hash and the activity of the engine must match the reference.
+ */
+
+static const uint32_t sizes[][2] = {
+	{ 1, 1 }, { 3, 5 }, { 17, 9 }, { 31, 64 }, { 64, 3 }, { 65, 33 }, { 129, 70 }, { 200, 1 }
+};
+#define NB_SIZES (sizeof (sizes) / sizeof (sizes[0]))
+
+static const uint32_t generations[] = { 1, 2, 5, 13 };
+#define NB_GENERATIONS (sizeof (generations) / sizeof (generations[0]))
+
+#define NB_STEPS 40 // per run, enough for small maps to reach their cycle
+#define CYCLE_MEMORY (16u << 20)
+
+static const engine_ops_t * engines[] = {
+	&charEngine, &bitsliceEngine, &tiledEngine, &frontierEngine, &packedEngine, &graphEngine,
+	&hashlifeEngine, &stripsEngine, &autoEngine
+};
+#define NB_ENGINES (sizeof (engines) / sizeof (engines[0]))
+
+/* Fills the cells of a bordered map : mostly conductors, some of them heads and tails */
+static void random_map (char * map, uint32_t xsize, uint32_t ysize) {
+	uint32_t x, y;
+	for (y = 1; y < ysize + 1; ++y)
+		for (x = 1; x < xsize + 1; ++x) {
+			int r = rand () % 100;
+			map[x + y * (xsize + 2)] = r < 35 ? C_INSULATOR : r < 85 ? C_WIRE : r < 93 ? C_HEAD : C_TAIL;
+		}
+}
+
+static uint64_t count_active (const char * map, uint32_t xsize, uint32_t ysize) {
+	size_t i, size = engineMapCells (xsize, ysize);
+	uint64_t count = 0;
+	for (i = 0; i < size; ++i)
+		count += map[i] == C_HEAD || map[i] == C_TAIL;
+	return count;
+}
+
+/* Returns 0 if the engine matches the reference, -1 otherwise (after printing the difference) */
+static int check_run (const engine_ops_t * ops, int cycle, uint32_t xsize, uint32_t ysize,
+		uint32_t stepSize) {
+	engine_params_t params = { 3, 3 };
+	char * maps[2] = { engineAllocMap (xsize, ysize), engineAllocMap (xsize, ysize) };
+	char * scratch = engineAllocMap (xsize, ysize);
+	uint32_t frameSize = wireworldFrameMessageSize (xsize, ysize);
+	wireworld_message_t * frame = malloc (frameSize * sizeof (wireworld_message_t));
+	wireworld_message_t * expected = malloc (frameSize * sizeof (wireworld_message_t));
+	int dir = 0, res = -1;
+	const char * what = NULL;
+	uint32_t s, g;
+
+	random_map (maps[0], xsize, ysize);
+	memcpy (maps[1], maps[0], engineMapCells (xsize, ysize));
+	engine_t * engine = engineCreate (ops, maps[0], xsize, ysize, &params);
+	if (engine == NULL) {
+		what = "creation";
+		s = 0;
+		goto end;
+	}
+	if (cycle)
+		engine = cycleEngineCreate (engine, CYCLE_MEMORY);
+
+	for (s = 1; s <= NB_STEPS; ++s) {
+		if (engineStep (engine, stepSize) != 0) {
+			what = "step";
+			goto end;
+		}
+		for (g = 0; g < stepSize; ++g)
+			update_map (&dir, maps, xsize, ysize);
+		const char * reference = maps[dir];
+
+		const char * map = engineExport (engine, scratch);
+		if (map == NULL || memcmp (map, reference, engineMapCells (xsize, ysize)) != 0) {
+			what = "export";
+			goto end;
+		}
+		enginePackMap (reference, xsize, ysize, expected);
+		if (enginePack (engine, frame, scratch) != 0 ||
+				memcmp (frame, expected, frameSize * sizeof (wireworld_message_t)) != 0) {
+			what = "packed frame";
+			goto end;
+		}
+		if (engineHash (engine, scratch) != engineHashMap (reference, xsize, ysize)) {
+			what = "hash";
+			goto end;
+		}
+		if (engine->ops->activity != NULL &&
+				engine->ops->activity (engine) != count_active (reference, xsize, ysize)) {
+			what = "activity";
+			goto end;
+		}
+	}
+	res = 0;
+
+end:
+	if (res != 0)
+		fprintf (stderr, "%s%s : %ux%u map, %u generations per step, step %u : wrong %s\n",
+				cycle ? "cycle/" : "", ops->name, xsize, ysize, stepSize, s, what);
+	if (engine != NULL)
+		engineDestroy (engine);
+	free (maps[0]);
+	free (maps[1]);
+	free (scratch);
+	free (frame);
+	free (expected);
+	return res;
+}
+
+int main (void) {
+	uint32_t e, i, g, nbRuns = 0, nbFailed = 0;
+	int cycle;
+
+	srand (1);
+	for (e = 0; e < NB_ENGINES; ++e)
+		for (cycle = 0; cycle <= (engines[e]->hash != NULL); ++cycle)
+			for (i = 0; i < NB_SIZES; ++i)
+				for (g = 0; g < NB_GENERATIONS; ++g) {
+					nbRuns++;
+					if (check_run (engines[e], cycle, sizes[i][0], sizes[i][1], generations[g]) != 0)
+						nbFailed++;
+				}
+
+	printf ("engines : %u runs, %u failed\n", nbRuns, nbFailed);
+	return nbFailed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,259 @@
+#include "engine.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../protocol/protocol.h"
+
+/* Multithreaded tiled engine.
+ *
+ * The char double buffer is cut in tiles small enough for both buffers to stay in cache.
+ * Tiles without any conductor never change, and are dropped once and for all at creation.
+ * The remaining tiles are shared evenly between the workers, each owning a contiguous
+ * range of tiles (spatial locality). A worker which has finished its own range steals tiles
+ * from the ranges of the others, so dense and empty areas of the map do not leave cores idle.
+ *
+ * The calling thread is worker 0. A step of n generations costs one barrier to start the
+ * workers, then one barrier at the end of each generation.
+ */
+
+#define TILE_W 256
+#define TILE_H 32
+
+typedef struct {
+	uint32_t x0, y0, x1, y1; // in bordered map coordinates, [x0, x1) * [y0, y1)
+} tile_t;
+
+/* Range of tiles of a worker.
+ * There is a counter per generation parity : the one of the next generation is reset
+ * by its owner during the current one, when nobody can use it.
+ * Aligned to avoid false sharing between workers.
+ */
+typedef struct {
+	atomic_uint next[2];
+	uint32_t begin, end;
+} __attribute__ ((aligned (64))) tile_range_t;
+
+typedef struct tiled_engine tiled_engine_t;
+
+typedef struct {
+	tiled_engine_t * engine;
+	uint32_t id;
+	pthread_t thread;
+} worker_t;
+
+struct tiled_engine {
+	engine_t base;
+	char * maps[2];
+	int dir;
+
+	tile_t * tiles;
+	uint32_t nbTiles;
+
+	uint32_t nbWorkers;
+	worker_t * workers;
+	tile_range_t * ranges;
+	pthread_barrier_t barrier;
+
+	// Job description, written by worker 0 before the start barrier
+	uint32_t generations;
+	int quit;
+};
+
+static void * worker_main (void * arg);
+static void run_generations (tiled_engine_t * e, uint32_t id);
+static void update_tile (const char * fromMap, char * toMap, uint32_t stride, const tile_t * tile);
+
+static engine_t * tiled_create (const char * borderedMap, uint32_t xsize, uint32_t ysize,
+		const engine_params_t * params) {
+	tiled_engine_t * e = malloc (sizeof (tiled_engine_t));
+	assert (e != NULL);
+
+	size_t size = engineMapCells (xsize, ysize) * sizeof (char);
+	e->maps[0] = engineAllocMap (xsize, ysize);
+	e->maps[1] = engineAllocMap (xsize, ysize);
+	memcpy (e->maps[0], borderedMap, size);
+	memcpy (e->maps[1], borderedMap, size); // Static cells are never written
+	e->dir = 0;
+
+	// Cut in tiles, and keep the ones with conductors
+	uint32_t ntx = (xsize + TILE_W - 1) / TILE_W;
+	uint32_t nty = (ysize + TILE_H - 1) / TILE_H;
+	e->tiles = malloc (ntx * nty * sizeof (tile_t));
+	assert (e->tiles != NULL);
+	e->nbTiles = 0;
+
+	uint32_t tx, ty, x, y;
+	for (ty = 0; ty < nty; ++ty)
+		for (tx = 0; tx < ntx; ++tx) {
+			tile_t t;
+			t.x0 = 1 + tx * TILE_W;
+			t.y0 = 1 + ty * TILE_H;
+			t.x1 = t.x0 + TILE_W < xsize + 1 ? t.x0 + TILE_W : xsize + 1;
+			t.y1 = t.y0 + TILE_H < ysize + 1 ? t.y0 + TILE_H : ysize + 1;
+
+			int hasConductor = 0;
+			for (y = t.y0; y < t.y1 && !hasConductor; ++y)
+				for (x = t.x0; x < t.x1; ++x)
+					if (borderedMap[x + y * (xsize + 2)] != C_INSULATOR) {
+						hasConductor = 1;
+						break;
+					}
+			if (hasConductor)
+				e->tiles[e->nbTiles++] = t;
+		}
+
+	// Workers
+	e->nbWorkers = params->threads;
+	if (e->nbWorkers == 0) {
+		long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+		e->nbWorkers = cpus > 0 ? cpus : 1;
+	}
+
+	e->ranges = aligned_alloc (sizeof (tile_range_t), e->nbWorkers * sizeof (tile_range_t));
+	assert (e->ranges != NULL);
+	uint32_t i;
+	for (i = 0; i < e->nbWorkers; ++i) {
+		e->ranges[i].begin = (uint64_t) e->nbTiles * i / e->nbWorkers;
+		e->ranges[i].end = (uint64_t) e->nbTiles * (i + 1) / e->nbWorkers;
+	}
+
+	pthread_barrier_init (&e->barrier, NULL, e->nbWorkers);
+	e->quit = 0;
+	e->generations = 0;
+
+	e->workers = malloc (e->nbWorkers * sizeof (worker_t));
+	assert (e->workers != NULL);
+	for (i = 0; i < e->nbWorkers; ++i) {
+		e->workers[i].engine = e;
+		e->workers[i].id = i;
+		if (i > 0 && pthread_create (&e->workers[i].thread, NULL, worker_main, &e->workers[i]) != 0) {
+			perror ("pthread_create");
+			abort ();
+		}
+	}
+	return &e->base;
+}
+
+static int tiled_step (engine_t * engine, uint32_t generations) {
+	tiled_engine_t * e = (tiled_engine_t *) engine;
+	if (generations == 0)
+		return 0;
+
+	// Workers are all waiting on the start barrier, so the counters can be reset
+	uint32_t i;
+	for (i = 0; i < e->nbWorkers; ++i) {
+		atomic_store (&e->ranges[i].next[0], e->ranges[i].begin);
+		atomic_store (&e->ranges[i].next[1], e->ranges[i].begin);
+	}
+	e->generations = generations;
+
+	pthread_barrier_wait (&e->barrier);
+	run_generations (e, 0);
+
+	e->dir = (e->dir + generations) % 2;
+	return 0;
+}
+
+static char * tiled_export (engine_t * engine, char * scratch) {
+	(void) scratch;
+	tiled_engine_t * e = (tiled_engine_t *) engine;
+	return e->maps[e->dir];
+}
+
+static void tiled_destroy (engine_t * engine) {
+	tiled_engine_t * e = (tiled_engine_t *) engine;
+
+	e->quit = 1;
+	pthread_barrier_wait (&e->barrier);
+
+	uint32_t i;
+	for (i = 1; i < e->nbWorkers; ++i)
+		pthread_join (e->workers[i].thread, NULL);
+	pthread_barrier_destroy (&e->barrier);
+
+	free (e->workers);
+	free (e->ranges);
+	free (e->tiles);
+	free (e->maps[0]);
+	free (e->maps[1]);
+	free (e);
+}
+
+const engine_ops_t tiledEngine = {
+	"tiled", tiled_create, tiled_step, tiled_export, NULL, NULL, NULL, tiled_destroy
+};
+
+/* Workers */
+
+static void * worker_main (void * arg) {
+	worker_t * w = arg;
+	tiled_engine_t * e = w->engine;
+	while (1) {
+		pthread_barrier_wait (&e->barrier);
+		if (e->quit)
+			break;
+		run_generations (e, w->id);
+	}
+	return NULL;
+}
+
+static void run_generations (tiled_engine_t * e, uint32_t id) {
+	uint32_t stride = e->base.xsize + 2;
+	uint32_t g, i;
+
+	// Copy the job : worker 0 may start writing the next one after the last barrier
+	uint32_t generations = e->generations;
+	int dir = e->dir;
+
+	for (g = 0; g < generations; ++g) {
+		int parity = g % 2;
+		const char * fromMap = e->maps[(dir + g) % 2];
+		char * toMap = e->maps[(dir + g + 1) % 2];
+
+		// Prepare own counter for the next generation
+		atomic_store (&e->ranges[id].next[1 - parity], e->ranges[id].begin);
+
+		// Own range first, then steal from the others
+		for (i = 0; i < e->nbWorkers; ++i) {
+			tile_range_t * range = &e->ranges[(id + i) % e->nbWorkers];
+			uint32_t t;
+			while ((t = atomic_fetch_add (&range->next[parity], 1)) < range->end)
+				update_tile (fromMap, toMap, stride, &e->tiles[t]);
+		}
+
+		pthread_barrier_wait (&e->barrier);
+	}
+}
+
+/* Same rules as update_map, restricted to a tile, in row order.
+ */
+static void update_tile (const char * fromMap, char * toMap, uint32_t stride, const tile_t * tile) {
+	uint32_t i, j;
+	for (j = tile->y0; j < tile->y1; ++j) {
+		const char * up = &fromMap[(j - 1) * stride];
+		const char * mid = &fromMap[j * stride];
+		const char * down = &fromMap[(j + 1) * stride];
+		char * out = &toMap[j * stride];
+
+		for (i = tile->x0; i < tile->x1; ++i) {
+			char state = mid[i];
+			if (state == C_WIRE) {
+				int nbHeads =
+					(up[i - 1] == C_HEAD) + (up[i] == C_HEAD) + (up[i + 1] == C_HEAD) +
+					(mid[i - 1] == C_HEAD) + (mid[i + 1] == C_HEAD) +
+					(down[i - 1] == C_HEAD) + (down[i] == C_HEAD) + (down[i + 1] == C_HEAD);
+				out[i] = (nbHeads == 1 || nbHeads == 2) ? C_HEAD : C_WIRE;
+			} else if (state == C_HEAD) {
+				out[i] = C_TAIL;
+			} else if (state == C_TAIL) {
+				out[i] = C_WIRE;
+			}
+			// Insulators never change, and are already set in both buffers
+		}
+	}
+}